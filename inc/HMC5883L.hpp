@@ -3,7 +3,11 @@
 #include <time.h>
 #include <unistd.h>
 #include <math.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
 #include <linux/i2c-dev.h> 
+#include <linux/i2c.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 
@@ -12,6 +16,10 @@
 
 #define HMC5883L_ADDRESS            0x1E // this device only has one address
 #define HMC5883L_DEFAULT_ADDRESS    (HMC5883L_ADDRESS<<1)
+#define HMC5883L_I2C_BUS_HZ         100000 // default Raspberry Pi I2C clock
+#define HMC5883L_I2C_RETRIES        3 // attempts after a failed transfer
+#define HMC5883L_I2C_BACKOFF_US     100 // first wait before retrying, doubles each retry
+#define HMC5883L_READ_ERROR         -1
 
 #define HMC5883L_RA_CONFIG_A        0x00
 #define HMC5883L_RA_CONFIG_B        0x01
@@ -73,6 +81,16 @@
 #define HMC5883L_STATUS_LOCK_BIT    1
 #define HMC5883L_STATUS_READY_BIT   0
 
+typedef struct HMC5883L_transfer_stats {
+    unsigned long nb_syscalls;
+    unsigned long bus_bits; // clock cycles the transfers take on the bus
+    double time; // spent in transfer syscalls, s
+    unsigned long nb_nak; // transfers failing with an error, NAK or bus error
+    unsigned long nb_short; // transfers cut short
+    unsigned long nb_retries;
+    unsigned long nb_failures; // transfers still failing after every retry
+} HMC5883L_transfer_stats;
+
 void HMC5883L_Initialize();
 bool HMC5883L_TestConnection();
 
@@ -94,6 +112,9 @@ void HMC5883L_SetMode(unsigned char mode);
 
 // DATA* registers
 double HMC5883L_GetHeading(short int* Mag);
+int HMC5883L_ReadRaw(short int* Mag);
+int HMC5883L_ReadStatusAndRaw(short int* Mag);
+double HMC5883L_HeadingFromRaw(short int* Mag);
 // STATUS register
 bool HMC5883L_GetLockStatus();
 bool HMC5883L_GetReadyStatus();
@@ -103,9 +124,18 @@ void HMC5883L_WriteBit(unsigned char slaveAddr, unsigned char regAddr, unsigned
 void HMC5883L_ReadBits(unsigned char slaveAddr, unsigned char regAddr , unsigned char bitStart, unsigned char length, unsigned char *data);
 void HMC5883L_ReadBit(unsigned char slaveAddr, unsigned char regAddr, unsigned char bitNum, unsigned char *data);
 
-void HMC5883L_I2C_Init();
-void HMC5883L_I2C_ByteWrite(unsigned char slaveAddr, unsigned char* pBuffer, unsigned char WriteAddr);
-void HMC5883L_I2C_BufferRead(unsigned char slaveAddr,unsigned char* pBuffer, unsigned char ReadAddr, unsigned int NumByteToRead);
+int HMC5883L_I2C_Init();
+int HMC5883L_I2C_RDWR(struct i2c_msg * msgs, int nb_msgs);
+int HMC5883L_I2C_Transfer(struct i2c_msg * msgs, int nb_msgs);
+int HMC5883L_I2C_ByteWrite(unsigned char slaveAddr, unsigned char* pBuffer, unsigned char WriteAddr);
+int HMC5883L_I2C_BufferRead(unsigned char slaveAddr,unsigned char* pBuffer, unsigned char ReadAddr, unsigned int NumByteToRead);
+
+int HMC5883L_DRDY_Init(int gpio);
+int HMC5883L_DRDY_Wait(int timeout_ms);
+HMC5883L_transfer_stats * HMC5883L_GetStats();
+void HMC5883L_ResetStats();
+void HMC5883L_UseFakeDevice();
+void HMC5883L_FakeFaults(unsigned int nak_percent, unsigned int short_percent);
 
 void init_compass();
 
@@ -0,0 +1,37 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "HMC5883L.hpp"
+#include "magnetometer.hpp"
+#include "pipeline.hpp"
+
+#define COMPASS_RATE 75 //Hz, fastest continuous output of the HMC5883L
+#define COMPASS_DRDY_TIMEOUT_MS 30 //about two measurement periods
+#define COMPASS_RETRY_US 1000 //wait before reading again when no measurement was ready
+#define COMPASS_MAX_RETRIES 3
+#define COMPASS_STALE_AGE 0.1 //s, a heading older than this is not used for control
+#define COMPASS_REINIT_FAILURES 5 //consecutive failed reads before the device is configured again
+#define COMPASS_CALIBRATION_TIME 15. //s of recording, long enough to turn the bot by hand
+
+#ifndef COMPASS_H
+#define COMPASS_H
+
+typedef struct compass_sample {
+	double timestamp; //monotonic time the data registers were read
+	double heading; //degrees, calibrated, filtered and unwrapped
+	double yaw_rate; //degrees/s
+	short mag[3]; //raw data registers
+	unsigned int count; //samples published so far, tells new samples apart
+} compass_sample;
+
+int start_compass_thread(int drdy_gpio, const char * calibration_path);
+void stop_compass_thread();
+int read_compass(compass_sample * sample);
+int compass_stale(compass_sample * sample);
+void print_compass_stats();
+int calibrate_compass(const char * path, double duration);
+int test_compass_calibration(int argc, char ** argv);
+#endif
@@ -13,6 +13,7 @@ using namespace cv;
 #ifndef DETECT_LINE_H
 #define DETECT_LINE_H
 #define POLY_LENGTH 4
+#define NB_LINES_SAMPLED 28 //maximum number of line points
 typedef struct curve {
 	float p[POLY_LENGTH];
 	float max_x;
@@ -25,7 +26,9 @@ typedef struct point {
 } point;
 
 
-float detect_line(Mat & img, curve * l, point * pts, int * nb_pts);
+float detect_line(Mat & img, curve * l, point * pts, int * nb_pts, int track);
 void init_line_detector() ;
+void line_detector_rows(unsigned char * row_mask, unsigned int h);
+void set_line_detector_seed(unsigned int seed);
 int detect_line_test(int argc, char ** argv) ;
 #endif
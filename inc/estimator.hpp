@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <Eigen/Dense>
+
+#include "pipeline.hpp"
+
+using namespace Eigen;
+
+//vehicle model, the same bicycle as the simulator
+#define EST_WHEELBASE 260.0 //mm
+#define EST_MAX_STEER_ANGLE 25.0 //wheel angle in degrees for a full servo command
+#define EST_MAX_SPEED 2500.0 //mm/s for a full esc command
+#define EST_SPEED_TAU 0.3 //s, esc to speed first order response
+#define EST_MAX_STEP 0.02 //s, longer predictions are split
+#define EST_HISTORY 64 //snapshots kept to fuse late measurements, about 0.2 s
+//process noise, standard deviation growth per square root of second
+#define EST_Q_POSITION 5.0 //mm
+#define EST_Q_HEADING 0.01 //rad
+#define EST_Q_SPEED 400.0 //mm/s, the esc response depends on the battery
+#define EST_Q_BIAS 0.005 //rad/s
+//initial uncertainty
+#define EST_INIT_HEADING 5.0 //degrees
+#define EST_INIT_SPEED 100.0 //mm/s
+#define EST_INIT_BIAS 0.1 //rad/s
+//measurement noise
+#define EST_R_COMPASS 3.0 //degrees
+#define EST_R_YAW_RATE 3.0 //degrees/s
+#define EST_R_VO_DISPLACEMENT 3.0 //mm per visual odometry frame
+#define EST_R_VO_YAW 0.5 //degrees per visual odometry frame
+#define EST_GATE 16.0 //squared normalized innovation beyond which a measurement is rejected
+#define EST_COMMAND_LOG 64 //steering commands kept to predict through the actuation delay, power of two
+
+#ifndef ESTIMATOR_H
+#define ESTIMATOR_H
+
+enum est_state {
+	EST_X, EST_Y, EST_HEADING, EST_SPEED, EST_BIAS, EST_NB_STATES
+};
+
+enum est_measurement_type {
+	EST_NONE, EST_MEASURE_HEADING, EST_MEASURE_YAW_RATE, EST_MEASURE_SPEED
+};
+
+//x is along compass heading 0 and y along heading 90, from the start position,
+//covariance is in mm, rad, mm/s and rad/s
+typedef struct estimate {
+	double timestamp;
+	double x, y; //mm
+	double heading; //degrees, unwrapped
+	double speed; //mm/s
+	double yaw_rate_bias; //degrees/s, turn rate the steering model misses
+	double covariance[EST_NB_STATES][EST_NB_STATES];
+} estimate;
+
+//steering commands as sent, the wheels follow them after the actuation delay
+typedef struct command_log {
+	double t[EST_COMMAND_LOG];
+	float steering[EST_COMMAND_LOG];
+	unsigned int count;
+} command_log;
+
+void init_estimator();
+int estimator_ready();
+void estimator_predict(double t);
+void estimator_command(double t, float steering, float esc_speed);
+void estimator_heading(double t, double heading);
+void estimator_yaw_rate(double t, double yaw_rate, double noise);
+void estimator_odometry(double t, double dt, float dx, float dy);
+int get_estimate(estimate * e);
+int get_estimate_at(double t, estimate * e);
+void extrapolate_estimate(estimate * e, double t, float steering);
+void init_command_log(command_log * log);
+void log_command(command_log * log, double t, float steering);
+void predict_motion(command_log * log, double delay, double start, double end,
+		double speed, double yaw_rate_bias, float * dx, float * dy, float * dyaw);
+void print_estimator_stats();
+int test_estimator(int argc, char ** argv);
+#endif
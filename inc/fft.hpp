@@ -0,0 +1,18 @@
+#include <math.h>
+#include <string.h>
+
+#define FFT_MAX_SIZE 128 //largest transform size, must be a power of two
+
+#ifndef FFT_H
+#define FFT_H
+
+typedef struct complexf {
+	float re;
+	float im;
+} complexf;
+
+void init_fft();
+void fft(complexf * data, unsigned int n, unsigned int stride, int inverse);
+void fft_2d(complexf * data, unsigned int rows, unsigned int cols,
+		int inverse);
+#endif
@@ -0,0 +1,28 @@
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/videoio/videoio.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "camera_parameters.h"
+#include "pipeline.hpp"
+#include "recording.hpp"
+#include "simulator.hpp"
+
+using namespace cv;
+
+#ifndef FRAME_SOURCE_H
+#define FRAME_SOURCE_H
+
+int init_frame_source_camera();
+int init_frame_source_file(char * path);
+int init_frame_source_replay(char * path, int realtime);
+int init_frame_source_simulator(char * track_path, double actuation_delay);
+void set_frame_source_rows(unsigned char * row_mask);
+int frame_source_read(frame_slot * slot);
+double frame_source_time();
+unsigned long frame_source_dropped();
+unsigned long frame_source_bytes();
+#endif
@@ -0,0 +1,38 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+extern "C" {
+#include "fast/fast.h"
+}
+
+#define KLT_PYRAMID_LEVELS 3
+#define KLT_HALF_WINDOW 4 //tracking window is (2*KLT_HALF_WINDOW+1) pixels wide
+#define KLT_MAX_ITERATIONS 10
+#define KLT_MAX_FEATURES 64
+#define KLT_MIN_FEATURES 32 //replenish features when fewer survive tracking
+#define KLT_FAST_THRESHOLD 40
+#define KLT_MIN_DISTANCE 10 //minimum distance in pixels between two tracked features
+#define KLT_FB_THRESHOLD 0.5 //maximum forward-backward error in pixels
+
+#ifndef KLT_TRACKER_H
+#define KLT_TRACKER_H
+
+typedef struct klt_track {
+	float x0; //position in keyframe
+	float y0;
+	float x1; //position in current frame
+	float y1;
+} klt_track;
+
+//predicts where a feature of the previous frame lies in the current frame
+typedef void (*klt_predictor)(float x, float y, float * px, float * py);
+
+void init_klt_tracker(unsigned int w, unsigned int h);
+void close_klt_tracker();
+void reset_klt_tracker();
+void klt_set_keyframe();
+int klt_track_features(unsigned char * img, unsigned int step,
+		klt_track * tracks, unsigned int max_tracks, klt_predictor predict);
+#endif
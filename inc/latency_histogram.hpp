@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include <string.h>
+
+//log-linear buckets as in HDR histograms : values below 2^LATENCY_SUB_BUCKET_BITS us
+//are exact, above that each power of two is split in 2^(LATENCY_SUB_BUCKET_BITS-1)
+//buckets, giving a relative precision better than 1.6%
+#define LATENCY_SUB_BUCKET_BITS 7
+#define LATENCY_MAX_BITS 21 //values are clamped to 2^21 us, about 2s
+#define LATENCY_NB_BUCKETS ((1 << LATENCY_SUB_BUCKET_BITS) \
+		+ (LATENCY_MAX_BITS - LATENCY_SUB_BUCKET_BITS) * (1 << (LATENCY_SUB_BUCKET_BITS - 1)))
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+//single writer, read by the same thread or once the writer is stopped
+typedef struct latency_histogram {
+	unsigned long counts[LATENCY_NB_BUCKETS];
+	unsigned long count;
+	unsigned long nb_deadline_miss;
+	unsigned long max_us;
+	unsigned long deadline_us;
+	double sum;
+} latency_histogram;
+
+void init_latency_histogram(latency_histogram * h, double deadline);
+int record_latency(latency_histogram * h, double latency);
+double latency_percentile(latency_histogram * h, double percentile);
+void merge_latency_histogram(latency_histogram * h, latency_histogram * from);
+void print_latency_histogram(const char * name, latency_histogram * h);
+#endif
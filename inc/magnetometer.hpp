@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <Eigen/Dense>
+
+using namespace Eigen;
+
+#define MAG_CALIBRATION_FILE "mag_calibration.txt"
+#define MAG_CALIBRATION_MIN_SAMPLES 200
+#define MAG_CALIBRATION_SECTORS 12 //30 degrees sectors, each must hold samples
+#define MAG_FLAT_RATIO 0.2 //z spread under this fraction of the x, y spread is a flat spin
+#define MAG_FIELD_TOLERANCE 0.25 //relative error of the corrected horizontal field
+								 //beyond which a sample is distorted (motor current, tilt)
+#define MAG_MAX_RESIDUAL 30.0 //degrees, larger jumps are rejected as outliers
+#define MAG_MAX_REJECTED 15 //consecutive rejections before the filter restarts on the measurement
+#define MAG_ALPHA 0.4 //heading gain of the alpha-beta filter
+#define MAG_BETA 0.1 //yaw rate gain, alpha^2/(2-alpha) for a critically damped response
+
+#ifndef MAGNETOMETER_H
+#define MAGNETOMETER_H
+
+//corrected = soft * (raw - offset), axes in x, y, z order
+typedef struct mag_calibration {
+	double offset[3]; //hard iron
+	double soft[3][3]; //soft iron, maps the fitted ellipsoid to a sphere
+	double field; //radius of that sphere, raw units
+	int valid;
+} mag_calibration;
+
+typedef struct mag_filter {
+	double heading; //degrees, unwrapped so that it does not jump at +-180
+	double yaw_rate; //degrees/s
+	double timestamp;
+	int initialized;
+	unsigned int nb_rejected; //consecutive rejected samples
+	unsigned long nb_samples, nb_outliers;
+} mag_filter;
+
+double wrap_heading(double angle);
+void init_mag_calibration(mag_calibration * cal);
+int fit_mag_calibration(short (*mag)[3], unsigned int nb_samples,
+		mag_calibration * cal);
+int save_mag_calibration(const char * path, mag_calibration * cal);
+int load_mag_calibration(const char * path, mag_calibration * cal);
+void correct_mag(mag_calibration * cal, short * mag, double * corrected);
+double mag_heading(double * corrected);
+void init_mag_filter(mag_filter * f);
+int update_mag_filter(mag_filter * f, mag_calibration * cal, short * mag,
+		double timestamp);
+#endif
@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <Eigen/Dense>
+
+#include "detect_line.hpp"
+#include "pipeline.hpp"
+
+using namespace Eigen;
+
+#define MPC_HORIZON 12 //steps predicted, wheel angles solved for
+#define MPC_STEP 0.04 //s, about the visible line at full speed over the horizon
+#define MPC_WHEELBASE 260.0 //mm
+#define MPC_MAX_STEER_ANGLE 25.0 //wheel angle in degrees for a full servo command
+#define MPC_MAX_STEER_RATE 300.0 //degrees/s the servo turns the wheels at
+#define MPC_MIN_SPEED 300.0 //mm/s, the model degenerates when stopped
+//cost weights, per mm^2 of lateral error and per rad^2 of the others
+#define MPC_Q_LATERAL 1.0
+#define MPC_Q_HEADING 10000.0
+#define MPC_R_CURVATURE 1000.0 //wheel angle away from the one following the curve
+#define MPC_R_RATE 20000.0 //wheel angle change between steps
+//solver, ADMM on the condensed problem
+#define MPC_RHO 0.1 //for the problem scaled to a unit diagonal
+#define MPC_SIGMA 1e-6
+#define MPC_ALPHA 1.6 //over-relaxation
+#define MPC_MAX_ITERATIONS 40 //hard cap, bounds the solve time
+#define MPC_TOLERANCE 1e-4 //rad, primal and dual residuals
+
+#ifndef MPC_H
+#define MPC_H
+
+typedef struct mpc_stats {
+	unsigned long nb_solves, nb_capped, iterations;
+	unsigned int max_iterations;
+	double time, time_max;
+} mpc_stats;
+
+//solver state kept for the warm start, owned by the thread steering with it
+typedef struct mpc_solver {
+	double x[MPC_HORIZON]; //wheel angles, rad
+	double y[2 * MPC_HORIZON]; //dual variables
+	double last_t;
+	int has_solution;
+	mpc_stats stats;
+} mpc_solver;
+
+void init_mpc(mpc_solver * s);
+float mpc_steering(mpc_solver * s, curve * c, float speed, float steering,
+		double t);
+void print_mpc_stats(mpc_solver * s);
+#endif
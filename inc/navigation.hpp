@@ -1,5 +1,42 @@
 
+#define PLAN_SAMPLES 24 //curvature samples from the bot to the end of the curve
+#define PLAN_MAX_SPEED 2500.0 //mm/s, full esc command
+#define PLAN_MIN_SPEED 300.0 //mm/s, the bot keeps moving in the tightest turns
+#define PLAN_MAX_LATERAL_ACC 3000.0 //mm/s^2, tyre grip in turns
+#define PLAN_MAX_ACC 1500.0 //mm/s^2
+#define PLAN_MAX_DEC 1500.0 //mm/s^2, the esc brakes slowly
+#define NAV_SCHEDULE_FILE "navigation_schedule.txt"
+#define NAV_SCHEDULE_MAX 8 //speed rows in the steering schedule
+#define NAV_LOOKAHEAD 150.0 //mm, unscheduled lookahead
+#define NAV_GAIN -0.20 //unscheduled servo command per 1/m of curvature
+
 #ifndef NAVIGATION_H
 #define NAVIGATION_H
+
+//speed profile along the curve, distances from the bot
+typedef struct speed_plan {
+	float s[PLAN_SAMPLES]; //mm
+	float curvature[PLAN_SAMPLES]; //1/mm
+	float v[PLAN_SAMPLES]; //mm/s
+	float command; //mm/s
+} speed_plan;
+
+//lookahead and steering gain interpolated on the speed, both scaled on curves
+//fitted with a low confidence
+typedef struct nav_schedule {
+	int nb_speeds;
+	float speed[NAV_SCHEDULE_MAX]; //mm/s, increasing
+	float lookahead[NAV_SCHEDULE_MAX]; //mm
+	float gain[NAV_SCHEDULE_MAX];
+	float low_confidence; //confidence at which the scales fully apply
+	float lookahead_scale, gain_scale; //fade to 1 at full confidence
+} nav_schedule;
+
 float steering_speed_from_curve(curve * c, float x_lookahead, float * y_lookahead, float * speed);
+void propagate_curve(curve * c, float dx, float dy, float dyaw, curve * moved);
+float plan_speed(curve * c, float speed, float horizon, speed_plan * plan);
+void init_nav_schedule(nav_schedule * s);
+int load_nav_schedule(const char * path, nav_schedule * s);
+void schedule_steering(nav_schedule * s, float speed, float confidence,
+		float * lookahead, float * gain);
 #endif
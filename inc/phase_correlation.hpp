@@ -0,0 +1,29 @@
+#include "opencv2/core/core.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "fft.hpp"
+#include "resampling.hpp"
+#include "camera_parameters.h"
+
+using namespace cv;
+
+#define PHASE_PATCH_SIZE 64 //bird's-eye patch is PHASE_PATCH_SIZE cells wide, power of two
+#define PHASE_CELL_MM 4.0 //ground size of a patch cell
+#define PHASE_PATCH_X_MM 150.0 //distance from the bot to the near edge of the patch
+#define PHASE_LOGPOLAR_ANGLES 128 //angular samples over half a turn of the spectrum
+#define PHASE_LOGPOLAR_RADII 32
+#define PHASE_MIN_CONFIDENCE 0.05 //phase correlation peak below which the estimate is rejected
+#define PHASE_MAX_ROTATION 20.0 //degrees, larger log-polar rotations are taken as outliers
+#define PHASE_KEYFRAME_MAX_MM 32.0 //rotation estimate degrades quickly with the distance to the keyframe
+
+#ifndef PHASE_CORRELATION_H
+#define PHASE_CORRELATION_H
+
+void init_phase_correlation();
+float phase_correlation_motion(Mat & img, float * tx, float * ty, float * yaw);
+void phase_set_keyframe();
+void reset_phase_correlation();
+void phase_correlation_rows(unsigned char * row_mask, unsigned int h);
+#endif
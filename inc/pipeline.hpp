@@ -0,0 +1,97 @@
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+
+using namespace cv;
+
+#define RING_SIZE 4 //power of two, a ring holds at most RING_SIZE-1 items
+#define PIPELINE_FRAMES 10 //frame buffers shared by the stages
+#define FRAME_MAX_AGE_PERIODS 1.5 //frames older than this when a stage starts are dropped
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+//single producer, single consumer lock-free ring of pointers
+typedef struct spsc_ring {
+	void * items[RING_SIZE];
+	unsigned int head; //only written by the producer
+	unsigned int tail; //only written by the consumer
+	int event_fd; //signaled on each push so that the consumer can sleep on empty
+	//occupancy counters, only written by the producer
+	unsigned long nb_push;
+	unsigned long nb_full;
+	unsigned long occupancy_sum;
+	unsigned int max_occupancy;
+} spsc_ring;
+
+typedef struct frame_slot {
+	Mat img; //grayscale frame, allocated once by the pool
+	unsigned int seq;
+	double timestamp; //capture time in seconds, monotonic clock
+	int refs; //number of stages still holding the frame
+} frame_slot;
+
+typedef struct frame_pool {
+	frame_slot slots[PIPELINE_FRAMES];
+	unsigned int next;
+	unsigned long nb_stall; //captures that found no free buffer
+} frame_pool;
+
+typedef struct stage_stats {
+	unsigned long nb_processed;
+	unsigned long nb_skipped; //stale inputs dropped for a fresher one
+	double busy_time;
+} stage_stats;
+
+//frames are due one period after capture, a stage drops frames that are already
+//too old and takes its fast path after a frame finished past its deadline
+enum frame_decision {
+	FRAME_PROCESS,
+	FRAME_DEGRADED,
+	FRAME_DROP
+};
+
+typedef struct frame_policy {
+	int enabled; //off, every frame is processed in full
+	int degraded_path; //run the fast path after an overrun
+	double deadline; //s after capture
+	double max_age; //s after capture
+	int overrun; //last frame finished after its deadline, written by the stage
+	unsigned long nb_dropped;
+	unsigned long nb_degraded;
+	unsigned long nb_overruns;
+} frame_policy;
+
+double monotonic_time();
+
+void init_ring(spsc_ring * ring);
+int ring_push(spsc_ring * ring, void * item);
+int ring_pop(spsc_ring * ring, void ** item);
+void ring_wait(spsc_ring * ring);
+unsigned int ring_occupancy(spsc_ring * ring);
+void seqlock_write(unsigned int * seq, void * shared, const void * value,
+		size_t size);
+unsigned int seqlock_read(unsigned int * seq, const void * shared, void * value,
+		size_t size);
+void print_ring_stats(const char * name, spsc_ring * ring);
+void print_stage_stats(const char * name, stage_stats * stats, double elapsed);
+
+void init_frame_policy(frame_policy * p, int enabled, int degraded_path,
+		double deadline, double max_age);
+int frame_policy_decide(frame_policy * p, double age);
+void frame_policy_done(frame_policy * p, double age);
+void print_frame_policy(const char * name, frame_policy * p);
+
+void init_frame_pool(frame_pool * pool, unsigned int w, unsigned int h);
+frame_slot * acquire_frame(frame_pool * pool, int nb_consumers);
+void release_frame(frame_slot * slot);
+unsigned long convert_rows_to_gray(Mat & color, Mat & gray,
+		unsigned char * row_mask);
+#endif
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <iostream>
+
+#include "pipeline.hpp"
+
+#define PROFILE_MAX_THREADS 8
+#define PROFILE_RING_SIZE 32768 //events kept per thread, power of two
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+//wall clock timing, replaces the clock() based macros that measured process CPU time
+#define tic      double tic_t = monotonic_time();
+#define toc      std::cout << (monotonic_time() - tic_t) \
+                           << " seconds" << std::endl;
+
+enum profile_stage {
+	PROFILE_GRAB,
+	PROFILE_LINE,
+	PROFILE_GRADIENT,
+	PROFILE_PROJECTION,
+	PROFILE_RANSAC,
+	PROFILE_TRACK,
+	PROFILE_ODOMETRY,
+	PROFILE_FAST,
+	PROFILE_BRIEF,
+	PROFILE_MATCH,
+	PROFILE_VOTE,
+	PROFILE_KLT,
+	PROFILE_PHASE,
+	PROFILE_CONTROL,
+	PROFILE_COMPASS,
+	PROFILE_ACTUATION,
+	PROFILE_NB_STAGES
+};
+
+typedef struct profile_event {
+	uint64_t start; //monotonic clock, ns
+	uint32_t duration; //ns
+	uint32_t stage;
+} profile_event;
+
+//events of one thread, only written by that thread
+typedef struct profile_ring {
+	profile_event events[PROFILE_RING_SIZE];
+	unsigned int head;
+	char name[16];
+} profile_ring;
+
+uint64_t profile_now();
+void profile_record(int stage, uint64_t start);
+void profile_thread(const char * name);
+void profile_report(const char * trace_path);
+
+//times the enclosing scope when built with -DPROFILE
+typedef struct profile_scope {
+	int stage;
+	uint64_t start;
+	profile_scope(int s) {
+		stage = s;
+		start = profile_now();
+	}
+	~profile_scope() {
+		profile_record(stage, start);
+	}
+} profile_scope;
+
+#ifdef PROFILE
+#define PROFILE_SCOPE(stage) profile_scope profile_scope_##stage(stage)
+#define PROFILE_THREAD(name) profile_thread(name)
+#else
+#define PROFILE_SCOPE(stage)
+#define PROFILE_THREAD(name)
+#endif
+
+#endif
@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "pipeline.hpp"
+#include "latency_histogram.hpp"
+
+//default profile for a 4 cores Pi : capture and control get their own core,
+//detectors share the last one, core 0 is left to the kernel, ssh, logging and
+//the short compass reads
+#define RT_CAPTURE_PRIORITY 80
+#define RT_CAPTURE_CPU 1
+#define RT_CONTROL_PRIORITY 70
+#define RT_CONTROL_CPU 2
+#define RT_LINE_PRIORITY 60
+#define RT_LINE_CPU 3
+#define RT_ODOMETRY_PRIORITY 50
+#define RT_ODOMETRY_CPU 3
+#define RT_STEERING_PRIORITY 75 //short periodic ticks, ahead of the frame rate control
+#define RT_STEERING_CPU 2
+#define RT_COMPASS_PRIORITY 85 //wakes briefly at the compass rate, keeps samples evenly spaced
+#define RT_COMPASS_CPU 0
+#define RT_STACK_PREFAULT (256*1024) //bytes of stack touched by each thread
+#define RT_PAGE_SIZE 4096
+#define RT_JITTER_PERIOD_US 1000
+#define RT_JITTER_SAMPLES 1000 //one second of wakeups
+
+#ifndef REALTIME_H
+#define REALTIME_H
+
+enum rt_role {
+	RT_CAPTURE,
+	RT_CONTROL,
+	RT_LINE,
+	RT_ODOMETRY,
+	RT_COMPASS,
+	RT_STEERING,
+	RT_NB_ROLES
+};
+
+int set_rt_profile(const char * spec);
+int rt_profile_enabled();
+void rt_prefault(void * ptr, size_t size);
+void rt_lock_memory();
+void rt_enter_thread(int role);
+void rt_jitter_probe();
+void print_rt_report();
+#endif
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "camera_parameters.h"
+#include "pipeline.hpp"
+
+#define RECORD_MAGIC "PLYREC"
+#define RECORD_VERSION 1
+#define RECORD_EVENT_RING 256 //control events waiting to be written, power of two
+#define RECORD_FRAME_RING 16 //frames waiting to be written, power of two, 5MB at 640x480
+#define RECORD_FLUSH_PERIOD_US 5000
+
+//entry types
+#define RECORD_FRAME 1 //Y plane, width*height bytes
+#define RECORD_COMPASS 2
+#define RECORD_POLE 3
+#define RECORD_COMMAND 4
+
+#ifndef RECORDING_H
+#define RECORDING_H
+
+//A recording is a header, entries appended in capture order, and an index written
+//when the recording is closed. Every entry starts with a record_entry, its payload
+//is padded to 8 bytes. A recording without index (interrupted run) is scanned.
+typedef struct record_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t fps;
+	uint64_t index_offset; //0 until the recording is closed
+	uint64_t nb_entries;
+} record_header;
+
+typedef struct record_entry {
+	uint32_t type;
+	uint32_t size; //payload bytes
+	uint32_t seq; //frame sequence number, control events carry the seq of the frame they were computed from
+	uint32_t reserved;
+	double timestamp;
+} record_entry;
+
+typedef struct record_index {
+	uint64_t offset; //of the record_entry
+	uint32_t type;
+	uint32_t seq;
+} record_index;
+
+typedef struct record_compass {
+	int16_t mag[3];
+	int16_t ready;
+	double heading;
+} record_compass;
+
+typedef struct record_command {
+	float steering;
+	float esc_speed;
+} record_command;
+
+int init_recording(const char * path, unsigned int w, unsigned int h);
+int is_recording();
+void record_frame(frame_slot * slot);
+void record_compass_sample(unsigned int seq, short * mag, int ready,
+		double heading);
+void record_pole(unsigned int seq, int level);
+void record_actuation(unsigned int seq, float steering, float esc_speed);
+void close_recording();
+
+int init_replay(const char * path, int realtime);
+int is_replaying();
+int replay_frame(frame_slot * slot);
+int replay_compass_sample(unsigned int seq, short * mag, double * heading);
+int replay_pole(unsigned int seq, int * level);
+void replay_actuation(unsigned int seq, float steering, float esc_speed);
+void print_replay_stats();
+#endif
@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "camera_parameters.h"
+#include "resampling.hpp"
+#include "pipeline.hpp"
+
+#define SIM_WHEELBASE 260.0 //mm
+#define SIM_MAX_STEER_ANGLE 25.0 //wheel angle in degrees for a full servo command
+#define SIM_MAX_SPEED 2500.0 //mm/s for a full esc command, MAX_ESC is 40% throttle
+#define SIM_SPEED_TAU 0.3 //s, esc to speed first order response
+#define SIM_SUBSTEPS 8 //physics steps per frame, faster than the steering loop
+#define SIM_LINE_WIDTH 25.0 //mm
+#define SIM_GRID_MM 4.0 //resolution of the rendered ground
+#define SIM_MARGIN_MM 2000.0 //ground rendered around the track
+#define SIM_MAX_VIEW_MM 6000.0 //pixels looking further are above the horizon
+#define SIM_GROUND_LEVEL 30
+#define SIM_LINE_LEVEL 220
+#define SIM_TEXTURE_LEVEL 140 //sparse bright speckles, give corners to visual odometry
+#define SIM_OFF_TRACK_MM 300.0
+#define SIM_NORTH_DEG 90.0 //compass heading of the track x axis
+#define SIM_LAPS 2
+#define SIM_MAX_TIME 300.0 //s
+#define SIM_DEFAULT_DELAY 0.040 //s from capture to the wheels responding
+#define SIM_COMMAND_QUEUE 64 //power of two
+//default track : two straights joined by half circles
+#define SIM_OVAL_STRAIGHT 4000.0
+#define SIM_OVAL_RADIUS 1500.0
+
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
+int init_simulator(const char * track_path, double actuation_delay);
+int is_simulating();
+int sim_read_frame(frame_slot * slot, unsigned char * row_mask);
+void sim_actuate(float steering, float esc_speed);
+void sim_set_tick(void (*tick)(double t), double rate);
+void sim_set_esc_gain(double gain);
+double sim_heading();
+void sim_score_estimate(double x, double y, double heading, double speed);
+void print_simulator_report();
+#endif
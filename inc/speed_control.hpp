@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#define SPEED_FF_SPEED 2500.0 //mm/s for a full esc command on a charged battery
+#define SPEED_ESC_TAU 0.3 //s, esc to speed first order response, led by the feed forward
+#define SPEED_MAX_ACC 1500.0 //mm/s^2, the reference follows the target no faster, as the planner
+#define SPEED_MAX_DEC 1500.0 //mm/s^2
+#define SPEED_KP 0.0001 //esc command per mm/s of error
+#define SPEED_KI 0.0006 //esc command per mm of accumulated error, the esc lags by 0.3 s
+#define SPEED_MAX_AGE 0.2 //s, older speed measurements are a dropout
+#define SPEED_DROPOUT_DECAY 2.0 //s, the integral fades with this time constant in a dropout
+#define SPEED_MAX_DT 0.1 //s, longer gaps between updates are not integrated
+
+#ifndef SPEED_CONTROL_H
+#define SPEED_CONTROL_H
+
+//PI on the ground speed around the feed forward of the nominal esc response, the
+//integral holds what the battery and the grip take away
+typedef struct speed_controller {
+	double integral; //esc command
+	double timestamp; //last update
+	float target, measured; //mm/s
+	float reference; //mm/s, the target rate limited, tracked by the esc
+	float command; //esc, 0 to 1
+	int dropout; //no measurement, feed forward and the held integral only
+	int open_loop; //measurements are only scored, the command is the feed forward
+	unsigned long nb_updates, nb_dropouts, nb_saturated;
+	double error_square_sum;
+} speed_controller;
+
+void init_speed_controller(speed_controller * s);
+float update_speed_controller(speed_controller * s, double t, float target,
+		float measured, int valid);
+void print_speed_controller_stats(speed_controller * s);
+#endif
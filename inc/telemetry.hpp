@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+
+#define TELEMETRY_RING_SIZE 4096 //records, power of two, about a minute at 60Hz
+#define TELEMETRY_CHUNK_SIZE 65536 //bytes written at once, multiple of TELEMETRY_ALIGN
+#define TELEMETRY_ALIGN 4096 //buffer, offset and size alignment for O_DIRECT
+#define TELEMETRY_FLUSH_PERIOD_US 20000
+#define TELEMETRY_MAGIC "PLYTLM"
+#define TELEMETRY_VERSION 5
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+//one record per control step, fixed size so that logs can be decoded offline
+typedef struct telemetry_record {
+	double timestamp; //capture time of the frame the command is computed from
+	unsigned int seq;
+	int speed_pop;
+	float curve[3];
+	float min_x;
+	float max_x;
+	float confidence;
+	float speed_x; //ground speed in mm/s
+	float speed_y;
+	float heading;
+	float steering; //command sent to the servo, 0 when not updated
+	float esc_speed;
+	float latency; //age of the frame when the servo was commanded, s
+	float latency_p99; //over every command sent so far, refreshed each second
+	unsigned int deadline_misses; //commands sent more than a frame period after capture
+	unsigned int frames_dropped; //stale frames dropped by the stages so far
+	unsigned int frames_degraded; //frames that went through the fast path so far
+	float est_x; //fused pose and speed, mm from the start position
+	float est_y;
+	float est_heading; //degrees
+	float est_speed; //mm/s
+	float est_position_std; //mm
+	float target_speed; //mm/s, from the speed planner
+	float measured_speed; //mm/s, tracked by the esc speed control, 0 in a dropout
+	unsigned int flags;
+} telemetry_record;
+
+#define TELEMETRY_COMMAND_UPDATED 0x1
+#define TELEMETRY_DEADLINE_MISS 0x2
+#define TELEMETRY_DEGRADED 0x4 //line from the tracking only fast path
+#define TELEMETRY_HEADING_STALE 0x8 //no compass sample for COMPASS_STALE_AGE
+#define TELEMETRY_SPEED_DROPOUT 0x10 //no speed measurement for SPEED_MAX_AGE
+
+typedef struct telemetry_header {
+	char magic[8];
+	unsigned int version;
+	unsigned int record_size;
+	double start_time; //clock when the log was opened, not the time base of the records
+} telemetry_header;
+
+int init_telemetry(const char * path);
+void telemetry_log(telemetry_record * record);
+void close_telemetry();
+void print_telemetry_stats();
+int telemetry_to_csv(const char * path, FILE * out);
+#endif
@@ -6,6 +6,8 @@
 
 #include "resampling.hpp"
 #include "camera_parameters.h"
+#include "klt_tracker.hpp"
+#include "phase_correlation.hpp"
 
 extern "C" {
 #include "fast/fast.h"
@@ -18,6 +20,14 @@ using namespace std;
 #define DESCRIPTOR_LENGTH 256 //Need to test different length and threshold
 #define DESCRIPTOR_MATCH_THRESHOLD 56
 #define STACK_SIZE 50
+#define VO_MATCH_RADIUS 32 //pixel distance between a keyframe feature predicted position and its match
+#define VO_KEYFRAME_MIN_SUPPORT 12 //a new keyframe is taken when fewer flows agree on the motion
+#define VO_KEYFRAME_MAX_DISTANCE 100.0 //mm travelled from the keyframe before a new one is taken
+#define VO_MAX_FLOWS ((STACK_SIZE > KLT_MAX_FEATURES) ? STACK_SIZE : KLT_MAX_FEATURES)
+
+#define VO_ENGINE_BRIEF 0 //FAST corners + BRIEF descriptors matched against a keyframe
+#define VO_ENGINE_KLT 1 //pyramidal Lucas-Kanade tracking of FAST corners
+#define VO_ENGINE_PHASE 2 //phase correlation of a bird's-eye ground patch
 
 #ifndef VISUAL_ODOMETRY_H
 #define VISUAL_ODOMETRY_H
@@ -29,6 +39,10 @@ typedef struct fxy {
 
 void init_visual_odometry();
 int estimate_ground_speeds(Mat & img,fxy * speeds);
+int estimate_ground_motion(Mat & img, fxy * speeds, float * yaw);
+void set_visual_odometry_engine(int engine);
+void set_visual_odometry_keyframes(int enable);
+void visual_odometry_rows(unsigned char * row_mask, unsigned int h);
 
 int test_estimate_ground_speeds(int argc, char ** argv);
 #endif
@@ -2,6 +2,11 @@
 
 int i2c_1_fd ;
 unsigned char HMC5883Lmode;
+unsigned char HMC5883L_cache[2]; // CONFIG_A and CONFIG_B as last written
+unsigned char HMC5883L_cache_valid = 0;
+int HMC5883L_drdy_fd = -1;
+HMC5883L_transfer_stats HMC5883L_stats;
+int (*HMC5883L_Transfer)(struct i2c_msg * msgs, int nb_msgs) = HMC5883L_I2C_RDWR;
 
 /** Power on and prepare for general usage.
  * This will prepare the magnetometer with default settings, ready for single-
@@ -227,7 +232,7 @@ void HMC5883L_SetMode(unsigned char newMode)
 {
     // use this method to guarantee that bits 7-2 are set to zero, which is a
     // requirement specified in the datasheet; 
-    unsigned char tmp = HMC5883Lmode << (HMC5883L_MODEREG_BIT - HMC5883L_MODEREG_LENGTH + 1);
+    unsigned char tmp = newMode << (HMC5883L_MODEREG_BIT - HMC5883L_MODEREG_LENGTH + 1);
     HMC5883L_I2C_ByteWrite(HMC5883L_DEFAULT_ADDRESS, &tmp, HMC5883L_RA_MODE);
     HMC5883Lmode = newMode; // track to tell if we have to clear bit 7 after a read
 }
@@ -245,15 +250,37 @@ void HMC5883L_SetMode(unsigned char newMode)
  */
 double HMC5883L_GetHeading(short int * Mag)
 {
-    unsigned char tmpbuff[6] = { 0 };
-    HMC5883L_I2C_BufferRead(HMC5883L_DEFAULT_ADDRESS, tmpbuff, HMC5883L_RA_DATAX_H, 6);
+    HMC5883L_ReadRaw(Mag);
 
     unsigned char tmp = HMC5883L_MODE_SINGLE << (HMC5883L_MODEREG_BIT - HMC5883L_MODEREG_LENGTH + 1);
 
     if (HMC5883Lmode == HMC5883L_MODE_SINGLE)
         HMC5883L_I2C_ByteWrite(HMC5883L_DEFAULT_ADDRESS, &tmp, HMC5883L_RA_MODE);
+    return HMC5883L_HeadingFromRaw(Mag);
+}
+
+/** Read the three axes in a single burst.
+ * The six data registers are read in one transfer so that they come from the
+ * same measurement, a new measurement is not triggered in single mode.
+ * @param Mag 16-bit signed integer container for the three axes, in register order
+ * @see HMC5883L_RA_DATAX_H
+ * @return 1 on success, 0 when the transfer failed, Mag is then left unchanged
+ */
+int HMC5883L_ReadRaw(short int * Mag)
+{
+    unsigned char tmpbuff[6] = { 0 };
+    if (!HMC5883L_I2C_BufferRead(HMC5883L_DEFAULT_ADDRESS, tmpbuff, HMC5883L_RA_DATAX_H, 6))
+        return 0;
     for (int i = 0; i < 3; i++)
         Mag[i] = ((short int) ((unsigned short) tmpbuff[2 * i] << 8) + tmpbuff[2 * i + 1]);
+    return 1;
+}
+
+/** Heading in degrees from raw data registers.
+ * @param Mag data registers as read by HMC5883L_ReadRaw()
+ */
+double HMC5883L_HeadingFromRaw(short int * Mag)
+{
 	double heading = atan2(Mag[1], Mag[0]);
 	heading=heading*(180.0/M_PI);
 	return heading ;
@@ -296,6 +323,20 @@ bool HMC5883L_GetReadyStatus()
     return tmp == 0x01 ? 1 : 0;
 }
 
+/** Cached copy of a configuration register.
+ * CONFIG_A and CONFIG_B only change when written, the last value written is kept
+ * so that bit updates do not read the register back. MODE is not cached since
+ * the device goes back to idle on its own after a single measurement.
+ * @return 1 when the register is cached
+ */
+int HMC5883L_CachedRegister(unsigned char regAddr, unsigned char * value)
+{
+    if (regAddr > HMC5883L_RA_CONFIG_B || !(HMC5883L_cache_valid & (1 << regAddr)))
+        return 0;
+    *value = HMC5883L_cache[regAddr];
+    return 1;
+}
+
 /** Write multiple bits in an 8-bit device register.
  * @param slaveAddr I2C slave device address
  * @param regAddr Register regAddr to write to
@@ -306,7 +347,8 @@ bool HMC5883L_GetReadyStatus()
 void HMC5883L_WriteBits(unsigned char slaveAddr, unsigned char regAddr, unsigned char bitStart, unsigned char length, unsigned char data)
 {
     unsigned char tmp;
-    HMC5883L_I2C_BufferRead(slaveAddr, &tmp, regAddr, 1);
+    if (!HMC5883L_CachedRegister(regAddr, &tmp))
+        HMC5883L_I2C_BufferRead(slaveAddr, &tmp, regAddr, 1);
     unsigned char mask = ((1 << length) - 1) << (bitStart - length + 1);
     data <<= (bitStart - length + 1); // shift data into correct position
     data &= mask; // zero all non-important bits in data
@@ -324,7 +366,8 @@ void HMC5883L_WriteBits(unsigned char slaveAddr, unsigned char regAddr, unsigned
 void HMC5883L_WriteBit(unsigned char slaveAddr, unsigned char regAddr, unsigned char bitNum, unsigned char data)
 {
     unsigned char tmp;
-    HMC5883L_I2C_BufferRead(slaveAddr, &tmp, regAddr, 1);
+    if (!HMC5883L_CachedRegister(regAddr, &tmp))
+        HMC5883L_I2C_BufferRead(slaveAddr, &tmp, regAddr, 1);
     tmp = (data != 0) ? (tmp | (1 << bitNum)) : (tmp & ~(1 << bitNum));
     HMC5883L_I2C_ByteWrite(slaveAddr, &tmp, regAddr);
 }
@@ -340,7 +383,8 @@ void HMC5883L_WriteBit(unsigned char slaveAddr, unsigned char regAddr, unsigned
 void HMC5883L_ReadBits(unsigned char slaveAddr, unsigned char regAddr, unsigned char bitStart, unsigned char length, unsigned char *data)
 {
     unsigned char tmp;
-    HMC5883L_I2C_BufferRead(slaveAddr, &tmp, regAddr, 1);
+    if (!HMC5883L_CachedRegister(regAddr, &tmp))
+        HMC5883L_I2C_BufferRead(slaveAddr, &tmp, regAddr, 1);
     unsigned char mask = ((1 << length) - 1) << (bitStart - length + 1);
     tmp &= mask;
     tmp >>= (bitStart - length + 1);
@@ -357,25 +401,86 @@ void HMC5883L_ReadBits(unsigned char slaveAddr, unsigned char regAddr, unsigned
 void HMC5883L_ReadBit(unsigned char slaveAddr, unsigned char regAddr, unsigned char bitNum, unsigned char *data)
 {
     unsigned char tmp;
-    HMC5883L_I2C_BufferRead(slaveAddr, &tmp, regAddr, 1);
+    if (!HMC5883L_CachedRegister(regAddr, &tmp))
+        HMC5883L_I2C_BufferRead(slaveAddr, &tmp, regAddr, 1);
     *data = tmp & (1 << bitNum);
 }
 
 /**
  * @brief  Initializes the I2C peripheral used to drive the HMC5883L
  * @param  None
- * @retval None
+ * @retval 1 on success, 0 when the bus cannot be opened
  */
-void HMC5883L_I2C_Init()
+int HMC5883L_I2C_Init()
 {
-	if ((i2c_1_fd = open("/dev/i2c-1", O_RDWR)) < 0) {
-                printf("Faild to open i2c port\n");
-                exit(1);
-        }
-        if (ioctl(i2c_1_fd, I2C_SLAVE, HMC5883L_ADDRESS) < 0) {
-                printf("Unable to get bus access to talk to slave\n");
-                exit(1);
+    HMC5883L_cache_valid = 0;
+    if (HMC5883L_Transfer != HMC5883L_I2C_RDWR)
+        return 1; // in-process device, nothing to open
+    if ((i2c_1_fd = open("/dev/i2c-1", O_RDWR)) < 0) {
+        printf("Faild to open i2c port\n");
+        return 0;
+    }
+    if (ioctl(i2c_1_fd, I2C_SLAVE, HMC5883L_ADDRESS) < 0) {
+        printf("Unable to get bus access to talk to slave\n");
+        close(i2c_1_fd);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief  Combined transfer through the I2C_RDWR ioctl.
+ * Messages are sent with repeated starts in a single bus transaction and a
+ * single syscall, a register pointer write and the following read cannot be
+ * separated by another master.
+ * @param  msgs : messages, addresses are 7-bit
+ * @param  nb_msgs : number of messages
+ * @retval number of messages transferred, negative on error
+ */
+int HMC5883L_I2C_RDWR(struct i2c_msg * msgs, int nb_msgs)
+{
+    struct i2c_rdwr_ioctl_data data;
+    data.msgs = msgs;
+    data.nmsgs = nb_msgs;
+    return ioctl(i2c_1_fd, I2C_RDWR, &data);
+}
+
+/**
+ * @brief  Runs a transfer, retrying failed ones, and accounts for its syscalls,
+ * bytes, time and errors.
+ * A NAK or a transfer cut short is retried HMC5883L_I2C_RETRIES times with a
+ * backoff doubling from HMC5883L_I2C_BACKOFF_US, about 1 ms in the worst case.
+ * @retval 1 when every message was transferred, 0 otherwise
+ */
+int HMC5883L_I2C_Transfer(struct i2c_msg * msgs, int nb_msgs)
+{
+    struct timespec start, stop;
+    unsigned int backoff = HMC5883L_I2C_BACKOFF_US;
+    int i, attempt;
+    for (attempt = 0;; attempt++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int ret = HMC5883L_Transfer(msgs, nb_msgs);
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        HMC5883L_stats.nb_syscalls++;
+        HMC5883L_stats.time += (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1000000000.0;
+        // start or repeated start, address byte, data bytes, each byte acknowledged
+        for (i = 0; i < nb_msgs; i++)
+            HMC5883L_stats.bus_bits += 1 + 9 * (1 + msgs[i].len);
+        HMC5883L_stats.bus_bits++; // stop
+        if (ret == nb_msgs)
+            return 1;
+        if (ret < 0)
+            HMC5883L_stats.nb_nak++; // the adapter reports a NAK as EREMOTEIO or ENXIO
+        else
+            HMC5883L_stats.nb_short++;
+        if (attempt >= HMC5883L_I2C_RETRIES) {
+            HMC5883L_stats.nb_failures++;
+            return 0;
         }
+        HMC5883L_stats.nb_retries++;
+        usleep(backoff);
+        backoff *= 2;
+    }
 }
 
 /**
@@ -383,56 +488,352 @@ void HMC5883L_I2C_Init()
  * @param  slaveAddr : slave address HMC5883L_DEFAULT_ADDRESS
  * @param  pBuffer : pointer to the buffer  containing the data to be written to the HMC5883L.
  * @param  WriteAddr : address of the register in which the data will be written
- * @retval None
+ * @retval 1 on success, 0 when the transfer failed after retries
  */
-void HMC5883L_I2C_ByteWrite(unsigned char slaveAddr, unsigned char* pBuffer, unsigned char WriteAddr)
+int HMC5883L_I2C_ByteWrite(unsigned char slaveAddr, unsigned char* pBuffer, unsigned char WriteAddr)
 {
 	unsigned char buf[2];
         buf[0] = WriteAddr;
         buf[1] = *pBuffer;
-        if((write(i2c_1_fd,buf,2))!=2) {
-                printf("Error writing to i2c slave\n");
-                exit(1);
+        struct i2c_msg msg = { (__u16) (slaveAddr >> 1), 0, 2, buf };
+        if (!HMC5883L_I2C_Transfer(&msg, 1)) {
+                // the register may or may not hold the value, read it back next time
+                if (WriteAddr <= HMC5883L_RA_CONFIG_B)
+                    HMC5883L_cache_valid &= ~(1 << WriteAddr);
+                return 0;
         }
+        if (WriteAddr <= HMC5883L_RA_CONFIG_B) {
+            HMC5883L_cache[WriteAddr] = *pBuffer;
+            HMC5883L_cache_valid |= (1 << WriteAddr);
+        }
+        return 1;
 }
 
 /**
  * @brief  Reads a block of data from the HMC5883L.
+ * The register pointer write and the read are a single combined transaction.
  * @param  slaveAddr  : slave address HMC5883L_DEFAULT_ADDRESS
  * @param  pBuffer : pointer to the buffer that receives the data read from the HMC5883L.
  * @param  ReadAddr : HMC5883L's internal address to read from.
  * @param  NumByteToRead : number of bytes to read from the HMC5883L ( NumByteToRead >1  only for the Magnetometer reading).
- * @retval None
+ * @retval 1 on success, 0 when the transfer failed after retries
+ */
+int HMC5883L_I2C_BufferRead(unsigned char slaveAddr, unsigned char* pBuffer, unsigned char ReadAddr, unsigned int NumByteToRead)
+{
+        struct i2c_msg msgs[2] = {
+            { (__u16) (slaveAddr >> 1), 0, 1, &ReadAddr },
+            { (__u16) (slaveAddr >> 1), I2C_M_RD, (__u16) NumByteToRead, pBuffer } };
+        return HMC5883L_I2C_Transfer(msgs, 2);
+}
+
+/** Read STATUS and the three axes in one transaction.
+ * STATUS is read first, when RDY is set the data read right after belongs to
+ * the new measurement, reading the data registers clears RDY.
+ * @param Mag 16-bit signed integer container for the three axes, in register order
+ * @return RDY bit of the STATUS register, HMC5883L_READ_ERROR when the transfer failed
+ */
+int HMC5883L_ReadStatusAndRaw(short int * Mag)
+{
+    unsigned char status_addr = HMC5883L_RA_STATUS, data_addr = HMC5883L_RA_DATAX_H;
+    unsigned char status = 0, tmpbuff[6] = { 0 };
+    __u16 addr = HMC5883L_ADDRESS;
+    struct i2c_msg msgs[4] = {
+        { addr, 0, 1, &status_addr },
+        { addr, I2C_M_RD, 1, &status },
+        { addr, 0, 1, &data_addr },
+        { addr, I2C_M_RD, 6, tmpbuff } };
+    if (!HMC5883L_I2C_Transfer(msgs, 4))
+        return HMC5883L_READ_ERROR;
+    for (int i = 0; i < 3; i++)
+        Mag[i] = ((short int) ((unsigned short) tmpbuff[2 * i] << 8) + tmpbuff[2 * i + 1]);
+    return (status & (1 << HMC5883L_STATUS_READY_BIT)) ? 1 : 0;
+}
+
+/** Export the GPIO wired to DRDY and wait for its falling edges.
+ * DRDY is pulled low for 250 us when a measurement is placed in the data
+ * registers. The sysfs interface is used so that the wait is a plain poll().
+ * @param gpio BCM number of the GPIO wired to DRDY
+ * @return 1 when the GPIO could be set up
+ */
+int HMC5883L_DRDY_Init(int gpio)
+{
+    char path[64], value[16];
+    int fd;
+    if ((fd = open("/sys/class/gpio/export", O_WRONLY)) >= 0) {
+        int len = snprintf(value, sizeof(value), "%d", gpio);
+        if (write(fd, value, len) != len && errno != EBUSY)
+            printf("Cannot export gpio %d \n", gpio);
+        close(fd);
+    }
+    snprintf(path, sizeof(path), "/sys/class/gpio/gpio%d/edge", gpio);
+    if ((fd = open(path, O_WRONLY)) < 0 || write(fd, "falling", 7) != 7) {
+        printf("Cannot wait for edges on gpio %d \n", gpio);
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+    close(fd);
+    snprintf(path, sizeof(path), "/sys/class/gpio/gpio%d/value", gpio);
+    if ((HMC5883L_drdy_fd = open(path, O_RDONLY)) < 0)
+        return 0;
+    read(HMC5883L_drdy_fd, value, sizeof(value)); // clear the pending edge
+    return 1;
+}
+
+/** Wait for the next DRDY falling edge.
+ * @param timeout_ms Longest wait
+ * @return 1 on an edge, 0 on timeout or when DRDY is not set up
  */
-void HMC5883L_I2C_BufferRead(unsigned char slaveAddr, unsigned char* pBuffer, unsigned char ReadAddr, unsigned int NumByteToRead)
+int HMC5883L_DRDY_Wait(int timeout_ms)
 {
-        if((write(i2c_1_fd,&ReadAddr,1))!= 1){
-                printf("Error writing to i2c slave\n");
-                exit(1);
+    char value[16];
+    struct pollfd pfd;
+    if (HMC5883L_drdy_fd < 0)
+        return 0;
+    pfd.fd = HMC5883L_drdy_fd;
+    pfd.events = POLLPRI | POLLERR;
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+        return 0;
+    lseek(HMC5883L_drdy_fd, 0, SEEK_SET);
+    read(HMC5883L_drdy_fd, value, sizeof(value));
+    HMC5883L_stats.nb_syscalls += 3;
+    return 1;
+}
+
+/** Transfer statistics since the last reset. */
+HMC5883L_transfer_stats * HMC5883L_GetStats()
+{
+    return &HMC5883L_stats;
+}
+
+void HMC5883L_ResetStats()
+{
+    memset(&HMC5883L_stats, 0, sizeof(HMC5883L_stats));
+}
+
+/** In-process stand-in for /dev/i2c-1.
+ * Emulates the registers of the HMC5883L : register pointer with auto
+ * increment, continuous and single measurement modes at the configured rate,
+ * RDY cleared when the data registers are read. Transfers take the time the
+ * bus would take at HMC5883L_I2C_BUS_HZ so that timings stay meaningful.
+ */
+unsigned char fake_regs[13] = { 0x10, 0x20, 0x01, 0, 0, 0, 0, 0, 0, 0, 'H', '4', '3' };
+unsigned char fake_pointer = 0;
+unsigned int fake_nak_percent = 0, fake_short_percent = 0;
+unsigned int fake_random = 1;
+double fake_next_measurement = 0.;
+unsigned int fake_nb_measurements = 0;
+const double fake_rates[8] = { 0.75, 1.5, 3., 7.5, 15., 30., 75., 75. };
+
+double fake_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+// a slowly rotating field so that headings change
+void fake_measure()
+{
+    // the bot turns slowly, the field is shifted and squashed by hard and soft iron
+    double a = fake_nb_measurements * 0.01;
+    short m[3] = { (short) (60 + 400 * cos(a)), (short) (-120),
+            (short) (-30 + 250 * sin(a) + 60 * cos(a)) };
+    for (int i = 0; i < 3; i++) {
+        fake_regs[HMC5883L_RA_DATAX_H + 2 * i] = ((unsigned short) m[i]) >> 8;
+        fake_regs[HMC5883L_RA_DATAX_H + 2 * i + 1] = ((unsigned short) m[i]) & 0xFF;
+    }
+    fake_regs[HMC5883L_RA_STATUS] |= (1 << HMC5883L_STATUS_READY_BIT);
+    fake_nb_measurements++;
+}
+
+void fake_update()
+{
+    double now = fake_time();
+    unsigned char mode = fake_regs[HMC5883L_RA_MODE] & 0x03;
+    if (mode == HMC5883L_MODE_CONTINUOUS) {
+        double period = 1. / fake_rates[(fake_regs[HMC5883L_RA_CONFIG_A] >> 2) & 0x07];
+        if (fake_next_measurement == 0.)
+            fake_next_measurement = now + period;
+        while (now >= fake_next_measurement) {
+            fake_measure();
+            fake_next_measurement += period;
         }
-        if(read(i2c_1_fd,pBuffer,NumByteToRead) < 0){
-                printf("Error reading from i2c slave\n");
-                exit(1);
+    } else if (mode == HMC5883L_MODE_SINGLE && now >= fake_next_measurement) {
+        fake_measure();
+        fake_regs[HMC5883L_RA_MODE] = HMC5883L_MODE_IDLE;
+    }
+}
+
+void fake_register_written(unsigned char reg)
+{
+    if (reg == HMC5883L_RA_MODE)
+        fake_next_measurement = fake_time() + 0.006; // single measurement time
+}
+
+unsigned char fake_read_register()
+{
+    unsigned char value = fake_regs[fake_pointer];
+    if (fake_pointer >= HMC5883L_RA_DATAX_H && fake_pointer <= HMC5883L_RA_DATAZ_L)
+        fake_regs[HMC5883L_RA_STATUS] &= ~(1 << HMC5883L_STATUS_READY_BIT);
+    // data registers wrap so that they can be read again without a pointer write
+    if (fake_pointer == HMC5883L_RA_DATAZ_L)
+        fake_pointer = HMC5883L_RA_DATAX_H;
+    else
+        fake_pointer = (fake_pointer + 1) % 13;
+    return value;
+}
+
+// deterministic draws so that fault runs can be compared
+unsigned int fake_draw_percent()
+{
+    fake_random = fake_random * 1103515245 + 12345;
+    return (fake_random >> 16) % 100;
+}
+
+int HMC5883L_FakeTransfer(struct i2c_msg * msgs, int nb_msgs)
+{
+    unsigned long bits = 1;
+    int i, j;
+    if (fake_draw_percent() < fake_nak_percent) {
+        // address not acknowledged, nothing reaches the device
+        usleep((10 * 1000000) / HMC5883L_I2C_BUS_HZ);
+        errno = EREMOTEIO;
+        return -1;
+    }
+    // the device stops answering during the last message
+    int cut = (fake_draw_percent() < fake_short_percent) ? nb_msgs - 1 : nb_msgs;
+    fake_update();
+    for (i = 0; i < nb_msgs; i++) {
+        if (msgs[i].addr != HMC5883L_ADDRESS)
+            return -1;
+        bits += 1 + 9 * (1 + msgs[i].len);
+        if (msgs[i].flags & I2C_M_RD) {
+            for (j = 0; j < msgs[i].len; j++)
+                msgs[i].buf[j] = (i < cut || j < msgs[i].len / 2) ? fake_read_register() : 0xFF;
+        } else if (msgs[i].len > 0) {
+            fake_pointer = msgs[i].buf[0] % 13;
+            for (j = 1; j < msgs[i].len; j++) {
+                if (fake_pointer <= HMC5883L_RA_MODE) {
+                    fake_regs[fake_pointer] = msgs[i].buf[j];
+                    fake_register_written(fake_pointer);
+                }
+                fake_pointer = (fake_pointer + 1) % 13;
+            }
         }
+    }
+    usleep((bits * 1000000) / HMC5883L_I2C_BUS_HZ);
+    return cut;
+}
+
+/** Make the in-process device fail some transfers.
+ * @param nak_percent transfers whose address is not acknowledged
+ * @param short_percent transfers cut during their last message
+ */
+void HMC5883L_FakeFaults(unsigned int nak_percent, unsigned int short_percent)
+{
+    fake_nak_percent = nak_percent;
+    fake_short_percent = short_percent;
+}
+
+/** Route transfers to the in-process stand-in instead of /dev/i2c-1. */
+void HMC5883L_UseFakeDevice()
+{
+    HMC5883L_Transfer = HMC5883L_FakeTransfer;
 }
 
 void init_compass(){
-HMC5883L_I2C_Init();
+if (!HMC5883L_I2C_Init())
+	exit(1);
 HMC5883L_Initialize();
 }
 
+void print_transfer_stats(const char * name, unsigned int nb_samples)
+{
+    HMC5883L_transfer_stats * stats = HMC5883L_GetStats();
+    if (nb_samples == 0)
+        nb_samples = 1;
+    printf("%s : %.2f syscalls, %.0f us of transfers, %.0f us on the bus at %d kHz per heading \n",
+            name, ((double) stats->nb_syscalls) / nb_samples,
+            1000000. * stats->time / nb_samples,
+            1000000. * stats->bus_bits / HMC5883L_I2C_BUS_HZ / nb_samples,
+            HMC5883L_I2C_BUS_HZ / 1000);
+    if (stats->nb_nak + stats->nb_short > 0)
+        printf("%s : %lu NAK, %lu short transfers, %lu retries, %lu failures \n",
+                name, stats->nb_nak, stats->nb_short, stats->nb_retries,
+                stats->nb_failures);
+}
+
+// continuous mode reads for nb_reads output periods, return the samples read
+unsigned int read_continuous(unsigned int nb_reads, short int * heading,
+        unsigned int * nb_errors)
+{
+    unsigned int i, n = 0;
+    for (i = 0; i < nb_reads; i++) {
+        int ready = HMC5883L_ReadStatusAndRaw(heading);
+        if (ready == HMC5883L_READ_ERROR)
+            (*nb_errors)++;
+        else if (ready)
+            n++;
+        usleep(1000000 / 75);
+    }
+    return n;
+}
 
+// test_compass [fake] : compares single mode polling with continuous mode and
+// combined STATUS and DATA reads, on the in-process device with "fake", where
+// NAKs and short reads are then injected
 int test_hmc5883l(int argc, char ** argv){
 short int heading[3];
-HMC5883L_I2C_Init();
+double cap;
+unsigned int n, nb_errors;
+int fake = (argc > 1 && strcmp(argv[1], "fake") == 0);
+if (fake)
+	HMC5883L_UseFakeDevice();
+if (!HMC5883L_I2C_Init())
+	return -1;
 HMC5883L_Initialize();
-//HMC5883L_SetMode(HMC5883L_MODE_CONTINUOUS);
-while(1){
+HMC5883L_ResetStats();
+n = 0;
+while(n < 30){
 	if( HMC5883L_GetReadyStatus()){
-		double cap = HMC5883L_GetHeading(heading);
-		printf("%d, %d, %d, %lf \n", heading[0], heading[1], heading[2], cap);
+		cap = HMC5883L_GetHeading(heading);
+		n++;
 	}
-
-	usleep(30000);
+	usleep(1000);
 }
+printf("%d, %d, %d, %lf \n", heading[0], heading[1], heading[2], cap);
+print_transfer_stats("Single mode, status polling", n);
+
+HMC5883L_SetDataRate(HMC5883L_RATE_75);
+HMC5883L_SetMode(HMC5883L_MODE_CONTINUOUS);
+HMC5883L_ResetStats();
+nb_errors = 0;
+n = read_continuous(150, heading, &nb_errors);
+cap = HMC5883L_HeadingFromRaw(heading);
+printf("%d, %d, %d, %lf \n", heading[0], heading[1], heading[2], cap);
+print_transfer_stats("Continuous mode, combined status and data", n);
+if (!fake)
+	return 0;
+
+// glitches are absorbed by retries
+HMC5883L_FakeFaults(10, 5);
+HMC5883L_ResetStats();
+nb_errors = 0;
+n = read_continuous(150, heading, &nb_errors);
+printf("10%% NAK, 5%% short reads : %u samples in 150 periods, %u failed reads \n",
+        n, nb_errors);
+print_transfer_stats("Continuous mode with glitches", n);
+// an outage makes reads fail after bounded retries, then reads recover
+HMC5883L_FakeFaults(100, 0);
+nb_errors = 0;
+double start = fake_time();
+n = read_continuous(20, heading, &nb_errors);
+printf("Outage : %u samples, %u failed reads in %.0f ms \n", n, nb_errors,
+        1000. * (fake_time() - start));
+HMC5883L_FakeFaults(0, 0);
+nb_errors = 0;
+n = read_continuous(20, heading, &nb_errors);
+printf("Recovered : %u samples, %u failed reads in 20 periods \n", n, nb_errors);
+return (nb_errors == 0 && n > 0) ? 0 : -1;
 }
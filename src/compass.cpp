@@ -0,0 +1,281 @@
+#include "compass.hpp"
+#include "realtime.hpp"
+#include "profiler.hpp"
+
+//The HMC5883L runs in continuous mode, a thread wakes on DRDY edges or at the output
+//rate, reads STATUS and the three axes in one transaction and publishes new samples
+//through a seqlock. The control loop never waits on the I2C bus.
+//Bus errors are retried by the driver, a read still failing is skipped and the
+//device is configured again after COMPASS_REINIT_FAILURES failures in a row. The
+//control loop checks the age of the sample and stops trusting a stale heading.
+//Samples are corrected with the hard and soft iron calibration and filtered in the
+//thread, so the heading and yaw rate come at the sensor rate.
+
+pthread_t compass_tid;
+int compass_running = 0;
+int compass_drdy = 0; //woken by DRDY edges instead of a timer
+unsigned int compass_seq = 0; //odd while a sample is being written
+compass_sample compass_latest;
+mag_calibration compass_calibration;
+mag_filter compass_filter; //only touched by the compass thread
+
+//thread side statistics, read once the thread is stopped or for reporting
+unsigned long compass_reads = 0;
+unsigned long compass_not_ready = 0; //reads that found no new measurement
+unsigned long compass_drdy_timeouts = 0;
+unsigned long compass_errors = 0; //reads failing after the driver retries
+unsigned long compass_reinits = 0;
+double compass_read_time = 0., compass_read_max = 0.;
+double compass_late_max = 0.; //wakeup lateness
+//reader side, only touched by the control loop
+unsigned long compass_retries = 0;
+
+void publish_compass_sample(short * mag, double timestamp) {
+	compass_sample sample;
+	sample.timestamp = timestamp;
+	sample.heading = compass_filter.heading;
+	sample.yaw_rate = compass_filter.yaw_rate;
+	sample.mag[0] = mag[0];
+	sample.mag[1] = mag[1];
+	sample.mag[2] = mag[2];
+	sample.count = compass_latest.count + 1;
+	seqlock_write(&compass_seq, &compass_latest, &sample, sizeof(compass_sample));
+}
+
+//copy of the latest sample, return 0 until a first sample was read
+int read_compass(compass_sample * sample) {
+	compass_retries += seqlock_read(&compass_seq, &compass_latest, sample,
+			sizeof(compass_sample));
+	return sample->count > 0;
+}
+
+//the sample is too old to steer with, the compass stopped answering
+int compass_stale(compass_sample * sample) {
+	return sample->count == 0
+			|| monotonic_time() - sample->timestamp > COMPASS_STALE_AGE;
+}
+
+//continuous mode at the highest output rate, return 0 if the device did not answer
+int configure_compass() {
+	if (!HMC5883L_TestConnection())
+		return 0;
+	HMC5883L_Initialize();
+	HMC5883L_SetDataRate(HMC5883L_RATE_75);
+	HMC5883L_SetMode(HMC5883L_MODE_CONTINUOUS);
+	return 1;
+}
+
+void * compass_thread(void * arg) {
+	struct timespec next;
+	short mag[3];
+	PROFILE_THREAD("compass");
+	rt_enter_thread(RT_COMPASS);
+	int failures = 0;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (__atomic_load_n(&compass_running, __ATOMIC_ACQUIRE)) {
+		int ready, retries = 0;
+		double t;
+		if (compass_drdy) {
+			if (!HMC5883L_DRDY_Wait(COMPASS_DRDY_TIMEOUT_MS))
+				compass_drdy_timeouts++;
+			t = monotonic_time();
+		} else {
+			next.tv_nsec += 1000000000 / COMPASS_RATE;
+			if (next.tv_nsec >= 1000000000) {
+				next.tv_nsec -= 1000000000;
+				next.tv_sec++;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+			t = monotonic_time();
+			double late = t - (next.tv_sec + next.tv_nsec / 1000000000.);
+			if (late > compass_late_max)
+				compass_late_max = late;
+		}
+		while (1) {
+			double start = monotonic_time();
+			{
+				PROFILE_SCOPE(PROFILE_COMPASS);
+				ready = HMC5883L_ReadStatusAndRaw(mag);
+			}
+			double read_time = monotonic_time() - start;
+			compass_read_time += read_time;
+			if (read_time > compass_read_max)
+				compass_read_max = read_time;
+			compass_reads++;
+			//the timer drifts against the compass clock, a read can come just before
+			//the measurement
+			if (ready || compass_drdy || retries >= COMPASS_MAX_RETRIES)
+				break;
+			compass_not_ready++;
+			retries++;
+			usleep(COMPASS_RETRY_US);
+		}
+		if (ready == HMC5883L_READ_ERROR) {
+			compass_errors++;
+			failures++;
+			//a brown-out resets the device to single mode, configure it again
+			if (failures >= COMPASS_REINIT_FAILURES) {
+				compass_reinits++;
+				if (configure_compass())
+					failures = 0;
+				clock_gettime(CLOCK_MONOTONIC, &next);
+			}
+			continue;
+		}
+		failures = 0;
+		if (ready) {
+			update_mag_filter(&compass_filter, &compass_calibration, mag, t);
+			publish_compass_sample(mag, t);
+		}
+		else
+			compass_not_ready++;
+	}
+	return NULL;
+}
+
+//continuous mode at the highest output rate, samples are read by a dedicated thread,
+//drdy_gpio is the GPIO wired to DRDY or -1 to read at the output rate, without a
+//calibration file headings are raw
+int start_compass_thread(int drdy_gpio, const char * calibration_path) {
+#ifndef __arm__
+	//no compass on desktop builds, an in-process device stands in
+	HMC5883L_UseFakeDevice();
+#endif
+	if (!HMC5883L_I2C_Init()) {
+		printf("Cannot open the compass, no heading \n");
+		return 0;
+	}
+	if (!configure_compass())
+		printf("Compass not answering, the thread keeps trying \n");
+	compass_drdy = (drdy_gpio >= 0) && HMC5883L_DRDY_Init(drdy_gpio);
+	if (drdy_gpio >= 0 && !compass_drdy)
+		printf("DRDY not available, compass read at %d Hz \n", COMPASS_RATE);
+	if (calibration_path != NULL
+			&& !load_mag_calibration(calibration_path, &compass_calibration))
+		printf("No compass calibration in %s, headings are not corrected \n",
+				calibration_path);
+	init_mag_filter(&compass_filter);
+	compass_reads = compass_not_ready = compass_drdy_timeouts = 0;
+	compass_errors = compass_reinits = compass_retries = 0;
+	compass_read_time = compass_read_max = compass_late_max = 0.;
+	HMC5883L_ResetStats();
+	memset(&compass_latest, 0, sizeof(compass_sample));
+	compass_running = 1;
+	if (pthread_create(&compass_tid, NULL, compass_thread, NULL) != 0) {
+		compass_running = 0;
+		printf("Cannot start the compass thread \n");
+		return 0;
+	}
+	return 1;
+}
+
+void stop_compass_thread() {
+	if (!compass_running)
+		return;
+	__atomic_store_n(&compass_running, 0, __ATOMIC_RELEASE);
+	pthread_join(compass_tid, NULL);
+}
+
+void print_compass_stats() {
+	if (compass_reads == 0)
+		return;
+	unsigned int nb_samples = compass_latest.count;
+	HMC5883L_transfer_stats * stats = HMC5883L_GetStats();
+	printf("Compass : %u samples, %lu reads, %lu without new data, %s",
+			nb_samples, compass_reads, compass_not_ready,
+			compass_drdy ? "woken by DRDY" : "woken by timer");
+	if (compass_drdy)
+		printf(", %lu DRDY timeouts \n", compass_drdy_timeouts);
+	else
+		printf(", late by %.1f us at most \n", 1000000. * compass_late_max);
+	printf("Compass : read time mean %.1f us, max %.1f us, %.2f syscalls and %.0f us on the bus per sample, %lu reader retries \n",
+			1000000. * compass_read_time / compass_reads,
+			1000000. * compass_read_max,
+			((double) stats->nb_syscalls) / (nb_samples > 0 ? nb_samples : 1),
+			1000000. * stats->bus_bits / HMC5883L_I2C_BUS_HZ
+					/ (nb_samples > 0 ? nb_samples : 1), compass_retries);
+	if (compass_filter.nb_outliers > 0)
+		printf("Compass : %lu distorted samples rejected by the heading filter \n",
+				compass_filter.nb_outliers);
+	if (stats->nb_retries + compass_errors > 0)
+		printf("Compass : %lu transfers retried, %lu failed, %lu failed reads, %lu reconfigurations \n",
+				stats->nb_retries, stats->nb_failures, compass_errors,
+				compass_reinits);
+}
+
+//relative rms error of the corrected horizontal field
+double field_error(mag_calibration * cal, short (*mag)[3], unsigned int n) {
+	double sum = 0., sum2 = 0.;
+	unsigned int i;
+	for (i = 0; i < n; i++) {
+		double c[3];
+		correct_mag(cal, mag[i], c);
+		double norm = hypot(c[0], c[1]);
+		sum += norm;
+		sum2 += norm * norm;
+	}
+	double mean = sum / n;
+	return sqrt(fmax(0., sum2 / n - mean * mean)) / mean;
+}
+
+//record the raw field while the bot is turned through at least a full turn, fit the
+//hard and soft iron correction and store it, the compass thread must be running
+int calibrate_compass(const char * path, double duration) {
+	unsigned int max = (unsigned int) (duration * COMPASS_RATE) + 1, n = 0;
+	unsigned int last = 0;
+	compass_sample sample;
+	mag_calibration cal, hard;
+	short (*mag)[3] = (short (*)[3]) malloc(max * sizeof(short[3]));
+	if (mag == NULL)
+		return 0;
+	printf("Turn the bot through a full turn or more, recording for %.0f s \n",
+			duration);
+	double start = monotonic_time();
+	while (n < max && monotonic_time() - start < duration) {
+		if (read_compass(&sample) && sample.count != last) {
+			last = sample.count;
+			memcpy(mag[n], sample.mag, sizeof(mag[n]));
+			n++;
+		}
+		usleep(1000000 / COMPASS_RATE / 2);
+	}
+	if (!fit_mag_calibration(mag, n, &cal)) {
+		printf("Calibration failed : %u samples, not every direction covered or no ellipsoid fits \n",
+				n);
+		free(mag);
+		return 0;
+	}
+	init_mag_calibration(&hard);
+	memcpy(hard.offset, cal.offset, sizeof(hard.offset));
+	printf("Calibration : %u samples, offset %.1f %.1f %.1f, horizontal field %.1f \n",
+			n, cal.offset[0], cal.offset[1], cal.offset[2], cal.field);
+	printf("Calibration : field rms error %.1f%% with the offset only, %.1f%% with the full correction \n",
+			100. * field_error(&hard, mag, n), 100. * field_error(&cal, mag, n));
+	free(mag);
+	return save_mag_calibration(path, &cal);
+}
+
+// test_compass calibrate [file] : records a spin, stores the calibration and reads
+// the corrected heading and yaw rate back for a few seconds
+int test_compass_calibration(int argc, char ** argv) {
+	const char * path = (argc > 1) ? argv[1] : MAG_CALIBRATION_FILE;
+	compass_sample sample;
+	int i;
+	if (!start_compass_thread(-1, NULL))
+		return -1;
+	int ok = calibrate_compass(path, COMPASS_CALIBRATION_TIME);
+	stop_compass_thread();
+	if (!ok)
+		return -1;
+	if (!start_compass_thread(-1, path))
+		return -1;
+	for (i = 0; i < 6; i++) {
+		usleep(500000);
+		read_compass(&sample);
+		printf("heading %.1f, wrapped %.1f, yaw rate %.1f deg/s \n",
+				sample.heading, wrap_heading(sample.heading), sample.yaw_rate);
+	}
+	stop_compass_thread();
+	print_compass_stats();
+	return 0;
+}
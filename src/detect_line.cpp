@@ -7,6 +7,7 @@
 #include "resampling.hpp"
 #include "detect_line.hpp"
 #include "navigation.hpp"
+#include "profiler.hpp"
 
 #include "camera_parameters.h"
 using namespace std;
@@ -14,10 +15,6 @@ using namespace std;
 #define STEER_P 0.25
 #define SPEED_DEC 0.5
 
-#define tic      double tic_t = clock();
-#define toc      std::cout << (clock() - tic_t)/CLOCKS_PER_SEC \
-                           << " seconds" << std::endl;
-
 //Needds to be computed from camera calibration results using resampling.c
 
 double cam_ct[12];
@@ -27,7 +24,6 @@ double bot_pos_in_world[4];
 char line_detection_kernel[9] = { -1, 0, 1, -1, 0, 1, -1, 0, 1 };
 
 #define NB_LINES_HORIZ_SAMPLING 8
-#define NB_LINES_SAMPLED 28
 #define SAMPLE_SPACING_MM 30.0
 
 float posx_samples_world[NB_LINES_SAMPLED];
@@ -39,6 +35,15 @@ char * used;
 unsigned char * inliers;
 unsigned char * max_inliers;
 
+unsigned int line_seed = 0;
+int line_seed_fixed = 0;
+
+//RANSAC draws the same samples for the same points, used to record and replay runs
+void set_line_detector_seed(unsigned int seed) {
+	line_seed = seed;
+	line_seed_fixed = 1;
+}
+
 float rand_a_b(int a, int b) {
 	//return ((rand() % (b - a) + a;
 	float rand_0_1 = (((float) rand()) / ((float) RAND_MAX));
@@ -116,6 +121,7 @@ inline float distance_to_curve(curve * l, float x, float y) {
 #define RANSAC_NB_LOOPS NB_LINES_SAMPLED
 #define RANSAC_INLIER_LIMIT 5.0
 float fit_line(point * pts, unsigned int nb_pts, curve * l) {
+	PROFILE_SCOPE(PROFILE_RANSAC);
 	int i;
 //Should move dynamic memory allocation to static
 	int max_consensus = 0;
@@ -129,7 +135,7 @@ float fit_line(point * pts, unsigned int nb_pts, curve * l) {
 		while (pt_index < RANSAC_LIST) {
 			idx = rand_a_b(0, (nb_pts - 1));
 			while (used[idx] != 0)
-				idx = (idx + 1) % NB_LINES_SAMPLED;
+				idx = (idx + 1) % nb_pts;
 			y[pt_index] = pts[idx].y;
 			x[pt_index] = pts[idx].x;
 			if (x[pt_index] > max_x_temp)
@@ -233,10 +239,11 @@ void extract_line_pos(int * horizontal_gradient, unsigned int line_start,
 }
 
 float detect_line(Mat & img, curve * l, point * pts, int * nb_pts, int track) {
+	PROFILE_SCOPE(PROFILE_LINE);
 	int i;
 	(*nb_pts) = 0;
 	int * sampled_lines = (int *) malloc(img.cols * sizeof(int));
-	srand(time(NULL));
+	srand(line_seed_fixed ? line_seed : time(NULL));
 	unsigned int initial_search_start_u = 0;
 	unsigned int initial_search_stop_u = img.cols;
 	if (track == 1) {
@@ -261,28 +268,35 @@ float detect_line(Mat & img, curve * l, point * pts, int * nb_pts, int track) {
 		//compute curve position at first sample
 		//limit search space {initial_search_start_u, initial_search_stop_u}
 	}
-	for (i = 0; i < NB_LINES_HORIZ_SAMPLING; i++) {
-		kernel_horiz(img, sampled_lines, posv_samples_cam[i],
-				initial_search_start_u, initial_search_stop_u);
-		float line_pos;
-		int nb_lines = 1;
-		extract_line_pos(sampled_lines, initial_search_start_u, initial_search_stop_u, &line_pos, &nb_lines);
-		if (nb_lines > 0) {
-			pts[(*nb_pts)].x = line_pos;
-			pts[(*nb_pts)].y = posv_samples_cam[i];
-			(*nb_pts)++;
+	{
+		PROFILE_SCOPE(PROFILE_GRADIENT);
+		for (i = 0; i < NB_LINES_HORIZ_SAMPLING; i++) {
+			kernel_horiz(img, sampled_lines, posv_samples_cam[i],
+					initial_search_start_u, initial_search_stop_u);
+			float line_pos;
+			int nb_lines = 1;
+			extract_line_pos(sampled_lines, initial_search_start_u, initial_search_stop_u, &line_pos, &nb_lines);
+			if (nb_lines > 0) {
+				pts[(*nb_pts)].x = line_pos;
+				pts[(*nb_pts)].y = posv_samples_cam[i];
+				(*nb_pts)++;
+			}
 		}
 	}
 
-	for (i = 0; i < (*nb_pts); i++) {
-		undistort_radial(K, pts[i].x, pts[i].y, &(pts[i].x), &(pts[i].y),
-				radial_undistort, POLY_UNDISTORT_SIZE);
-		pixel_to_ground_plane(cam_ct, pts[i].x, pts[i].y, &(pts[i].x),
-				&(pts[i].y));
+	{
+		PROFILE_SCOPE(PROFILE_PROJECTION);
+		for (i = 0; i < (*nb_pts); i++) {
+			undistort_radial(K, pts[i].x, pts[i].y, &(pts[i].x), &(pts[i].y),
+					radial_undistort, POLY_UNDISTORT_SIZE);
+			pixel_to_ground_plane(cam_ct, pts[i].x, pts[i].y, &(pts[i].x),
+					&(pts[i].y));
+		}
 	}
 
 	if ((*nb_pts) > ((POLY_LENGTH * 2.0) - 1)) {
 		float confidence = fit_line(pts, (*nb_pts), l);
+		PROFILE_SCOPE(PROFILE_TRACK);
 		for (i = NB_LINES_HORIZ_SAMPLING; i < NB_LINES_SAMPLED; i++) {
 			float u, v;
 			float old_l_max_x = l->max_x;
@@ -291,10 +305,13 @@ float detect_line(Mat & img, curve * l, point * pts, int * nb_pts, int track) {
 			ground_plane_to_pixel(cam_ct, (i * SAMPLE_SPACING_MM), y, &u, &v);
 			if (u < 0 || u >= img.cols || v < 0 || v >= img.rows)
 				break;
-			kernel_horiz(img, sampled_lines, v, u - 50, u + 50);
+			//search window clamped to the image, responses outside are not computed
+			unsigned int u_start = (u > 50) ? (u - 50) : 0;
+			unsigned int u_stop = (u + 50 < img.cols) ? (u + 50) : img.cols;
+			kernel_horiz(img, sampled_lines, v, u_start, u_stop);
 			float line_pos;
 			int nb_lines = 1;
-			extract_line_pos(sampled_lines, u - 50, u + 50, &line_pos,
+			extract_line_pos(sampled_lines, u_start, u_stop, &line_pos,
 					&nb_lines);
 			if (nb_lines > 0) {
 				undistort_radial(K, line_pos, v, &(pts[(*nb_pts)].x),
@@ -343,6 +360,33 @@ void init_line_detector() {
 	NB_LINES_SAMPLED * sizeof(char));
 }
 
+//mark the image rows read by the line detector, sample rows and tracking
+//windows are read with a one row margin for the gradient kernel
+void line_detector_rows(unsigned char * row_mask, unsigned int h) {
+	int i, j;
+	for (i = 0; i < NB_LINES_SAMPLED; i++) {
+		for (j = -1; j <= 1; j++) {
+			int v = posv_samples_cam[i] + j;
+			if (v >= 0 && v < (int) h)
+				row_mask[v] = 1;
+		}
+	}
+	//tracking windows follow the curve, take every row the curve can project to
+	for (i = NB_LINES_HORIZ_SAMPLING; i < NB_LINES_SAMPLED; i++) {
+		float y;
+		for (y = -1000.; y <= 1000.; y += 10.) {
+			float u, v;
+			ground_plane_to_pixel(cam_ct, (i * SAMPLE_SPACING_MM), y, &u, &v);
+			if (u < 0 || u >= IMAGE_WIDTH || v < 0 || v >= h)
+				continue;
+			for (j = -1; j <= 2; j++) {
+				if (((int) v) + j >= 0 && ((int) v) + j < (int) h)
+					row_mask[((int) v) + j] = 1;
+			}
+		}
+	}
+}
+
 void close_line_detector() {
 	free(x);
 	free(y);
@@ -0,0 +1,518 @@
+#include "estimator.hpp"
+
+//Kinematic bicycle EKF over position, heading, speed and yaw rate bias. Steering and
+//esc commands drive the prediction, the compass, its yaw rate and visual odometry
+//correct it with scalar updates, so that no matrix is inverted and every matrix has
+//a fixed size.
+//Measurements carry the time they were taken and often arrive after the estimate
+//moved past it : a snapshot is kept at each command and measurement, a late
+//measurement rolls back to the snapshot before it, is fused in and the later
+//snapshots are replayed.
+
+typedef Matrix<double, EST_NB_STATES, 1> est_vector;
+typedef Matrix<double, EST_NB_STATES, EST_NB_STATES> est_matrix;
+
+typedef struct est_snapshot {
+	double t;
+	est_vector s;
+	est_matrix P;
+	double steer; //wheel angle in rad, applied from t on
+	double speed_command; //mm/s
+	int type; //measurement fused at t, EST_NONE for a command
+	double value;
+	double noise;
+} est_snapshot;
+
+est_snapshot est_current;
+est_snapshot est_history[EST_HISTORY]; //ring, ordered by time
+unsigned int est_history_start = 0, est_history_size = 0;
+int est_initialized = 0;
+
+//statistics
+unsigned long est_nb_calls = 0, est_nb_late = 0, est_nb_too_old = 0,
+		est_nb_rejected = 0, est_nb_measurements = 0;
+double est_time = 0., est_time_max = 0.;
+
+est_snapshot * history_at(unsigned int i) {
+	return &(est_history[(est_history_start + i) % EST_HISTORY]);
+}
+
+//insert in time order, the oldest snapshot is forgotten when the ring is full,
+//return the position of the new snapshot
+unsigned int history_insert(est_snapshot * e) {
+	unsigned int i;
+	if (est_history_size == EST_HISTORY) {
+		est_history_start = (est_history_start + 1) % EST_HISTORY;
+		est_history_size--;
+	}
+	i = est_history_size;
+	while (i > 0 && history_at(i - 1)->t > e->t) {
+		(*history_at(i)) = (*history_at(i - 1));
+		i--;
+	}
+	(*history_at(i)) = (*e);
+	est_history_size++;
+	return i;
+}
+
+void est_step(est_snapshot * e, double dt) {
+	est_vector & s = e->s;
+	double c = cos(s(EST_HEADING)), sn = sin(s(EST_HEADING));
+	double v = s(EST_SPEED);
+	double k = tan(e->steer) / EST_WHEELBASE; //curvature
+	est_matrix F = est_matrix::Identity();
+	F(EST_X, EST_HEADING) = -v * sn * dt;
+	F(EST_X, EST_SPEED) = c * dt;
+	F(EST_Y, EST_HEADING) = v * c * dt;
+	F(EST_Y, EST_SPEED) = sn * dt;
+	F(EST_HEADING, EST_SPEED) = k * dt;
+	F(EST_HEADING, EST_BIAS) = dt;
+	F(EST_SPEED, EST_SPEED) = 1. - dt / EST_SPEED_TAU;
+	s(EST_X) += v * c * dt;
+	s(EST_Y) += v * sn * dt;
+	s(EST_HEADING) += (v * k + s(EST_BIAS)) * dt;
+	s(EST_SPEED) += (e->speed_command - v) * dt / EST_SPEED_TAU;
+	e->P = F * e->P * F.transpose();
+	e->P(EST_X, EST_X) += EST_Q_POSITION * EST_Q_POSITION * dt;
+	e->P(EST_Y, EST_Y) += EST_Q_POSITION * EST_Q_POSITION * dt;
+	e->P(EST_HEADING, EST_HEADING) += EST_Q_HEADING * EST_Q_HEADING * dt;
+	e->P(EST_SPEED, EST_SPEED) += EST_Q_SPEED * EST_Q_SPEED * dt;
+	e->P(EST_BIAS, EST_BIAS) += EST_Q_BIAS * EST_Q_BIAS * dt;
+	e->t += dt;
+}
+
+void est_predict(est_snapshot * e, double t) {
+	while (e->t < t)
+		est_step(e, fmin(t - e->t, EST_MAX_STEP));
+}
+
+double wrap_angle(double a) {
+	a = fmod(a + M_PI, 2. * M_PI);
+	if (a < 0.)
+		a += 2. * M_PI;
+	return a - M_PI;
+}
+
+//scalar update, return 0 when the measurement was gated out
+int est_fuse(est_snapshot * e, int type, double value, double noise) {
+	est_vector H = est_vector::Zero();
+	double innovation;
+	switch (type) {
+	case EST_MEASURE_HEADING:
+		H(EST_HEADING) = 1.;
+		innovation = wrap_angle(value - e->s(EST_HEADING));
+		break;
+	case EST_MEASURE_YAW_RATE: {
+		double k = tan(e->steer) / EST_WHEELBASE;
+		H(EST_SPEED) = k;
+		H(EST_BIAS) = 1.;
+		innovation = value - (e->s(EST_SPEED) * k + e->s(EST_BIAS));
+		break;
+	}
+	case EST_MEASURE_SPEED:
+		H(EST_SPEED) = 1.;
+		innovation = value - e->s(EST_SPEED);
+		break;
+	default:
+		return 1;
+	}
+	est_vector PH = e->P * H;
+	double S = H.dot(PH) + noise * noise;
+	if (innovation * innovation / S > EST_GATE)
+		return 0;
+	est_vector K = PH / S;
+	e->s += K * innovation;
+	e->P -= K * PH.transpose();
+	e->P = 0.5 * (e->P + e->P.transpose());
+	return 1;
+}
+
+//start from the first heading, at rest at the origin
+void est_start(double t, double heading) {
+	est_current.t = t;
+	est_current.s = est_vector::Zero();
+	est_current.s(EST_HEADING) = heading;
+	est_current.P = est_matrix::Zero();
+	est_current.P(EST_HEADING, EST_HEADING) = pow(EST_INIT_HEADING * M_PI / 180.,
+			2);
+	est_current.P(EST_SPEED, EST_SPEED) = EST_INIT_SPEED * EST_INIT_SPEED;
+	est_current.P(EST_BIAS, EST_BIAS) = EST_INIT_BIAS * EST_INIT_BIAS;
+	est_current.type = EST_NONE;
+	est_history_size = 0;
+	est_initialized = 1;
+}
+
+void est_measure(double t, int type, double value, double noise) {
+	unsigned int i, n;
+	if (!est_initialized) {
+		if (type == EST_MEASURE_HEADING)
+			est_start(t, value);
+		return;
+	}
+	est_nb_measurements++;
+	if (t >= est_current.t) {
+		est_predict(&est_current, t);
+		if (!est_fuse(&est_current, type, value, noise))
+			est_nb_rejected++;
+		est_current.type = type;
+		est_current.value = value;
+		est_current.noise = noise;
+		history_insert(&est_current);
+		return;
+	}
+	//late, roll back to the last snapshot taken before the measurement
+	for (n = est_history_size; n > 0; n--)
+		if (history_at(n - 1)->t <= t)
+			break;
+	if (n == 0) {
+		est_nb_too_old++;
+		return;
+	}
+	est_nb_late++;
+	double now = est_current.t;
+	est_snapshot e = (*history_at(n - 1));
+	est_predict(&e, t);
+	if (!est_fuse(&e, type, value, noise))
+		est_nb_rejected++;
+	e.type = type;
+	e.value = value;
+	e.noise = noise;
+	for (i = history_insert(&e) + 1; i < est_history_size; i++) {
+		est_snapshot * next = history_at(i);
+		est_predict(&e, next->t);
+		e.steer = next->steer;
+		e.speed_command = next->speed_command;
+		e.type = next->type;
+		e.value = next->value;
+		e.noise = next->noise;
+		est_fuse(&e, e.type, e.value, e.noise);
+		(*next) = e;
+	}
+	est_predict(&e, now);
+	est_current = e;
+}
+
+void est_account(double start) {
+	double elapsed = monotonic_time() - start;
+	est_nb_calls++;
+	est_time += elapsed;
+	if (elapsed > est_time_max)
+		est_time_max = elapsed;
+}
+
+void init_estimator() {
+	est_current.t = 0.;
+	est_current.s.setZero();
+	est_current.P.setZero();
+	est_current.steer = 0.;
+	est_current.speed_command = 0.;
+	est_current.type = EST_NONE;
+	est_history_start = 0;
+	est_history_size = 0;
+	est_initialized = 0;
+}
+
+int estimator_ready() {
+	return est_initialized;
+}
+
+//called at the control rate, the estimate is moved to t
+void estimator_predict(double t) {
+	double start = monotonic_time();
+	if (est_initialized)
+		est_predict(&est_current, t);
+	est_account(start);
+}
+
+//servo and esc commands as sent, a negative steering turns right, heading increases
+void estimator_command(double t, float steering, float esc_speed) {
+	double start = monotonic_time();
+	double steer = -fmax(-1., fmin(1., steering)) * EST_MAX_STEER_ANGLE * M_PI
+			/ 180.;
+	double speed_command = fmax(0., fmin(1., esc_speed)) * EST_MAX_SPEED;
+	if (est_initialized && t >= est_current.t) {
+		est_predict(&est_current, t);
+		est_current.steer = steer;
+		est_current.speed_command = speed_command;
+		est_current.type = EST_NONE;
+		history_insert(&est_current);
+	} else {
+		//before the first heading, or issued before the latest measurement
+		est_current.steer = steer;
+		est_current.speed_command = speed_command;
+	}
+	est_account(start);
+}
+
+//compass heading in degrees, sampled at t
+void estimator_heading(double t, double heading) {
+	double start = monotonic_time();
+	est_measure(t, EST_MEASURE_HEADING, heading * M_PI / 180.,
+			EST_R_COMPASS * M_PI / 180.);
+	est_account(start);
+}
+
+//yaw rate in degrees/s from the compass or visual odometry, noise in degrees/s
+void estimator_yaw_rate(double t, double yaw_rate, double noise) {
+	double start = monotonic_time();
+	est_measure(t, EST_MEASURE_YAW_RATE, yaw_rate * M_PI / 180.,
+			noise * M_PI / 180.);
+	est_account(start);
+}
+
+//ground displacement in the bot frame measured by visual odometry over the dt
+//seconds before t, x forward
+void estimator_odometry(double t, double dt, float dx, float dy) {
+	double start = monotonic_time();
+	if (dt > 0.)
+		est_measure(t - dt / 2., EST_MEASURE_SPEED, dx / dt,
+				EST_R_VO_DISPLACEMENT / dt);
+	est_account(start);
+}
+
+void copy_estimate(est_snapshot * s, estimate * e) {
+	int i, j;
+	e->timestamp = s->t;
+	e->x = s->s(EST_X);
+	e->y = s->s(EST_Y);
+	e->heading = s->s(EST_HEADING) * 180. / M_PI;
+	e->speed = s->s(EST_SPEED);
+	e->yaw_rate_bias = s->s(EST_BIAS) * 180. / M_PI;
+	for (i = 0; i < EST_NB_STATES; i++)
+		for (j = 0; j < EST_NB_STATES; j++)
+			e->covariance[i][j] = s->P(i, j);
+}
+
+//return 0 until the first heading was received
+int get_estimate(estimate * e) {
+	if (!est_initialized)
+		return 0;
+	copy_estimate(&est_current, e);
+	return 1;
+}
+
+//estimate at a past time, from the last snapshot before it, or predicted ahead,
+//return 0 when t is older than the snapshots kept
+int get_estimate_at(double t, estimate * e) {
+	unsigned int n;
+	est_snapshot s;
+	if (!est_initialized)
+		return 0;
+	if (t >= est_current.t) {
+		s = est_current;
+	} else {
+		for (n = est_history_size; n > 0; n--)
+			if (history_at(n - 1)->t <= t)
+				break;
+		if (n == 0)
+			return 0;
+		s = (*history_at(n - 1));
+	}
+	est_predict(&s, t);
+	copy_estimate(&s, e);
+	return 1;
+}
+
+//move the pose and speed of an estimate to t with the steering command applied
+//since, covariance is left as is
+void extrapolate_estimate(estimate * e, double t, float steering) {
+	double dt = t - e->timestamp;
+	if (dt <= 0.)
+		return;
+	double steer = -fmax(-1., fmin(1., steering)) * EST_MAX_STEER_ANGLE * M_PI
+			/ 180.;
+	double yaw_rate = e->speed * tan(steer) / EST_WHEELBASE
+			+ e->yaw_rate_bias * M_PI / 180.;
+	double heading = e->heading * M_PI / 180. + yaw_rate * dt / 2.;
+	e->x += e->speed * cos(heading) * dt;
+	e->y += e->speed * sin(heading) * dt;
+	e->heading += yaw_rate * dt * 180. / M_PI;
+	e->timestamp = t;
+}
+
+void init_command_log(command_log * log) {
+	log->count = 0;
+}
+
+void log_command(command_log * log, double t, float steering) {
+	unsigned int i = log->count & (EST_COMMAND_LOG - 1);
+	log->t[i] = t;
+	log->steering[i] = steering;
+	log->count++;
+}
+
+//motion from start to end in the bot frame at start, x forward, y to the right,
+//dyaw in degrees. The wheels follow each logged command delay seconds after it was
+//sent, the motion is integrated in pieces between those changes at a constant speed.
+//Before the first command the wheels are straight, once the log wrapped they are
+//assumed to hold the oldest command kept.
+void predict_motion(command_log * log, double delay, double start, double end,
+		double speed, double yaw_rate_bias, float * dx, float * dy, float * dyaw) {
+	estimate e;
+	unsigned int n = (log->count < EST_COMMAND_LOG) ? log->count : EST_COMMAND_LOG;
+	unsigned int first = log->count - n, i;
+	float steering = (first > 0) ? log->steering[first & (EST_COMMAND_LOG - 1)] : 0.;
+	memset(&e, 0, sizeof(estimate));
+	e.timestamp = start;
+	e.speed = speed;
+	e.yaw_rate_bias = yaw_rate_bias;
+	for (i = first; i < log->count && e.timestamp < end; i++) {
+		unsigned int k = i & (EST_COMMAND_LOG - 1);
+		double change = log->t[k] + delay;
+		while (e.timestamp < fmin(change, end))
+			extrapolate_estimate(&e,
+					fmin(fmin(change, end), e.timestamp + EST_MAX_STEP), steering);
+		steering = log->steering[k];
+	}
+	while (e.timestamp < end)
+		extrapolate_estimate(&e, fmin(end, e.timestamp + EST_MAX_STEP), steering);
+	(*dx) = e.x;
+	(*dy) = e.y;
+	(*dyaw) = e.heading;
+}
+
+void print_estimator_stats() {
+	if (est_nb_calls == 0)
+		return;
+	printf("Estimator : %lu calls, mean %.1f us, max %.1f us, %lu measurements, %lu late, %lu too old, %lu rejected \n",
+			est_nb_calls, 1000000. * est_time / est_nb_calls,
+			1000000. * est_time_max, est_nb_measurements, est_nb_late,
+			est_nb_too_old, est_nb_rejected);
+}
+
+//deterministic gaussian noise for the test, Box-Muller on a LCG
+unsigned int test_random = 12345;
+double test_gaussian(double sigma) {
+	double u[2];
+	int i;
+	for (i = 0; i < 2; i++) {
+		test_random = test_random * 1103515245 + 12345;
+		u[i] = ((test_random >> 8) + 1.) / 16777218.;
+	}
+	return sigma * sqrt(-2. * log(u[0])) * cos(2. * M_PI * u[1]);
+}
+
+typedef struct test_event {
+	double delivery; //time the measurement reaches the estimator
+	double t; //time it was taken
+	int type;
+	double value, dt;
+} test_event;
+
+// test_estimator : replays a drive of the simulator's bicycle with a servo trim
+// and a slower esc than modelled, compass samples at 75Hz, odometry at 60Hz
+// delivered two frames late, commands and predictions at 60Hz. Reports the errors
+// against the true path, and against headings and odometry used separately.
+int test_estimator(int argc, char ** argv) {
+	const double fine_dt = 0.0005, duration = 20., frame = 1. / 60.,
+			compass_period = 1. / 75., vo_latency = 2. * frame;
+	const double trim = 2.0 * M_PI / 180.; //rad/s the servo turns with a 0 command
+	const double true_tau = 0.4, true_max_speed = 2200.;
+	test_event events[64];
+	unsigned int nb_events = 0, i;
+	double x = 0., y = 0., yaw = 30. * M_PI / 180., v = 0., t = 0.;
+	double steer = 0., esc = 0., next_frame = 0., next_compass = 0.;
+	double vo_last_t = 0., vo_last_x = 0., vo_last_y = 0., vo_last_yaw = 0.;
+	double sep_x = 0., sep_y = 0., sep_heading = 0.;
+	double err_pos2 = 0., err_sep2 = 0., err_head2 = 0., err_speed2 = 0.;
+	double err_pos_max = 0.;
+	unsigned long nb_err = 0;
+	estimate e;
+	memset(&e, 0, sizeof(estimate));
+	init_estimator();
+	while (t < duration) {
+		//a slalom then a long turn, the esc at half speed
+		esc = (t < 1.) ? 0. : 0.5;
+		if (t < 4.)
+			steer = 0.;
+		else if (t < 10.)
+			steer = 0.5 * sin(2. * M_PI * (t - 4.) / 3.);
+		else
+			steer = -0.6;
+		double wheel = -steer * EST_MAX_STEER_ANGLE * M_PI / 180.;
+		double target = esc * true_max_speed;
+		//truth
+		v += (target - v) * fine_dt / true_tau;
+		x += v * cos(yaw) * fine_dt;
+		y += v * sin(yaw) * fine_dt;
+		yaw += (v * tan(wheel) / EST_WHEELBASE + trim) * fine_dt;
+		t += fine_dt;
+		if (t >= next_compass) {
+			test_event * c = &(events[nb_events++]);
+			c->delivery = t + 0.002;
+			c->t = t;
+			c->type = EST_MEASURE_HEADING;
+			c->value = yaw * 180. / M_PI + test_gaussian(2.);
+			next_compass += compass_period;
+		}
+		if (t < next_frame)
+			continue;
+		next_frame += frame;
+		//odometry sees the displacement in the bot frame since the last frame
+		double dx = x - vo_last_x, dy = y - vo_last_y;
+		test_event * o = &(events[nb_events++]);
+		o->delivery = t + vo_latency;
+		o->t = t;
+		o->type = EST_MEASURE_SPEED;
+		o->dt = t - vo_last_t;
+		o->value = cos(vo_last_yaw) * dx + sin(vo_last_yaw) * dy
+				+ test_gaussian(2.);
+		vo_last_t = t;
+		vo_last_x = x;
+		vo_last_y = y;
+		vo_last_yaw = yaw;
+		//control tick : deliver what arrived, predict, command
+		unsigned int kept = 0;
+		for (i = 0; i < nb_events; i++) {
+			test_event * m = &(events[i]);
+			if (m->delivery > t) {
+				events[kept++] = (*m);
+				continue;
+			}
+			if (m->type == EST_MEASURE_HEADING) {
+				estimator_heading(m->t, m->value);
+				sep_heading = m->value;
+			} else {
+				estimator_odometry(m->t, m->dt, m->value, 0.);
+				sep_x += m->value * cos(sep_heading * M_PI / 180.);
+				sep_y += m->value * sin(sep_heading * M_PI / 180.);
+			}
+		}
+		nb_events = kept;
+		estimator_predict(t);
+		estimator_command(t, steer, esc);
+		if (!get_estimate(&e))
+			continue;
+		//the estimate starts at the origin, the truth at x, y = 0 too
+		double pos = hypot(e.x - x, e.y - y);
+		double head = wrap_angle((e.heading * M_PI / 180.) - yaw) * 180.
+				/ M_PI;
+		err_pos2 += pos * pos;
+		err_sep2 += pow(sep_x - x, 2) + pow(sep_y - y, 2);
+		err_head2 += head * head;
+		err_speed2 += pow(e.speed - v, 2);
+		if (pos > err_pos_max)
+			err_pos_max = pos;
+		nb_err++;
+	}
+	if (nb_err == 0) {
+		printf("No estimate produced \nFAIL \n");
+		return -1;
+	}
+	double pos_rms = sqrt(err_pos2 / nb_err), head_rms = sqrt(err_head2 / nb_err);
+	double speed_rms = sqrt(err_speed2 / nb_err);
+	printf("%.0f s, %.1f m driven \n", duration, hypot(x, y) / 1000.);
+	printf("Fused : position rms %.0f mm, max %.0f mm, final %.0f mm, heading rms %.2f deg, speed rms %.0f mm/s \n",
+			pos_rms, err_pos_max, hypot(e.x - x, e.y - y), head_rms, speed_rms);
+	printf("Fused : yaw rate bias %.2f deg/s for %.2f deg/s, position std %.0f mm \n",
+			e.yaw_rate_bias, trim * 180. / M_PI,
+			sqrt(e.covariance[EST_X][EST_X] + e.covariance[EST_Y][EST_Y]));
+	printf("Separate compass and odometry : position rms %.0f mm \n",
+			sqrt(err_sep2 / nb_err));
+	print_estimator_stats();
+	int ok = head_rms < 2. && speed_rms < 150.
+			&& pos_rms < sqrt(err_sep2 / nb_err)
+			&& est_time / est_nb_calls < 50e-6;
+	printf("%s \n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : -1;
+}
@@ -0,0 +1,71 @@
+#include "fft.hpp"
+
+//Radix-2 complex FFT for power of two sizes up to FFT_MAX_SIZE.
+//Inverse transforms are not normalized.
+
+complexf fft_twiddles[FFT_MAX_SIZE / 2];
+complexf fft_buffer[FFT_MAX_SIZE];
+
+void fft_contiguous(complexf * x, unsigned int n, int inverse) {
+	unsigned int i, j, k, len, bit;
+	for (i = 1, j = 0; i < n; i++) {
+		for (bit = n >> 1; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j) {
+			complexf temp = x[i];
+			x[i] = x[j];
+			x[j] = temp;
+		}
+	}
+	for (len = 2; len <= n; len <<= 1) {
+		unsigned int half = len >> 1;
+		unsigned int step = FFT_MAX_SIZE / len;
+		for (i = 0; i < n; i += len) {
+			for (k = 0; k < half; k++) {
+				complexf w = fft_twiddles[k * step];
+				if (inverse)
+					w.im = -w.im;
+				complexf * a = &(x[i + k]);
+				complexf * b = &(x[i + k + half]);
+				float vr = b->re * w.re - b->im * w.im;
+				float vi = b->re * w.im + b->im * w.re;
+				b->re = a->re - vr;
+				b->im = a->im - vi;
+				a->re += vr;
+				a->im += vi;
+			}
+		}
+	}
+}
+
+void fft(complexf * data, unsigned int n, unsigned int stride, int inverse) {
+	unsigned int i;
+	if (stride == 1) {
+		fft_contiguous(data, n, inverse);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		fft_buffer[i] = data[i * stride];
+	fft_contiguous(fft_buffer, n, inverse);
+	for (i = 0; i < n; i++)
+		data[i * stride] = fft_buffer[i];
+}
+
+//data is stored row first
+void fft_2d(complexf * data, unsigned int rows, unsigned int cols,
+		int inverse) {
+	unsigned int i;
+	for (i = 0; i < rows; i++)
+		fft(&(data[i * cols]), cols, 1, inverse);
+	for (i = 0; i < cols; i++)
+		fft(&(data[i]), rows, cols, inverse);
+}
+
+void init_fft() {
+	unsigned int i;
+	for (i = 0; i < FFT_MAX_SIZE / 2; i++) {
+		fft_twiddles[i].re = cos(-2.0 * M_PI * i / FFT_MAX_SIZE);
+		fft_twiddles[i].im = sin(-2.0 * M_PI * i / FFT_MAX_SIZE);
+	}
+}
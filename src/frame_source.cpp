@@ -0,0 +1,208 @@
+#include "frame_source.hpp"
+#include "profiler.hpp"
+
+//Frames are delivered in pooled gray buffers with a CLOCK_MONOTONIC timestamp taken
+//when the frame becomes available and a sequence number counted in camera frame
+//periods, so that gaps in the sequence are frames the camera produced but we missed.
+
+unsigned long acquisition_bytes = 0; //bytes read and written to produce gray frames
+unsigned char * frame_rows = NULL; //rows read by the detectors, NULL converts whole frames
+unsigned int frame_seq = 0;
+unsigned long frames_dropped = 0;
+double last_frame_time = 0.;
+int has_frame = 0;
+int input_is_file = 0;
+double replay_start = 0.;
+double time_offset = 0.; //frame source time minus monotonic time
+Mat decoded_frame;
+
+//fill a pooled gray frame, the frame buffer is reused since sizes match
+//color frames only get the rows read by the detectors converted
+void frame_to_gray(Mat & img, Mat & gray) {
+	if (img.channels() > 1) {
+		if (frame_rows == NULL || img.rows != IMAGE_HEIGHT) {
+			cvtColor(img, gray, COLOR_BGR2GRAY);
+			acquisition_bytes += (img.total() * img.channels()) + gray.total();
+		} else {
+			acquisition_bytes += convert_rows_to_gray(img, gray, frame_rows);
+		}
+	} else {
+		img.copyTo(gray);
+		acquisition_bytes += 2 * img.total();
+	}
+}
+
+//camera frames are numbered from the time elapsed since the last one
+void stamp_camera_frame(frame_slot * slot, double t) {
+	unsigned int periods = 1;
+	if (has_frame) {
+		periods = (unsigned int) (((t - last_frame_time) * FPS) + 0.5);
+		if (periods < 1)
+			periods = 1;
+		frame_seq += periods;
+		frames_dropped += periods - 1;
+	}
+	has_frame = 1;
+	last_frame_time = t;
+	slot->timestamp = t;
+	slot->seq = frame_seq;
+}
+
+//files are replayed at the camera rate, frames are stamped with their due time
+void wait_file_frame(frame_slot * slot) {
+	struct timespec due;
+	if (!has_frame) {
+		replay_start = monotonic_time();
+		has_frame = 1;
+	} else {
+		frame_seq++;
+	}
+	double t = replay_start + ((double) frame_seq) / FPS;
+	due.tv_sec = (time_t) t;
+	due.tv_nsec = (long) ((t - due.tv_sec) * 1000000000.0);
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+	slot->timestamp = t;
+	slot->seq = frame_seq;
+}
+
+#ifdef PI_CAM
+#include "RaspiCamCV.h"
+
+RaspiCamCvCapture * capture;
+VideoCapture capture_from_file;
+
+int init_frame_source_camera() {
+	RASPIVID_CONFIG * config = (RASPIVID_CONFIG*)malloc(sizeof(RASPIVID_CONFIG));
+	RASPIVID_PROPERTIES * properties = (RASPIVID_PROPERTIES*)malloc(sizeof(RASPIVID_PROPERTIES));
+	config->width=IMAGE_WIDTH;
+	config->height=IMAGE_HEIGHT;
+	config->bitrate=0;      // zero: leave as default
+	config->framerate=FPS;
+	config->monochrome=1; //only the Y plane is used, no color conversion in the camera callback
+	properties->hflip = HFLIP;
+	properties->vflip = VFLIP;
+	properties -> sharpness = 0;
+	properties -> contrast = 0;
+	properties -> brightness = 50;
+	properties -> saturation = 0;
+	properties -> exposure = AUTO;
+	properties -> shutter_speed = 0;// 0 is autoo
+	capture = (RaspiCamCvCapture *) raspiCamCvCreateCameraCapture3(0, config, properties, 1);
+	return 1;
+}
+
+int init_frame_source_file(char * path) {
+	if (!capture_from_file.open(path)) {
+		printf("Capture from %s didn't work \n", path);
+		return 0;
+	}
+	input_is_file = 1;
+	return 1;
+}
+
+//block until the next camera or file frame, return 0 at end of input
+int read_input_frame(frame_slot * slot) {
+	if(input_is_file) {
+		capture_from_file >> decoded_frame;
+		if (decoded_frame.empty())
+			return 0;
+		wait_file_frame(slot);
+		frame_to_gray(decoded_frame, slot->img);
+		return 1;
+	} else {
+		//grab waits for the camera callback to signal a new frame
+		while (raspiCamCvGrab(capture) == 0)
+			usleep(500);
+		stamp_camera_frame(slot, monotonic_time());
+		//the camera image is overwritten by the next frame callback, the Y plane
+		//is copied once in a pooled buffer that stages can hold
+		IplImage* image = raspiCamCvRetrieve(capture);
+		Mat y_plane = cvarrToMat(image);
+		frame_to_gray(y_plane, slot->img);
+		return 1;
+	}
+}
+
+#else
+
+VideoCapture capture;
+
+int init_frame_source_camera() {
+	if (!capture.open(0)) {
+		printf("Capture from camera #0 didn't work \n");
+		return 0;
+	}
+	return 1;
+}
+
+int init_frame_source_file(char * path) {
+	if (!capture.open(path)) {
+		printf("Capture from %s didn't work \n", path);
+		return 0;
+	}
+	input_is_file = 1;
+	return 1;
+}
+
+//block until the next camera or file frame, return 0 at end of input
+int read_input_frame(frame_slot * slot) {
+	capture >> decoded_frame;
+	if (decoded_frame.empty())
+		return 0;
+	if (input_is_file) {
+		wait_file_frame(slot);
+	} else {
+		stamp_camera_frame(slot, monotonic_time());
+	}
+	frame_to_gray(decoded_frame, slot->img);
+	return 1;
+}
+
+#endif
+
+//recordings are replayed with their capture timestamps, latencies are measured
+//from the time frames are delivered
+int init_frame_source_replay(char * path, int realtime) {
+	return init_replay(path, realtime);
+}
+
+//simulated frames are stamped with the simulation time
+int init_frame_source_simulator(char * track_path, double actuation_delay) {
+	return init_simulator(track_path, actuation_delay);
+}
+
+//block until the next frame, return 0 at end of input
+int frame_source_read(frame_slot * slot) {
+	PROFILE_SCOPE(PROFILE_GRAB);
+	if (is_simulating()) {
+		if (!sim_read_frame(slot, frame_rows))
+			return 0;
+		time_offset = slot->timestamp - monotonic_time();
+	} else if (is_replaying()) {
+		if (!replay_frame(slot))
+			return 0;
+		time_offset = slot->timestamp - monotonic_time();
+	} else if (!read_input_frame(slot)) {
+		return 0;
+	}
+	if (is_recording())
+		record_frame(slot);
+	return 1;
+}
+
+//current time in the time base of frame timestamps
+double frame_source_time() {
+	return monotonic_time() + time_offset;
+}
+
+void set_frame_source_rows(unsigned char * row_mask) {
+	frame_rows = row_mask;
+}
+
+unsigned long frame_source_dropped() {
+	return frames_dropped;
+}
+
+unsigned long frame_source_bytes() {
+	return acquisition_bytes;
+}
@@ -0,0 +1,289 @@
+#include "klt_tracker.hpp"
+
+//Sparse pyramidal Lucas-Kanade tracker working on a grayscale region of interest.
+//Patches are interpolated with fixed point bilinear weights and gradients are
+//computed on the interpolated patch so that nothing but the pyramid is built per frame.
+
+#define KLT_W_BITS 14 //fractional bits of the bilinear weights
+#define KLT_PATCH_BITS 5 //fractional bits kept on interpolated pixel values
+#define KLT_WINDOW (2*KLT_HALF_WINDOW+1)
+#define KLT_PATCH (KLT_WINDOW+2) //window plus one pixel border for the gradients
+#define KLT_BORDER ((KLT_HALF_WINDOW + 2) << (KLT_PYRAMID_LEVELS - 1))
+#define KLT_EPSILON 0.01 //squared displacement update at which iterations stop
+#define KLT_MIN_EIGEN 16.0 //minimum eigenvalue of the structure tensor, in gray level^2 per pixel
+
+typedef struct klt_pyramid {
+	unsigned char * level[KLT_PYRAMID_LEVELS];
+	unsigned int w[KLT_PYRAMID_LEVELS];
+	unsigned int h[KLT_PYRAMID_LEVELS];
+} klt_pyramid;
+
+klt_pyramid klt_pyramids[2];
+klt_pyramid * klt_prev = NULL;
+klt_pyramid * klt_next = NULL;
+int klt_has_prev = 0;
+
+float klt_x[KLT_MAX_FEATURES];
+float klt_y[KLT_MAX_FEATURES];
+float klt_dx[KLT_MAX_FEATURES]; //last displacement, used as prediction for next frame
+float klt_dy[KLT_MAX_FEATURES];
+float klt_kx[KLT_MAX_FEATURES]; //position in the keyframe
+float klt_ky[KLT_MAX_FEATURES];
+int klt_in_keyframe[KLT_MAX_FEATURES]; //features found after the keyframe have no keyframe position
+unsigned int klt_nb_features = 0;
+
+void klt_build_pyramid(klt_pyramid * pyr, unsigned char * img,
+		unsigned int step) {
+	unsigned int i, j, l;
+	for (i = 0; i < pyr->h[0]; i++) {
+		memcpy(&(pyr->level[0][i * pyr->w[0]]), &(img[i * step]), pyr->w[0]);
+	}
+	for (l = 1; l < KLT_PYRAMID_LEVELS; l++) {
+		unsigned char * src = pyr->level[l - 1];
+		unsigned char * dst = pyr->level[l];
+		unsigned int src_w = pyr->w[l - 1];
+		for (i = 0; i < pyr->h[l]; i++) {
+			unsigned char * r0 = &(src[(2 * i) * src_w]);
+			unsigned char * r1 = r0 + src_w;
+			for (j = 0; j < pyr->w[l]; j++) {
+				dst[i * pyr->w[l] + j] = (r0[2 * j] + r0[2 * j + 1] + r1[2 * j]
+						+ r1[2 * j + 1] + 2) >> 2;
+			}
+		}
+	}
+}
+
+//interpolate a size x size patch whose top left corner is at (x, y)
+//return 0 if the patch does not fit in the image
+int klt_interpolate(unsigned char * img, unsigned int w, unsigned int h,
+		float x, float y, int size, int * patch) {
+	int i, j;
+	int ix = (int) floor(x);
+	int iy = (int) floor(y);
+	if (ix < 0 || iy < 0 || (ix + size) >= (int) w || (iy + size) >= (int) h)
+		return 0;
+	float a = x - ix;
+	float b = y - iy;
+	int w00 = (int) ((1.f - a) * (1.f - b) * (1 << KLT_W_BITS) + 0.5f);
+	int w01 = (int) (a * (1.f - b) * (1 << KLT_W_BITS) + 0.5f);
+	int w10 = (int) ((1.f - a) * b * (1 << KLT_W_BITS) + 0.5f);
+	int w11 = (1 << KLT_W_BITS) - w00 - w01 - w10;
+	for (i = 0; i < size; i++) {
+		unsigned char * r0 = &(img[(iy + i) * w + ix]);
+		unsigned char * r1 = r0 + w;
+		for (j = 0; j < size; j++) {
+			int val = r0[j] * w00 + r0[j + 1] * w01 + r1[j] * w10
+					+ r1[j + 1] * w11;
+			patch[i * size + j] = (val
+					+ (1 << (KLT_W_BITS - KLT_PATCH_BITS - 1)))
+					>> (KLT_W_BITS - KLT_PATCH_BITS);
+		}
+	}
+	return 1;
+}
+
+//track point (x, y) of pyramid "from" into pyramid "to"
+//(tx, ty) holds the predicted position on input and the tracked position on output
+int klt_track_point(klt_pyramid * from, klt_pyramid * to, float x, float y,
+		float * tx, float * ty) {
+	int i, j, l, k;
+	int I[KLT_PATCH * KLT_PATCH];
+	int J[KLT_WINDOW * KLT_WINDOW];
+	int Ix[KLT_WINDOW * KLT_WINDOW];
+	int Iy[KLT_WINDOW * KLT_WINDOW];
+	float vx = ((*tx) - x) / (1 << (KLT_PYRAMID_LEVELS - 1));
+	float vy = ((*ty) - y) / (1 << (KLT_PYRAMID_LEVELS - 1));
+	for (l = KLT_PYRAMID_LEVELS - 1; l >= 0; l--) {
+		float scale = 1.f / (1 << l);
+		float px = x * scale;
+		float py = y * scale;
+		long long gxx = 0, gxy = 0, gyy = 0;
+		if (!klt_interpolate(from->level[l], from->w[l], from->h[l],
+				px - KLT_HALF_WINDOW - 1, py - KLT_HALF_WINDOW - 1, KLT_PATCH,
+				I))
+			return 0;
+		for (i = 0; i < KLT_WINDOW; i++) {
+			for (j = 0; j < KLT_WINDOW; j++) {
+				int * c = &(I[(i + 1) * KLT_PATCH + (j + 1)]);
+				//central differences, gradient is scaled by 2
+				int dx = c[1] - c[-1];
+				int dy = c[KLT_PATCH] - c[-KLT_PATCH];
+				Ix[i * KLT_WINDOW + j] = dx;
+				Iy[i * KLT_WINDOW + j] = dy;
+				gxx += dx * dx;
+				gxy += dx * dy;
+				gyy += dy * dy;
+			}
+		}
+		//back to gray level units, the 4 comes from the doubled gradient
+		float norm = 1.f
+				/ (4.f * (1 << (2 * KLT_PATCH_BITS)) * KLT_WINDOW * KLT_WINDOW);
+		float a = gxx * norm, b = gxy * norm, c = gyy * norm;
+		float min_eigen = ((a + c) - sqrt((a - c) * (a - c) + 4.f * b * b))
+				/ 2.f;
+		if (min_eigen < KLT_MIN_EIGEN)
+			return 0;
+		float det = (float) gxx * (float) gyy - (float) gxy * (float) gxy;
+		for (k = 0; k < KLT_MAX_ITERATIONS; k++) {
+			long long bx = 0, by = 0;
+			if (!klt_interpolate(to->level[l], to->w[l], to->h[l],
+					px + vx - KLT_HALF_WINDOW, py + vy - KLT_HALF_WINDOW,
+					KLT_WINDOW, J))
+				return 0;
+			for (i = 0; i < KLT_WINDOW; i++) {
+				for (j = 0; j < KLT_WINDOW; j++) {
+					int diff = I[(i + 1) * KLT_PATCH + (j + 1)]
+							- J[i * KLT_WINDOW + j];
+					bx += diff * Ix[i * KLT_WINDOW + j];
+					by += diff * Iy[i * KLT_WINDOW + j];
+				}
+			}
+			//solve G.eta = b, the factor 2 compensates the doubled gradient
+			float etax = 2.f * ((float) gyy * bx - (float) gxy * by) / det;
+			float etay = 2.f * ((float) gxx * by - (float) gxy * bx) / det;
+			vx += etax;
+			vy += etay;
+			if ((etax * etax + etay * etay) < KLT_EPSILON)
+				break;
+		}
+		if (l > 0) {
+			vx *= 2.f;
+			vy *= 2.f;
+		}
+	}
+	(*tx) = x + vx;
+	(*ty) = y + vy;
+	return 1;
+}
+
+void klt_replenish_features(klt_pyramid * pyr) {
+	int nb_corners, i, stride;
+	unsigned int j;
+	xy * corners = fast9_detect_nonmax(
+			pyr->level[0] + (KLT_BORDER * pyr->w[0]) + KLT_BORDER,
+			pyr->w[0] - 2 * KLT_BORDER, pyr->h[0] - 2 * KLT_BORDER, pyr->w[0],
+			KLT_FAST_THRESHOLD, &nb_corners);
+	if (corners == NULL)
+		return;
+	//corners come in raster order, striding spreads the new features on the roi
+	stride = (nb_corners / KLT_MAX_FEATURES) + 1;
+	for (i = 0; i < nb_corners && klt_nb_features < KLT_MAX_FEATURES; i +=
+			stride) {
+		float cx = corners[i].x + KLT_BORDER;
+		float cy = corners[i].y + KLT_BORDER;
+		float closest = pyr->w[0] * pyr->w[0];
+		float dx = 0., dy = 0.;
+		for (j = 0; j < klt_nb_features; j++) {
+			float d = (klt_x[j] - cx) * (klt_x[j] - cx)
+					+ (klt_y[j] - cy) * (klt_y[j] - cy);
+			if (d < closest) {
+				closest = d;
+				//new feature moves like its closest neighbour
+				dx = klt_dx[j];
+				dy = klt_dy[j];
+			}
+		}
+		if (closest < (KLT_MIN_DISTANCE * KLT_MIN_DISTANCE))
+			continue;
+		klt_x[klt_nb_features] = cx;
+		klt_y[klt_nb_features] = cy;
+		klt_dx[klt_nb_features] = dx;
+		klt_dy[klt_nb_features] = dy;
+		klt_in_keyframe[klt_nb_features] = 0;
+		klt_nb_features++;
+	}
+	free(corners);
+}
+
+int klt_track_features(unsigned char * img, unsigned int step,
+		klt_track * tracks, unsigned int max_tracks, klt_predictor predict) {
+	unsigned int i, nb_kept = 0, nb_tracks = 0;
+	klt_pyramid * temp = klt_prev;
+	klt_prev = klt_next;
+	klt_next = temp;
+	klt_build_pyramid(klt_next, img, step);
+	if (klt_has_prev) {
+		for (i = 0; i < klt_nb_features; i++) {
+			float tx, ty;
+			if (predict != NULL) {
+				predict(klt_x[i], klt_y[i], &tx, &ty);
+				klt_dx[i] = tx - klt_x[i];
+				klt_dy[i] = ty - klt_y[i];
+			} else {
+				tx = klt_x[i] + klt_dx[i];
+				ty = klt_y[i] + klt_dy[i];
+			}
+			if (!klt_track_point(klt_prev, klt_next, klt_x[i], klt_y[i], &tx,
+					&ty))
+				continue;
+			//forward-backward check, backward tracking starts from the prediction only
+			float bx = tx - klt_dx[i], by = ty - klt_dy[i];
+			if (!klt_track_point(klt_next, klt_prev, tx, ty, &bx, &by))
+				continue;
+			if (((bx - klt_x[i]) * (bx - klt_x[i])
+					+ (by - klt_y[i]) * (by - klt_y[i]))
+					> (KLT_FB_THRESHOLD * KLT_FB_THRESHOLD))
+				continue;
+			if (klt_in_keyframe[i] && nb_tracks < max_tracks) {
+				tracks[nb_tracks].x0 = klt_kx[i];
+				tracks[nb_tracks].y0 = klt_ky[i];
+				tracks[nb_tracks].x1 = tx;
+				tracks[nb_tracks].y1 = ty;
+				nb_tracks++;
+			}
+			klt_dx[nb_kept] = tx - klt_x[i];
+			klt_dy[nb_kept] = ty - klt_y[i];
+			klt_x[nb_kept] = tx;
+			klt_y[nb_kept] = ty;
+			klt_kx[nb_kept] = klt_kx[i];
+			klt_ky[nb_kept] = klt_ky[i];
+			klt_in_keyframe[nb_kept] = klt_in_keyframe[i];
+			nb_kept++;
+		}
+		klt_nb_features = nb_kept;
+	}
+	if (klt_nb_features < KLT_MIN_FEATURES) {
+		klt_replenish_features(klt_next);
+	}
+	klt_has_prev = 1;
+	return nb_tracks;
+}
+
+//current positions become the reference that tracks are reported against
+void klt_set_keyframe() {
+	unsigned int i;
+	for (i = 0; i < klt_nb_features; i++) {
+		klt_kx[i] = klt_x[i];
+		klt_ky[i] = klt_y[i];
+		klt_in_keyframe[i] = 1;
+	}
+}
+
+void reset_klt_tracker() {
+	klt_has_prev = 0;
+	klt_nb_features = 0;
+}
+
+void init_klt_tracker(unsigned int w, unsigned int h) {
+	int i, l;
+	for (i = 0; i < 2; i++) {
+		for (l = 0; l < KLT_PYRAMID_LEVELS; l++) {
+			klt_pyramids[i].w[l] = w >> l;
+			klt_pyramids[i].h[l] = h >> l;
+			klt_pyramids[i].level[l] = (unsigned char *) malloc(
+					klt_pyramids[i].w[l] * klt_pyramids[i].h[l]);
+		}
+	}
+	klt_prev = &(klt_pyramids[0]);
+	klt_next = &(klt_pyramids[1]);
+	reset_klt_tracker();
+}
+
+void close_klt_tracker() {
+	int i, l;
+	for (i = 0; i < 2; i++) {
+		for (l = 0; l < KLT_PYRAMID_LEVELS; l++) {
+			free(klt_pyramids[i].level[l]);
+		}
+	}
+}
@@ -0,0 +1,90 @@
+#include "latency_histogram.hpp"
+
+void init_latency_histogram(latency_histogram * h, double deadline) {
+	memset(h, 0, sizeof(latency_histogram));
+	h->deadline_us = (unsigned long) (deadline * 1000000.);
+}
+
+unsigned int latency_bucket(unsigned long us) {
+	if (us < (1UL << LATENCY_SUB_BUCKET_BITS))
+		return us;
+	if (us >= (1UL << LATENCY_MAX_BITS))
+		return LATENCY_NB_BUCKETS - 1;
+	unsigned int shift = (63 - __builtin_clzl(us)) - (LATENCY_SUB_BUCKET_BITS - 1);
+	unsigned long sub = (us >> shift) - (1UL << (LATENCY_SUB_BUCKET_BITS - 1));
+	return (1 << LATENCY_SUB_BUCKET_BITS)
+			+ (shift - 1) * (1 << (LATENCY_SUB_BUCKET_BITS - 1)) + sub;
+}
+
+//highest value falling in a bucket
+unsigned long latency_bucket_value(unsigned int bucket) {
+	if (bucket < (1 << LATENCY_SUB_BUCKET_BITS))
+		return bucket;
+	unsigned int i = bucket - (1 << LATENCY_SUB_BUCKET_BITS);
+	unsigned int shift = (i >> (LATENCY_SUB_BUCKET_BITS - 1)) + 1;
+	unsigned long sub = (i & ((1 << (LATENCY_SUB_BUCKET_BITS - 1)) - 1))
+			+ (1UL << (LATENCY_SUB_BUCKET_BITS - 1));
+	return ((sub + 1) << shift) - 1;
+}
+
+//latency in seconds, return 1 if it exceeds the deadline
+int record_latency(latency_histogram * h, double latency) {
+	unsigned long us = (latency > 0.) ? (unsigned long) (latency * 1000000.) : 0;
+	h->counts[latency_bucket(us)]++;
+	h->count++;
+	h->sum += latency;
+	if (us > h->max_us)
+		h->max_us = us;
+	if (us > h->deadline_us) {
+		h->nb_deadline_miss++;
+		return 1;
+	}
+	return 0;
+}
+
+//percentile in [0, 100], returned in seconds
+double latency_percentile(latency_histogram * h, double percentile) {
+	unsigned int i;
+	unsigned long seen = 0;
+	if (h->count == 0)
+		return 0.;
+	unsigned long rank = (unsigned long) ((percentile / 100.) * h->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < LATENCY_NB_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= rank) {
+			unsigned long us = latency_bucket_value(i);
+			return ((us < h->max_us) ? us : h->max_us) / 1000000.;
+		}
+	}
+	return h->max_us / 1000000.;
+}
+
+//add the samples of another histogram, both writers stopped
+void merge_latency_histogram(latency_histogram * h, latency_histogram * from) {
+	unsigned int i;
+	for (i = 0; i < LATENCY_NB_BUCKETS; i++)
+		h->counts[i] += from->counts[i];
+	h->count += from->count;
+	h->nb_deadline_miss += from->nb_deadline_miss;
+	h->sum += from->sum;
+	if (from->max_us > h->max_us)
+		h->max_us = from->max_us;
+}
+
+void print_latency_histogram(const char * name, latency_histogram * h) {
+	if (h->count == 0) {
+		printf("%s : no sample \n", name);
+		return;
+	}
+	printf("%s : %lu samples, mean %.2f ms, p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, p99.9 %.2f ms, max %.2f ms \n",
+			name, h->count, 1000. * h->sum / h->count,
+			1000. * latency_percentile(h, 50.),
+			1000. * latency_percentile(h, 90.),
+			1000. * latency_percentile(h, 99.),
+			1000. * latency_percentile(h, 99.9), h->max_us / 1000.);
+	printf("%s : %lu deadline misses over %.2f ms (%.1f%%) \n", name,
+			h->nb_deadline_miss, h->deadline_us / 1000.,
+			100. * h->nb_deadline_miss / h->count);
+}
@@ -0,0 +1,217 @@
+#include "magnetometer.hpp"
+
+//Magnetometer processing : hard and soft iron correction fitted on a spin of the bot,
+//heading and yaw rate from an alpha-beta filter on the unwrapped heading. The
+//correction is a fixed 3x3 transform, the filter a few operations per sample, both
+//run at the sensor rate in the compass thread.
+//Without an accelerometer tilt cannot be compensated, samples whose horizontal field
+//moved away from the calibrated one (tilt, motor current) are rejected and the
+//filter coasts on its yaw rate.
+
+//angle in [-180, 180)
+double wrap_heading(double angle) {
+	angle = fmod(angle + 180., 360.);
+	if (angle < 0.)
+		angle += 360.;
+	return angle - 180.;
+}
+
+void init_mag_calibration(mag_calibration * cal) {
+	memset(cal, 0, sizeof(mag_calibration));
+	cal->soft[0][0] = 1.;
+	cal->soft[1][1] = 1.;
+	cal->soft[2][2] = 1.;
+}
+
+//data registers are in x, z, y order
+void correct_mag(mag_calibration * cal, short * mag, double * corrected) {
+	double d[3] = { mag[0] - cal->offset[0], mag[2] - cal->offset[1], mag[1]
+			- cal->offset[2] };
+	int i;
+	for (i = 0; i < 3; i++)
+		corrected[i] = cal->soft[i][0] * d[0] + cal->soft[i][1] * d[1]
+				+ cal->soft[i][2] * d[2];
+}
+
+double mag_heading(double * corrected) {
+	return atan2(corrected[1], corrected[0]) * 180. / M_PI;
+}
+
+//x^T Q x + 2 l^T x = 1 fitted by least squares on centered samples, the correction
+//maps the ellipsoid to a sphere of the same volume. A flat spin leaves z unobserved,
+//an ellipse is then fitted in the horizontal plane and z is only centered.
+int fit_quadric(MatrixXd & p, int dim, mag_calibration * cal, double * mean) {
+	int nb_params = (dim == 3) ? 9 : 5, i;
+	MatrixXd design(p.rows(), nb_params);
+	VectorXd ones = VectorXd::Ones(p.rows());
+	for (i = 0; i < p.rows(); i++) {
+		double x = p(i, 0), y = p(i, 1), z = p(i, 2);
+		if (dim == 3)
+			design.row(i) << x * x, y * y, z * z, 2 * x * y, 2 * x * z, 2 * y * z, 2
+					* x, 2 * y, 2 * z;
+		else
+			design.row(i) << x * x, y * y, 2 * x * y, 2 * x, 2 * y;
+	}
+	VectorXd v = design.jacobiSvd(ComputeThinU | ComputeThinV).solve(ones);
+	MatrixXd q(dim, dim);
+	VectorXd l(dim);
+	if (dim == 3) {
+		q << v(0), v(3), v(4), v(3), v(1), v(5), v(4), v(5), v(2);
+		l << v(6), v(7), v(8);
+	} else {
+		q << v(0), v(2), v(2), v(1);
+		l << v(3), v(4);
+	}
+	VectorXd center = -q.ldlt().solve(l);
+	double k = 1. + center.dot(q * center);
+	if (!(k > 0.))
+		return 0;
+	SelfAdjointEigenSolver<MatrixXd> eigen(q / k);
+	VectorXd lambda = eigen.eigenvalues();
+	if (lambda.minCoeff() <= 0.)
+		return 0;
+	double radius = pow(lambda.prod(), -1. / (2. * dim));
+	MatrixXd soft = radius * eigen.eigenvectors()
+			* lambda.cwiseSqrt().asDiagonal() * eigen.eigenvectors().transpose();
+	init_mag_calibration(cal);
+	for (i = 0; i < 3; i++)
+		cal->offset[i] = mean[i] + ((i < dim) ? center(i) : 0.);
+	for (i = 0; i < dim * dim; i++)
+		cal->soft[i / dim][i % dim] = soft(i / dim, i % dim);
+	return 1;
+}
+
+//mag holds raw data registers recorded while the bot turns at least once, return 0
+//when the samples do not cover every direction or no ellipsoid fits them
+int fit_mag_calibration(short (*mag)[3], unsigned int nb_samples,
+		mag_calibration * cal) {
+	double mean[3] = { 0., 0., 0. }, min[3], max[3];
+	unsigned int i, j, sectors[MAG_CALIBRATION_SECTORS];
+	if (nb_samples < MAG_CALIBRATION_MIN_SAMPLES)
+		return 0;
+	MatrixXd p(nb_samples, 3);
+	for (i = 0; i < nb_samples; i++) {
+		p(i, 0) = mag[i][0];
+		p(i, 1) = mag[i][2];
+		p(i, 2) = mag[i][1];
+	}
+	for (j = 0; j < 3; j++) {
+		mean[j] = p.col(j).mean();
+		min[j] = p.col(j).minCoeff();
+		max[j] = p.col(j).maxCoeff();
+		p.col(j).array() -= mean[j];
+	}
+	double spread_xy = fmin(max[0] - min[0], max[1] - min[1]);
+	int dim = (max[2] - min[2] < MAG_FLAT_RATIO * spread_xy) ? 2 : 3;
+	if (spread_xy <= 0. || !fit_quadric(p, dim, cal, mean))
+		return 0;
+	memset(sectors, 0, sizeof(sectors));
+	double field = 0.;
+	for (i = 0; i < nb_samples; i++) {
+		double c[3];
+		correct_mag(cal, mag[i], c);
+		field += hypot(c[0], c[1]);
+		int s = (int) ((wrap_heading(mag_heading(c)) + 180.) / 360.
+				* MAG_CALIBRATION_SECTORS);
+		sectors[s % MAG_CALIBRATION_SECTORS]++;
+	}
+	for (j = 0; j < MAG_CALIBRATION_SECTORS; j++)
+		if (sectors[j] == 0)
+			return 0;
+	cal->field = field / nb_samples;
+	cal->valid = 1;
+	return 1;
+}
+
+int save_mag_calibration(const char * path, mag_calibration * cal) {
+	FILE * f = fopen(path, "w");
+	if (f == NULL) {
+		perror(path);
+		return 0;
+	}
+	fprintf(f, "# magnetometer calibration, corrected = soft * (raw - offset), x y z axes\n");
+	fprintf(f, "offset %.6f %.6f %.6f\n", cal->offset[0], cal->offset[1],
+			cal->offset[2]);
+	fprintf(f, "soft %.9f %.9f %.9f %.9f %.9f %.9f %.9f %.9f %.9f\n",
+			cal->soft[0][0], cal->soft[0][1], cal->soft[0][2], cal->soft[1][0],
+			cal->soft[1][1], cal->soft[1][2], cal->soft[2][0], cal->soft[2][1],
+			cal->soft[2][2]);
+	fprintf(f, "field %.6f\n", cal->field);
+	fclose(f);
+	return 1;
+}
+
+//leave the identity correction when the file is missing or incomplete
+int load_mag_calibration(const char * path, mag_calibration * cal) {
+	char line[256];
+	mag_calibration c;
+	int found = 0;
+	init_mag_calibration(cal);
+	init_mag_calibration(&c);
+	FILE * f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "offset %lf %lf %lf", &c.offset[0], &c.offset[1],
+				&c.offset[2]) == 3)
+			found |= 1;
+		else if (sscanf(line, "soft %lf %lf %lf %lf %lf %lf %lf %lf %lf",
+				&c.soft[0][0], &c.soft[0][1], &c.soft[0][2], &c.soft[1][0],
+				&c.soft[1][1], &c.soft[1][2], &c.soft[2][0], &c.soft[2][1],
+				&c.soft[2][2]) == 9)
+			found |= 2;
+		else if (sscanf(line, "field %lf", &c.field) == 1)
+			found |= 4;
+	}
+	fclose(f);
+	if (found != 7 || c.field <= 0.)
+		return 0;
+	c.valid = 1;
+	memcpy(cal, &c, sizeof(mag_calibration));
+	return 1;
+}
+
+void init_mag_filter(mag_filter * f) {
+	memset(f, 0, sizeof(mag_filter));
+}
+
+//return 1 when the sample corrected the heading, 0 when it was rejected and the
+//heading only propagated with the yaw rate
+int update_mag_filter(mag_filter * f, mag_calibration * cal, short * mag,
+		double timestamp) {
+	double c[3];
+	correct_mag(cal, mag, c);
+	double measured = mag_heading(c);
+	f->nb_samples++;
+	if (!f->initialized) {
+		f->heading = measured;
+		f->timestamp = timestamp;
+		f->initialized = 1;
+		return 1;
+	}
+	if (timestamp <= f->timestamp)
+		return 0;
+	double dt = timestamp - f->timestamp;
+	double predicted = f->heading + f->yaw_rate * dt;
+	double residual = wrap_heading(measured - predicted);
+	int distorted = cal->valid
+			&& fabs(hypot(c[0], c[1]) - cal->field)
+					> MAG_FIELD_TOLERANCE * cal->field;
+	f->timestamp = timestamp;
+	if (distorted || fabs(residual) > MAG_MAX_RESIDUAL) {
+		f->nb_outliers++;
+		f->nb_rejected++;
+		f->heading = predicted;
+		if (f->nb_rejected < MAG_MAX_REJECTED)
+			return 0;
+		//the disturbance lasts, trust the field again rather than drift
+		f->heading += residual;
+		f->yaw_rate = 0.;
+		f->nb_rejected = 0;
+		return 1;
+	}
+	f->nb_rejected = 0;
+	f->heading = predicted + MAG_ALPHA * residual;
+	f->yaw_rate += MAG_BETA * residual / dt;
+	return 1;
+}
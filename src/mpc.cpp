@@ -0,0 +1,169 @@
+#include "mpc.hpp"
+
+//Model predictive steering : the bot follows a bicycle model linearized around the
+//curve, the state is the lateral and heading errors to the curve, the inputs the
+//wheel angles over the horizon. The predictions are condensed into a QP over the
+//MPC_HORIZON wheel angles only, bounded in angle and in change per step by the servo
+//rate, and solved by ADMM.
+//Every matrix has a fixed size and lives on the stack, the solver starts from the
+//previous solution of the caller's mpc_solver shifted by the time elapsed and stops
+//after MPC_MAX_ITERATIONS, the command sent is clipped to the bounds when the
+//iterate is not yet feasible.
+
+typedef Matrix<double, MPC_HORIZON, 1> mpc_vector;
+typedef Matrix<double, MPC_HORIZON, MPC_HORIZON> mpc_matrix;
+typedef Matrix<double, 2 * MPC_HORIZON, 1> mpc_constraint_vector;
+typedef Matrix<double, 2 * MPC_HORIZON, MPC_HORIZON> mpc_constraint_matrix;
+
+void init_mpc(mpc_solver * s) {
+	memset(s, 0, sizeof(mpc_solver));
+}
+
+//signed curvature in 1/mm, positive turning right, outside the fitted range that of
+//the nearest end
+double curve_curvature(curve * c, double x) {
+	x = fmin(fmax(x, c->min_x), c->max_x);
+	double d1 = c->p[1] + x * (2. * c->p[2] + x * 3. * c->p[3]);
+	double d2 = 2. * c->p[2] + x * 6. * c->p[3];
+	return d2 / pow(1. + d1 * d1, 1.5);
+}
+
+//start from the last solution moved by the steps elapsed, the last angle repeated
+void mpc_warm_start(mpc_solver * s, double t, mpc_vector & feed_forward,
+		Map<mpc_vector> & mpc_x, Map<mpc_constraint_vector> & mpc_y) {
+	int shift = (int) floor((t - s->last_t) / MPC_STEP + 0.5), k;
+	if (!s->has_solution || shift < 0 || shift >= MPC_HORIZON) {
+		mpc_x = feed_forward;
+		mpc_y.setZero();
+		return;
+	}
+	if (shift == 0)
+		return;
+	for (k = 0; k < MPC_HORIZON; k++) {
+		int from = (k + shift < MPC_HORIZON) ? k + shift : MPC_HORIZON - 1;
+		mpc_x(k) = mpc_x(from);
+		mpc_y(k) = mpc_y(from);
+		mpc_y(MPC_HORIZON + k) = mpc_y(MPC_HORIZON + from);
+	}
+}
+
+//servo command steering along the curve, c in the bot frame at actuation time,
+//speed in mm/s, steering the last command sent, t the current time
+float mpc_steering(mpc_solver * s, curve * c, float speed, float steering,
+		double t) {
+	double start = monotonic_time();
+	Map<mpc_vector> mpc_x(s->x);
+	Map<mpc_constraint_vector> mpc_y(s->y);
+	double v = fmax(speed, MPC_MIN_SPEED), dt = MPC_STEP;
+	double max_angle = MPC_MAX_STEER_ANGLE * M_PI / 180.;
+	double max_change = MPC_MAX_STEER_RATE * M_PI / 180. * dt;
+	double previous = -fmax(-1., fmin(1., steering)) * max_angle;
+	int i, j, k;
+
+	//errors of the bot at the origin to the curve, x forward, y to the right
+	double slope = c->p[1];
+	Vector2d x0(-c->p[0] / sqrt(1. + slope * slope), -atan(slope));
+	//e(k+1) = A e(k) + B angle(k) + w(k), second order in dt for the lateral error
+	Matrix2d A;
+	A << 1., v * dt, 0., 1.;
+	Vector2d B(0.5 * v * v * dt * dt / MPC_WHEELBASE, v * dt / MPC_WHEELBASE);
+	mpc_vector feed_forward;
+	mpc_constraint_vector h; //errors with straight wheels
+	mpc_constraint_matrix G; //error response to the angles
+	Vector2d e = x0;
+	G.setZero();
+	for (k = 0; k < MPC_HORIZON; k++) {
+		double kappa = curve_curvature(c, v * dt * k);
+		feed_forward(k) = fmax(-max_angle,
+				fmin(max_angle, atan(MPC_WHEELBASE * kappa)));
+		e = A * e - Vector2d(0.5 * v * v * dt * dt * kappa, v * dt * kappa);
+		h.segment<2>(2 * k) = e;
+		Vector2d response = B;
+		for (j = k; j >= 0; j--) {
+			G.block<2, 1>(2 * k, j) = response;
+			response = A * response;
+		}
+	}
+
+	//cost sum of errors, distance to the feed forward and angle changes, the first
+	//change is from the angle already commanded
+	mpc_matrix D = mpc_matrix::Identity();
+	for (k = 1; k < MPC_HORIZON; k++)
+		D(k, k - 1) = -1.;
+	mpc_vector d = mpc_vector::Zero();
+	d(0) = previous;
+	mpc_constraint_vector weights;
+	for (k = 0; k < MPC_HORIZON; k++) {
+		weights(2 * k) = MPC_Q_LATERAL;
+		weights(2 * k + 1) = MPC_Q_HEADING;
+	}
+	mpc_matrix P = G.transpose() * weights.asDiagonal() * G
+			+ MPC_R_CURVATURE * mpc_matrix::Identity()
+			+ MPC_R_RATE * D.transpose() * D;
+	mpc_vector q = G.transpose() * weights.asDiagonal() * h
+			- MPC_R_CURVATURE * feed_forward - MPC_R_RATE * D.transpose() * d;
+	//same solution, conditioned for a fixed rho
+	double scale = P.diagonal().maxCoeff();
+	P /= scale;
+	q /= scale;
+
+	//bounds on the angles and on their changes
+	mpc_constraint_matrix C;
+	C.topRows<MPC_HORIZON>() = mpc_matrix::Identity();
+	C.bottomRows<MPC_HORIZON>() = D;
+	mpc_constraint_vector l, u;
+	for (k = 0; k < MPC_HORIZON; k++) {
+		l(k) = -max_angle;
+		u(k) = max_angle;
+		l(MPC_HORIZON + k) = d(k) - max_change;
+		u(MPC_HORIZON + k) = d(k) + max_change;
+	}
+
+	mpc_warm_start(s, t, feed_forward, mpc_x, mpc_y);
+	mpc_constraint_vector z = (C * mpc_x).cwiseMax(l).cwiseMin(u);
+	mpc_matrix K = P + MPC_SIGMA * mpc_matrix::Identity()
+			+ MPC_RHO * C.transpose() * C;
+	LLT<mpc_matrix> llt(K);
+	for (i = 0; i < MPC_MAX_ITERATIONS; i++) {
+		mpc_vector xt = llt.solve(
+				MPC_SIGMA * mpc_x - q + C.transpose() * (MPC_RHO * z - mpc_y));
+		mpc_constraint_vector zt = C * xt;
+		mpc_x = MPC_ALPHA * xt + (1. - MPC_ALPHA) * mpc_x;
+		mpc_constraint_vector relaxed = MPC_ALPHA * zt + (1. - MPC_ALPHA) * z;
+		z = (relaxed + mpc_y / MPC_RHO).cwiseMax(l).cwiseMin(u);
+		mpc_y += MPC_RHO * (relaxed - z);
+		double primal = (C * mpc_x - z).cwiseAbs().maxCoeff();
+		double dual = (P * mpc_x + q + C.transpose() * mpc_y).cwiseAbs().maxCoeff();
+		if (primal < MPC_TOLERANCE && dual < MPC_TOLERANCE)
+			break;
+	}
+	s->last_t = t;
+	s->has_solution = 1;
+	double angle = fmax(previous - max_change,
+			fmin(previous + max_change, mpc_x(0)));
+	angle = fmax(-max_angle, fmin(max_angle, angle));
+
+	double elapsed = monotonic_time() - start;
+	unsigned int nb_iterations = (i < MPC_MAX_ITERATIONS) ? i + 1 : i;
+	mpc_stats * stats = &(s->stats);
+	stats->nb_solves++;
+	stats->iterations += nb_iterations;
+	if (i >= MPC_MAX_ITERATIONS)
+		stats->nb_capped++;
+	if (nb_iterations > stats->max_iterations)
+		stats->max_iterations = nb_iterations;
+	stats->time += elapsed;
+	if (elapsed > stats->time_max)
+		stats->time_max = elapsed;
+	return -angle / max_angle;
+}
+
+void print_mpc_stats(mpc_solver * solver) {
+	mpc_stats * s = &(solver->stats);
+	if (s->nb_solves == 0)
+		return;
+	printf("MPC : %lu solves, mean %.1f us, max %.1f us, %.1f iterations on average, %u at most, %lu stopped at the cap of %d \n",
+			s->nb_solves, 1000000. * s->time / s->nb_solves,
+			1000000. * s->time_max, ((double) s->iterations) / s->nb_solves,
+			s->max_iterations, s->nb_capped, MPC_MAX_ITERATIONS);
+}
@@ -1,7 +1,10 @@
 #include <iostream>
 #include <unistd.h>
+#include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include "detect_line.hpp"
+#include "navigation.hpp"
 
 
 float steering_speed_from_curve(curve * c, float x_lookahead, float * y_lookahead, float * speed) {
@@ -21,3 +24,154 @@ float steering_speed_from_curve(curve * c, float x_lookahead, float * y_lookahea
 	float curvature = 1000.0 / r; //to have in milimeters instead of meters
 	return curvature;
 }
+
+//curve seen from the bot after it moved by dx, dy mm and turned by dyaw degrees,
+//points spread over the detected range are moved and fitted again
+void propagate_curve(curve * c, float dx, float dy, float dyaw, curve * moved) {
+	Matrix<double, POLY_LENGTH, POLY_LENGTH> A;
+	Matrix<double, POLY_LENGTH, 1> b;
+	double cs = cos(dyaw * M_PI / 180.), sn = sin(dyaw * M_PI / 180.);
+	int i, j;
+	if (c->max_x - c->min_x < 1.) {
+		(*moved) = (*c);
+		return;
+	}
+	for (i = 0; i < POLY_LENGTH; i++) {
+		double x = c->min_x + (c->max_x - c->min_x) * i / (POLY_LENGTH - 1);
+		double y = 0.;
+		for (j = POLY_LENGTH - 1; j >= 0; j--)
+			y = y * x + c->p[j];
+		double px = x - dx, py = y - dy;
+		double mx = cs * px + sn * py, my = -sn * px + cs * py;
+		for (j = 0; j < POLY_LENGTH; j++)
+			A(i, j) = pow(mx, j);
+		b(i) = my;
+		if (i == 0)
+			moved->min_x = mx;
+		if (i == POLY_LENGTH - 1)
+			moved->max_x = mx;
+	}
+	Matrix<double, POLY_LENGTH, 1> p = A.partialPivLu().solve(b);
+	for (i = 0; i < POLY_LENGTH; i++)
+		moved->p[i] = p(i);
+}
+
+//longitudinal acceleration left by the friction circle once the turn takes its share
+float friction_left(float a_max, float v, float curvature) {
+	float lateral = v * v * curvature / PLAN_MAX_LATERAL_ACC;
+	return (lateral >= 1.) ? 0. : a_max * sqrt(1. - lateral * lateral);
+}
+
+//speed profile over the curve, from the bot to max_x : the curvature of the
+//polynomial limits the speed through the lateral grip, a backward pass brakes
+//ahead of the turns, a forward pass limits the acceleration from the current speed.
+//Return the speed to command, the one planned where the bot will be after horizon
+//seconds.
+//Outside the fitted range the curvature of the nearest end is used, beyond max_x
+//the line is assumed to keep the last curvature seen.
+float plan_speed(curve * c, float speed, float horizon, speed_plan * plan) {
+	int i;
+	float *s = plan->s, *k = plan->curvature, *v = plan->v;
+	if (c->max_x <= 0.) {
+		plan->command = PLAN_MIN_SPEED;
+		return plan->command;
+	}
+	for (i = 0; i < PLAN_SAMPLES; i++) {
+		float x = c->max_x * i / (PLAN_SAMPLES - 1);
+		float xc = fmin(fmax(x, c->min_x), c->max_x);
+		//closed form derivatives of the cubic
+		float d1 = c->p[1] + xc * (2. * c->p[2] + xc * 3. * c->p[3]);
+		float d2 = 2. * c->p[2] + xc * 6. * c->p[3];
+		float n = sqrt(1. + d1 * d1);
+		k[i] = fabs(d2) / (n * n * n);
+		if (i == 0)
+			s[i] = 0.;
+		else
+			s[i] = s[i - 1] + (x - c->max_x * (i - 1) / (PLAN_SAMPLES - 1)) * n;
+		v[i] = PLAN_MAX_SPEED;
+		if (k[i] > 0.)
+			v[i] = fmin(v[i], sqrt(PLAN_MAX_LATERAL_ACC / k[i]));
+	}
+	for (i = PLAN_SAMPLES - 2; i >= 0; i--) {
+		float a = friction_left(PLAN_MAX_DEC, v[i + 1], k[i + 1]);
+		v[i] = fmin(v[i], sqrt(v[i + 1] * v[i + 1] + 2. * a * (s[i + 1] - s[i])));
+	}
+	v[0] = fmin(v[0], fmax(speed, 0.));
+	for (i = 1; i < PLAN_SAMPLES; i++) {
+		float a = friction_left(PLAN_MAX_ACC, v[i - 1], k[i - 1]);
+		v[i] = fmin(v[i], sqrt(v[i - 1] * v[i - 1] + 2. * a * (s[i] - s[i - 1])));
+	}
+	float target = fmax(speed, 0.) * horizon;
+	for (i = 1; i < PLAN_SAMPLES - 1 && s[i] < target; i++)
+		;
+	plan->command = fmax(v[i], PLAN_MIN_SPEED);
+	return plan->command;
+}
+
+//fixed lookahead and gain, until a schedule is loaded
+void init_nav_schedule(nav_schedule * s) {
+	s->nb_speeds = 1;
+	s->speed[0] = 0.;
+	s->lookahead[0] = NAV_LOOKAHEAD;
+	s->gain[0] = NAV_GAIN;
+	s->low_confidence = 0.;
+	s->lookahead_scale = s->gain_scale = 1.;
+}
+
+//one speed row per line, leave the default schedule when the file is missing or
+//its rows are not in increasing speed
+int load_nav_schedule(const char * path, nav_schedule * s) {
+	char line[256];
+	nav_schedule n;
+	float speed, lookahead, gain;
+	init_nav_schedule(s);
+	init_nav_schedule(&n);
+	n.nb_speeds = 0;
+	FILE * f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "speed %f %f %f", &speed, &lookahead, &gain) == 3) {
+			if (n.nb_speeds == NAV_SCHEDULE_MAX
+					|| (n.nb_speeds > 0 && speed <= n.speed[n.nb_speeds - 1])
+					|| lookahead <= 0.) {
+				fclose(f);
+				return 0;
+			}
+			n.speed[n.nb_speeds] = speed;
+			n.lookahead[n.nb_speeds] = lookahead;
+			n.gain[n.nb_speeds] = gain;
+			n.nb_speeds++;
+		} else {
+			sscanf(line, "confidence %f %f %f", &n.low_confidence,
+					&n.lookahead_scale, &n.gain_scale);
+		}
+	}
+	fclose(f);
+	if (n.nb_speeds == 0 || n.low_confidence >= 1.)
+		return 0;
+	memcpy(s, &n, sizeof(nav_schedule));
+	return 1;
+}
+
+//linear between the rows, held beyond the first and last speeds
+void schedule_steering(nav_schedule * s, float speed, float confidence,
+		float * lookahead, float * gain) {
+	int i = 1;
+	while (i < s->nb_speeds - 1 && speed > s->speed[i])
+		i++;
+	if (s->nb_speeds == 1 || speed <= s->speed[0]) {
+		(*lookahead) = s->lookahead[0];
+		(*gain) = s->gain[0];
+	} else if (speed >= s->speed[s->nb_speeds - 1]) {
+		(*lookahead) = s->lookahead[s->nb_speeds - 1];
+		(*gain) = s->gain[s->nb_speeds - 1];
+	} else {
+		float u = (speed - s->speed[i - 1]) / (s->speed[i] - s->speed[i - 1]);
+		(*lookahead) = s->lookahead[i - 1] + u * (s->lookahead[i] - s->lookahead[i - 1]);
+		(*gain) = s->gain[i - 1] + u * (s->gain[i] - s->gain[i - 1]);
+	}
+	float w = fmin(fmax((1. - confidence) / (1. - s->low_confidence), 0.), 1.);
+	(*lookahead) *= 1. + w * (s->lookahead_scale - 1.);
+	(*gain) *= 1. + w * (s->gain_scale - 1.);
+}
@@ -0,0 +1,297 @@
+#include "phase_correlation.hpp"
+
+//Dense ground motion estimation : a bird's-eye patch of the ground is sampled through
+//the camera projection, translation comes from phase correlation of successive patches
+//and rotation from phase correlation of the log-polar resampled magnitude spectra.
+//The log-polar step only resolves rotation to a bin, small rotations are refined from
+//the lateral displacement difference between the near and far halves of the patch.
+//All sizes are fixed so the cost does not depend on the ground texture.
+
+#define PHASE_CELLS (PHASE_PATCH_SIZE * PHASE_PATCH_SIZE)
+#define PHASE_LOGPOLAR_CELLS (PHASE_LOGPOLAR_ANGLES * PHASE_LOGPOLAR_RADII)
+#define PHASE_MIN_RADIUS 2.0 //lowest frequencies are dominated by the window
+#define PHASE_MAX_RADIUS ((PHASE_PATCH_SIZE / 2) - 1)
+#define PHASE_HALF_ROWS (PHASE_PATCH_SIZE / 2)
+#define PHASE_HALF_CELLS (PHASE_HALF_ROWS * PHASE_PATCH_SIZE)
+#define PHASE_LOGPOLAR_BIN (M_PI / PHASE_LOGPOLAR_ANGLES)
+#define PHASE_EPSILON 1e-6
+
+typedef struct phase_sample {
+	unsigned short u; //top left pixel of the bilinear neighbourhood
+	unsigned short v;
+	unsigned short w[4]; //bilinear weights, sum to 256
+} phase_sample;
+
+phase_sample phase_samples[PHASE_CELLS];
+float phase_patch[PHASE_CELLS];
+float phase_window[PHASE_CELLS];
+float phase_half_window[PHASE_HALF_CELLS];
+complexf phase_spectra[2][PHASE_CELLS];
+complexf * phase_key = phase_spectra[0];
+complexf * phase_cur = phase_spectra[1];
+complexf phase_half_spectra[2][2][PHASE_HALF_CELLS]; //near and far halves
+complexf (* phase_half_key)[PHASE_HALF_CELLS] = phase_half_spectra[0];
+complexf (* phase_half_cur)[PHASE_HALF_CELLS] = phase_half_spectra[1];
+complexf phase_work[PHASE_CELLS];
+float phase_magnitude[PHASE_CELLS];
+
+unsigned int phase_lp_index[PHASE_LOGPOLAR_CELLS][4];
+float phase_lp_weight[PHASE_LOGPOLAR_CELLS][4];
+float phase_lp_window[PHASE_LOGPOLAR_RADII];
+complexf phase_lp_spectra[2][PHASE_LOGPOLAR_CELLS];
+complexf * phase_lp_key = phase_lp_spectra[0];
+complexf * phase_lp_cur = phase_lp_spectra[1];
+complexf phase_lp_work[PHASE_LOGPOLAR_CELLS];
+
+int phase_has_keyframe = 0;
+
+float phase_hann(float i, unsigned int n) {
+	return 0.5 * (1.0 - cos(2.0 * M_PI * (i + 0.5) / n));
+}
+
+void phase_sample_patch(Mat & img) {
+	unsigned int i;
+	for (i = 0; i < PHASE_CELLS; i++) {
+		phase_sample * s = &(phase_samples[i]);
+		unsigned char * p = img.data + (s->v * img.step) + s->u;
+		unsigned int val = p[0] * s->w[0] + p[1] * s->w[1]
+				+ p[img.step] * s->w[2] + p[img.step + 1] * s->w[3];
+		phase_patch[i] = (float) (val >> 8);
+	}
+}
+
+//transform nb_cells of the sampled patch, mean removed and windowed
+void phase_spectrum(float * patch, unsigned int rows, float * window,
+		complexf * spectrum) {
+	unsigned int i, nb_cells = rows * PHASE_PATCH_SIZE;
+	float mean = 0.;
+	for (i = 0; i < nb_cells; i++) {
+		mean += patch[i];
+	}
+	mean /= nb_cells;
+	for (i = 0; i < nb_cells; i++) {
+		spectrum[i].re = (patch[i] - mean) * window[i];
+		spectrum[i].im = 0.;
+	}
+	fft_2d(spectrum, rows, PHASE_PATCH_SIZE, 0);
+}
+
+//log-polar resampling of the spectrum magnitude, rows are radii and columns angles
+void phase_log_polar(complexf * spectrum, complexf * lp) {
+	unsigned int i, k;
+	float mean = 0.;
+	for (i = 0; i < PHASE_CELLS; i++) {
+		phase_magnitude[i] = log(
+				1.0
+						+ sqrt(
+								spectrum[i].re * spectrum[i].re
+										+ spectrum[i].im * spectrum[i].im));
+	}
+	for (i = 0; i < PHASE_LOGPOLAR_CELLS; i++) {
+		float val = 0.;
+		for (k = 0; k < 4; k++) {
+			val += phase_lp_weight[i][k] * phase_magnitude[phase_lp_index[i][k]];
+		}
+		lp[i].re = val;
+		lp[i].im = 0.;
+		mean += val;
+	}
+	mean /= PHASE_LOGPOLAR_CELLS;
+	//angles wrap around, only the radius axis needs a window
+	for (i = 0; i < PHASE_LOGPOLAR_CELLS; i++) {
+		lp[i].re = (lp[i].re - mean)
+				* phase_lp_window[i / PHASE_LOGPOLAR_ANGLES];
+	}
+	fft_2d(lp, PHASE_LOGPOLAR_RADII, PHASE_LOGPOLAR_ANGLES, 0);
+}
+
+//sub-sample peak offset for phase correlation, whose peak is sinc shaped (Foroosh et al.)
+float phase_subpixel_peak(float before, float peak, float after) {
+	if (after > before && after > 0.) {
+		return after / (after + peak);
+	} else if (before > 0.) {
+		return -before / (before + peak);
+	}
+	return 0.;
+}
+
+//phase correlation of two spectra, the shift is the displacement of cur relative to prev
+//returns the normalized correlation peak
+float phase_correlate(complexf * cur, complexf * prev, complexf * work,
+		unsigned int rows, unsigned int cols, float * dr, float * dc) {
+	unsigned int i, r, c, max_index = 0;
+	float max = -1.;
+	for (i = 0; i < rows * cols; i++) {
+		float re = cur[i].re * prev[i].re + cur[i].im * prev[i].im;
+		float im = cur[i].im * prev[i].re - cur[i].re * prev[i].im;
+		float m = sqrt(re * re + im * im) + PHASE_EPSILON;
+		work[i].re = re / m;
+		work[i].im = im / m;
+	}
+	fft_2d(work, rows, cols, 1);
+	for (i = 0; i < rows * cols; i++) {
+		if (work[i].re > max) {
+			max = work[i].re;
+			max_index = i;
+		}
+	}
+	r = max_index / cols;
+	c = max_index % cols;
+	(*dr) = r + phase_subpixel_peak(work[((r + rows - 1) % rows) * cols + c].re,
+			max, work[((r + 1) % rows) * cols + c].re);
+	(*dc) = c + phase_subpixel_peak(work[r * cols + ((c + cols - 1) % cols)].re,
+			max, work[r * cols + ((c + 1) % cols)].re);
+	if ((*dr) >= rows / 2)
+		(*dr) -= rows;
+	if ((*dc) >= cols / 2)
+		(*dc) -= cols;
+	return max / (rows * cols);
+}
+
+//motion of the bot between keyframe and current frame in mm, yaw in degrees
+//yaw is positive when the bot turns from its x axis toward its y axis
+float phase_correlation_motion(Mat & img, float * tx, float * ty, float * yaw) {
+	float confidence = 0.;
+	(*tx) = 0.;
+	(*ty) = 0.;
+	(*yaw) = 0.;
+	phase_sample_patch(img);
+	phase_spectrum(phase_patch, PHASE_PATCH_SIZE, phase_window, phase_cur);
+	phase_spectrum(phase_patch, PHASE_HALF_ROWS, phase_half_window,
+			phase_half_cur[0]);
+	phase_spectrum(&(phase_patch[PHASE_HALF_CELLS]), PHASE_HALF_ROWS,
+			phase_half_window, phase_half_cur[1]);
+	phase_log_polar(phase_cur, phase_lp_cur);
+	if (phase_has_keyframe) {
+		float dr, dc, dradius, dangle, dr_near, dc_near, dr_far, dc_far;
+		float rotation = 0.;
+		confidence = phase_correlate(phase_cur, phase_key, phase_work,
+		PHASE_PATCH_SIZE, PHASE_PATCH_SIZE, &dr, &dc);
+		float rotation_confidence = phase_correlate(phase_lp_cur, phase_lp_key,
+				phase_lp_work, PHASE_LOGPOLAR_RADII, PHASE_LOGPOLAR_ANGLES,
+				&dradius, &dangle);
+		float near_confidence = phase_correlate(phase_half_cur[0],
+				phase_half_key[0], phase_work, PHASE_HALF_ROWS,
+				PHASE_PATCH_SIZE, &dr_near, &dc_near);
+		float far_confidence = phase_correlate(phase_half_cur[1],
+				phase_half_key[1], phase_work, PHASE_HALF_ROWS,
+				PHASE_PATCH_SIZE, &dr_far, &dc_far);
+		//ground rotates the opposite way of the bot
+		if (rotation_confidence > PHASE_MIN_CONFIDENCE
+				&& fabs(dangle * PHASE_LOGPOLAR_BIN)
+						< (PHASE_MAX_ROTATION * M_PI / 180.)) {
+			rotation = -dangle * PHASE_LOGPOLAR_BIN;
+		}
+		if (near_confidence > PHASE_MIN_CONFIDENCE
+				&& far_confidence > PHASE_MIN_CONFIDENCE) {
+			//halves centers are PHASE_HALF_ROWS cells apart
+			float refined = -(dc_far - dc_near) / PHASE_HALF_ROWS;
+			if (fabs(refined - rotation) < PHASE_LOGPOLAR_BIN)
+				rotation = refined;
+		}
+		//displacement is measured at the patch center, bring it back to the bot origin
+		float center_x = PHASE_PATCH_X_MM
+				+ (PHASE_PATCH_SIZE * PHASE_CELL_MM / 2.);
+		(*tx) = -dr * PHASE_CELL_MM;
+		(*ty) = -(dc * PHASE_CELL_MM) - (rotation * center_x);
+		(*yaw) = rotation * 180. / M_PI;
+	}
+	return confidence;
+}
+
+//current frame becomes the reference that following frames are correlated with
+void phase_set_keyframe() {
+	complexf * temp = phase_key;
+	phase_key = phase_cur;
+	phase_cur = temp;
+	temp = phase_lp_key;
+	phase_lp_key = phase_lp_cur;
+	phase_lp_cur = temp;
+	complexf (* half_temp)[PHASE_HALF_CELLS] = phase_half_key;
+	phase_half_key = phase_half_cur;
+	phase_half_cur = half_temp;
+	phase_has_keyframe = 1;
+}
+
+//mark the image rows read when sampling the ground patch
+void phase_correlation_rows(unsigned char * row_mask, unsigned int h) {
+	unsigned int i;
+	for (i = 0; i < PHASE_CELLS; i++) {
+		unsigned int v = phase_samples[i].v;
+		if (v < h)
+			row_mask[v] = 1;
+		if (v + 1 < h)
+			row_mask[v + 1] = 1;
+	}
+}
+
+void reset_phase_correlation() {
+	phase_has_keyframe = 0;
+}
+
+void init_phase_correlation() {
+	unsigned int i, j, k;
+	init_fft();
+	//ground patch sampling table, rows go forward along x and columns along y
+	for (i = 0; i < PHASE_PATCH_SIZE; i++) {
+		for (j = 0; j < PHASE_PATCH_SIZE; j++) {
+			float u, v;
+			phase_sample * s = &(phase_samples[i * PHASE_PATCH_SIZE + j]);
+			double x = PHASE_PATCH_X_MM + ((i + 0.5) * PHASE_CELL_MM);
+			double y = (((float) j) - (PHASE_PATCH_SIZE / 2) + 0.5)
+					* PHASE_CELL_MM;
+			ground_plane_to_pixel(cam_ct, x, y, &u, &v);
+			distort_radial(K, u, v, &u, &v, radial_distort, POLY_DISTORT_SIZE);
+			if (u < 0)
+				u = 0;
+			if (u > IMAGE_WIDTH - 2)
+				u = IMAGE_WIDTH - 2;
+			if (v < 0)
+				v = 0;
+			if (v > IMAGE_HEIGHT - 2)
+				v = IMAGE_HEIGHT - 2;
+			s->u = (unsigned short) u;
+			s->v = (unsigned short) v;
+			//fractional parts on 4 bits so that the weights sum exactly to 256
+			unsigned short a = (unsigned short) ((u - s->u) * 16. + 0.5);
+			unsigned short b = (unsigned short) ((v - s->v) * 16. + 0.5);
+			s->w[0] = (16 - a) * (16 - b);
+			s->w[1] = a * (16 - b);
+			s->w[2] = (16 - a) * b;
+			s->w[3] = a * b;
+			phase_window[i * PHASE_PATCH_SIZE + j] = phase_hann(i, PHASE_PATCH_SIZE)
+					* phase_hann(j, PHASE_PATCH_SIZE);
+			if (i < PHASE_HALF_ROWS) {
+				phase_half_window[i * PHASE_PATCH_SIZE + j] = phase_hann(i,
+				PHASE_HALF_ROWS) * phase_hann(j, PHASE_PATCH_SIZE);
+			}
+		}
+	}
+	//log-polar sampling table of the spectrum, the magnitude is symmetric so half a turn is enough
+	double log_step = log(PHASE_MAX_RADIUS / PHASE_MIN_RADIUS)
+			/ (PHASE_LOGPOLAR_RADII - 1);
+	for (i = 0; i < PHASE_LOGPOLAR_RADII; i++) {
+		double radius = PHASE_MIN_RADIUS * exp(i * log_step);
+		phase_lp_window[i] = phase_hann(i, PHASE_LOGPOLAR_RADII);
+		for (j = 0; j < PHASE_LOGPOLAR_ANGLES; j++) {
+			unsigned int index = i * PHASE_LOGPOLAR_ANGLES + j;
+			double angle = M_PI * j / PHASE_LOGPOLAR_ANGLES;
+			double fr = radius * cos(angle) + PHASE_PATCH_SIZE;
+			double fc = radius * sin(angle) + PHASE_PATCH_SIZE;
+			unsigned int r0 = (unsigned int) floor(fr);
+			unsigned int c0 = (unsigned int) floor(fc);
+			double a = fc - c0;
+			double b = fr - r0;
+			for (k = 0; k < 4; k++) {
+				unsigned int r = (r0 + (k >> 1)) % PHASE_PATCH_SIZE;
+				unsigned int c = (c0 + (k & 1)) % PHASE_PATCH_SIZE;
+				phase_lp_index[index][k] = r * PHASE_PATCH_SIZE + c;
+			}
+			phase_lp_weight[index][0] = (1. - a) * (1. - b);
+			phase_lp_weight[index][1] = a * (1. - b);
+			phase_lp_weight[index][2] = (1. - a) * b;
+			phase_lp_weight[index][3] = a * b;
+		}
+	}
+	reset_phase_correlation();
+}
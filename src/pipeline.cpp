@@ -0,0 +1,209 @@
+#include "pipeline.hpp"
+
+//Stages only share data through rings of pointers and reference counted frames,
+//head and tail indices grow freely and are masked when accessing the items.
+
+double monotonic_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+void init_ring(spsc_ring * ring) {
+	ring->head = 0;
+	ring->tail = 0;
+	ring->nb_push = 0;
+	ring->nb_full = 0;
+	ring->occupancy_sum = 0;
+	ring->max_occupancy = 0;
+	ring->event_fd = eventfd(0, 0);
+}
+
+//return 0 if the ring is full
+int ring_push(spsc_ring * ring, void * item) {
+	unsigned int head = ring->head;
+	unsigned int tail = __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+	if ((head - tail) >= (RING_SIZE - 1)) {
+		ring->nb_full++;
+		return 0;
+	}
+	ring->items[head & (RING_SIZE - 1)] = item;
+	__atomic_store_n(&(ring->head), head + 1, __ATOMIC_RELEASE);
+	uint64_t one = 1;
+	if (write(ring->event_fd, &one, sizeof(one)) != sizeof(one))
+		perror("ring event");
+	ring->nb_push++;
+	ring->occupancy_sum += (head + 1 - tail);
+	if ((head + 1 - tail) > ring->max_occupancy)
+		ring->max_occupancy = (head + 1 - tail);
+	return 1;
+}
+
+//return 0 if the ring is empty
+int ring_pop(spsc_ring * ring, void ** item) {
+	unsigned int tail = ring->tail;
+	unsigned int head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return 0;
+	(*item) = ring->items[tail & (RING_SIZE - 1)];
+	__atomic_store_n(&(ring->tail), tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+//block until the ring holds at least one item, a push between the emptiness
+//check and the read leaves the event counter set so no wake up is lost
+void ring_wait(spsc_ring * ring) {
+	uint64_t count;
+	while (ring_occupancy(ring) == 0) {
+		if (read(ring->event_fd, &count, sizeof(count)) != sizeof(count))
+			perror("ring event");
+	}
+}
+
+unsigned int ring_occupancy(spsc_ring * ring) {
+	return __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE)
+			- __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+}
+
+//Latest value shared by a single writer : the sequence is odd while the value is
+//copied in, readers copy it out again when the sequence was odd or changed during
+//their copy. Neither side waits on the other.
+void seqlock_write(unsigned int * seq, void * shared, const void * value,
+		size_t size) {
+	unsigned int s = __atomic_load_n(seq, __ATOMIC_RELAXED);
+	__atomic_store_n(seq, s + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(shared, value, size);
+	__atomic_store_n(seq, s + 2, __ATOMIC_RELEASE);
+}
+
+//return the number of retries
+unsigned int seqlock_read(unsigned int * seq, const void * shared, void * value,
+		size_t size) {
+	unsigned int before, after, retries = 0;
+	while (1) {
+		before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+		if ((before & 1) == 0) {
+			memcpy(value, shared, size);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			after = __atomic_load_n(seq, __ATOMIC_RELAXED);
+			if (before == after)
+				return retries;
+		}
+		retries++;
+	}
+}
+
+void print_ring_stats(const char * name, spsc_ring * ring) {
+	printf("%s : %lu pushed, %lu rejected full, mean occupancy %.2f, max %u \n",
+			name, ring->nb_push, ring->nb_full,
+			(ring->nb_push > 0) ?
+					((float) ring->occupancy_sum) / ring->nb_push : 0.,
+			ring->max_occupancy);
+}
+
+void print_stage_stats(const char * name, stage_stats * stats, double elapsed) {
+	printf("%s : %lu processed, %lu skipped, busy %.1f%% \n", name,
+			stats->nb_processed, stats->nb_skipped,
+			(elapsed > 0.) ? (100. * stats->busy_time / elapsed) : 0.);
+}
+
+void init_frame_policy(frame_policy * p, int enabled, int degraded_path,
+		double deadline, double max_age) {
+	p->enabled = enabled;
+	p->degraded_path = degraded_path;
+	p->deadline = deadline;
+	p->max_age = max_age;
+	p->overrun = 0;
+	p->nb_dropped = 0;
+	p->nb_degraded = 0;
+	p->nb_overruns = 0;
+}
+
+//age of the frame when the stage is about to start on it
+int frame_policy_decide(frame_policy * p, double age) {
+	if (!p->enabled)
+		return FRAME_PROCESS;
+	if (age > p->max_age) {
+		p->nb_dropped++;
+		return FRAME_DROP;
+	}
+	if (p->degraded_path && __atomic_load_n(&(p->overrun), __ATOMIC_RELAXED)) {
+		p->nb_degraded++;
+		return FRAME_DEGRADED;
+	}
+	return FRAME_PROCESS;
+}
+
+//age of the frame when the stage is done with it
+void frame_policy_done(frame_policy * p, double age) {
+	if (!p->enabled)
+		return;
+	int overrun = age > p->deadline;
+	if (overrun)
+		p->nb_overruns++;
+	__atomic_store_n(&(p->overrun), overrun, __ATOMIC_RELAXED);
+}
+
+void print_frame_policy(const char * name, frame_policy * p) {
+	if (!p->enabled) {
+		printf("%s : frame policy off \n", name);
+		return;
+	}
+	printf("%s : %lu stale frames dropped, %lu degraded, %lu past the %.1f ms deadline \n",
+			name, p->nb_dropped, p->nb_degraded, p->nb_overruns,
+			1000. * p->deadline);
+}
+
+void init_frame_pool(frame_pool * pool, unsigned int w, unsigned int h) {
+	unsigned int i;
+	for (i = 0; i < PIPELINE_FRAMES; i++) {
+		pool->slots[i].img.create(h, w, CV_8UC1);
+		pool->slots[i].refs = 0;
+		pool->slots[i].seq = 0;
+		pool->slots[i].timestamp = 0.;
+	}
+	pool->next = 0;
+	pool->nb_stall = 0;
+}
+
+//only called from the capture thread, waits until a buffer is released by every stage
+frame_slot * acquire_frame(frame_pool * pool, int nb_consumers) {
+	unsigned int i;
+	while (1) {
+		for (i = 0; i < PIPELINE_FRAMES; i++) {
+			frame_slot * slot = &(pool->slots[(pool->next + i) % PIPELINE_FRAMES]);
+			if (__atomic_load_n(&(slot->refs), __ATOMIC_ACQUIRE) == 0) {
+				pool->next = (pool->next + i + 1) % PIPELINE_FRAMES;
+				slot->refs = nb_consumers;
+				return slot;
+			}
+		}
+		pool->nb_stall++;
+		usleep(500);
+	}
+}
+
+void release_frame(frame_slot * slot) {
+	__atomic_sub_fetch(&(slot->refs), 1, __ATOMIC_RELEASE);
+}
+
+//convert the rows set in row_mask, runs of rows are converted at once
+//return the number of bytes read and written
+unsigned long convert_rows_to_gray(Mat & color, Mat & gray,
+		unsigned char * row_mask) {
+	int first, last;
+	unsigned long bytes = 0;
+	for (first = 0; first < color.rows; first = last) {
+		if (!row_mask[first]) {
+			last = first + 1;
+			continue;
+		}
+		for (last = first; last < color.rows && row_mask[last]; last++)
+			;
+		Mat dst = gray.rowRange(first, last);
+		cvtColor(color.rowRange(first, last), dst, COLOR_BGR2GRAY);
+		bytes += (last - first) * color.cols * (color.channels() + 1);
+	}
+	return bytes;
+}
@@ -0,0 +1,158 @@
+#include "profiler.hpp"
+
+//Each thread records the stages it runs into its own ring, no lock is taken while
+//profiling. Rings keep the last PROFILE_RING_SIZE events, statistics and traces
+//are computed from them at exit.
+
+const char * profile_stage_names[PROFILE_NB_STAGES] = { "grab", "line",
+		"gradient", "projection", "ransac", "track", "odometry", "fast",
+		"brief", "match", "vote", "klt", "phase", "control", "compass",
+		"actuation" };
+
+profile_ring * profile_rings[PROFILE_MAX_THREADS];
+int nb_profile_threads = 0;
+__thread profile_ring * thread_ring = NULL;
+__thread int thread_ring_failed = 0;
+
+uint64_t profile_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (((uint64_t) ts.tv_sec) * 1000000000ULL) + ts.tv_nsec;
+}
+
+//the ring of a thread is allocated on its first event
+profile_ring * get_thread_ring() {
+	if (thread_ring != NULL || thread_ring_failed)
+		return thread_ring;
+	int index = __atomic_fetch_add(&nb_profile_threads, 1, __ATOMIC_ACQ_REL);
+	if (index < 0 || index >= PROFILE_MAX_THREADS) {
+		thread_ring_failed = 1;
+		return NULL;
+	}
+	profile_ring * ring = (profile_ring *) malloc(sizeof(profile_ring));
+	memset(ring, 0, sizeof(profile_ring)); //no page fault while profiling
+	snprintf(ring->name, sizeof(ring->name), "thread %u", (unsigned int) index);
+	__atomic_store_n(&(profile_rings[index]), ring, __ATOMIC_RELEASE);
+	thread_ring = ring;
+	return ring;
+}
+
+void profile_thread(const char * name) {
+	profile_ring * ring = get_thread_ring();
+	if (ring != NULL)
+		strncpy(ring->name, name, sizeof(ring->name) - 1);
+}
+
+void profile_record(int stage, uint64_t start) {
+	uint64_t stop = profile_now();
+	profile_ring * ring = get_thread_ring();
+	if (ring == NULL)
+		return;
+	profile_event * e = &(ring->events[ring->head & (PROFILE_RING_SIZE - 1)]);
+	e->start = start;
+	e->duration = (uint32_t) (stop - start);
+	e->stage = stage;
+	__atomic_store_n(&(ring->head), ring->head + 1, __ATOMIC_RELEASE);
+}
+
+int compare_durations(const void * a, const void * b) {
+	uint32_t da = *((uint32_t *) a), db = *((uint32_t *) b);
+	return (da > db) - (da < db);
+}
+
+//rings of threads still registering are skipped
+unsigned int ring_nb_events(profile_ring * ring) {
+	if (ring == NULL)
+		return 0;
+	unsigned int head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+	return (head > PROFILE_RING_SIZE) ? PROFILE_RING_SIZE : head;
+}
+
+//p50/p99 per stage over the events of every thread
+void print_profile_table(int nb_threads) {
+	int i, t;
+	unsigned int j, total = 0;
+	for (t = 0; t < nb_threads; t++)
+		total += ring_nb_events(profile_rings[t]);
+	uint32_t * durations = (uint32_t *) malloc(
+			(total > 0 ? total : 1) * sizeof(uint32_t));
+	printf("%-12s %8s %10s %10s %10s %10s \n", "stage", "count", "mean us",
+			"p50 us", "p99 us", "max us");
+	for (i = 0; i < PROFILE_NB_STAGES; i++) {
+		unsigned int n = 0;
+		double sum = 0.;
+		for (t = 0; t < nb_threads; t++) {
+			profile_ring * ring = profile_rings[t];
+			unsigned int nb_events = ring_nb_events(ring);
+			for (j = 0; j < nb_events; j++) {
+				if (ring->events[j].stage == (uint32_t) i) {
+					durations[n++] = ring->events[j].duration;
+					sum += ring->events[j].duration;
+				}
+			}
+		}
+		if (n == 0)
+			continue;
+		qsort(durations, n, sizeof(uint32_t), compare_durations);
+		printf("%-12s %8u %10.1f %10.1f %10.1f %10.1f \n",
+				profile_stage_names[i], n, sum / n / 1000.,
+				durations[n / 2] / 1000., durations[(n * 99) / 100] / 1000.,
+				durations[n - 1] / 1000.);
+	}
+	free(durations);
+}
+
+//Chrome trace event format, complete events with times in us
+void write_profile_trace(const char * path, int nb_threads) {
+	int t, nb_written = 0;
+	unsigned int j;
+	uint64_t origin = UINT64_MAX;
+	FILE * out = fopen(path, "w");
+	if (out == NULL) {
+		perror(path);
+		return;
+	}
+	for (t = 0; t < nb_threads; t++) {
+		profile_ring * ring = profile_rings[t];
+		unsigned int nb_events = ring_nb_events(ring);
+		for (j = 0; j < nb_events; j++) {
+			if (ring->events[j].start < origin)
+				origin = ring->events[j].start;
+		}
+	}
+	fprintf(out, "{\"traceEvents\":[\n");
+	for (t = 0; t < nb_threads; t++) {
+		profile_ring * ring = profile_rings[t];
+		unsigned int nb_events = ring_nb_events(ring);
+		if (ring == NULL)
+			continue;
+		if (nb_written++ > 0)
+			fprintf(out, ",\n");
+		fprintf(out,
+				"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				t, ring->name);
+		for (j = 0; j < nb_events; j++) {
+			profile_event * e = &(ring->events[j]);
+			fprintf(out,
+					",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+					profile_stage_names[e->stage], t,
+					(e->start - origin) / 1000., e->duration / 1000.);
+		}
+	}
+	fprintf(out, "\n]}\n");
+	fclose(out);
+	printf("Profile trace written to %s \n", path);
+}
+
+//threads may still be recording, the oldest events of a wrapped ring can be
+//overwritten while reading, which only affects the diagnostic
+void profile_report(const char * trace_path) {
+	int nb_threads = __atomic_load_n(&nb_profile_threads, __ATOMIC_ACQUIRE);
+	if (nb_threads > PROFILE_MAX_THREADS)
+		nb_threads = PROFILE_MAX_THREADS;
+	if (nb_threads == 0)
+		return;
+	print_profile_table(nb_threads);
+	if (trace_path != NULL)
+		write_profile_trace(trace_path, nb_threads);
+}
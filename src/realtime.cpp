@@ -0,0 +1,200 @@
+#include "realtime.hpp"
+
+//Real-time profile : SCHED_FIFO priorities and core pinning for the loop threads,
+//memory locked and pre-faulted before the robot is armed. Each setting falls back
+//to the default behaviour when it cannot be applied (no CAP_SYS_NICE, fewer cores)
+//and the report says which ones did.
+
+typedef struct rt_thread_status {
+	int priority;
+	int cpu; //-1 leaves the thread on every core
+	int entered;
+	int sched_error; //errno of the failed call, 0 when applied
+	int cpu_error;
+} rt_thread_status;
+
+const char * rt_role_names[RT_NB_ROLES] = { "capture", "control", "line",
+		"odometry", "compass", "steering" };
+
+int rt_enabled = 0;
+rt_thread_status rt_threads[RT_NB_ROLES] = {
+		{ RT_CAPTURE_PRIORITY, RT_CAPTURE_CPU, 0, 0, 0 },
+		{ RT_CONTROL_PRIORITY, RT_CONTROL_CPU, 0, 0, 0 },
+		{ RT_LINE_PRIORITY, RT_LINE_CPU, 0, 0, 0 },
+		{ RT_ODOMETRY_PRIORITY, RT_ODOMETRY_CPU, 0, 0, 0 },
+		{ RT_COMPASS_PRIORITY, RT_COMPASS_CPU, 0, 0, 0 },
+		{ RT_STEERING_PRIORITY, RT_STEERING_CPU, 0, 0, 0 } };
+int rt_lock_error = -1; //-1 until rt_lock_memory is called
+unsigned long rt_minor_faults = 0; //faults taken by pre-faulting
+latency_histogram rt_jitter;
+
+//"default" or a comma separated list of role=priority[@cpu], for instance
+//capture=80@1,control=70@2, roles not listed keep the default profile
+int set_rt_profile(const char * spec) {
+	char buffer[128];
+	char * save = NULL, * token;
+	rt_enabled = 1;
+	if (strcmp(spec, "default") == 0)
+		return 1;
+	strncpy(buffer, spec, sizeof(buffer) - 1);
+	buffer[sizeof(buffer) - 1] = '\0';
+	for (token = strtok_r(buffer, ",", &save); token != NULL;
+			token = strtok_r(NULL, ",", &save)) {
+		char * value = strchr(token, '=');
+		int role, priority, cpu = -1;
+		if (value == NULL)
+			return 0;
+		*value = '\0';
+		value++;
+		for (role = 0; role < RT_NB_ROLES; role++)
+			if (strcmp(token, rt_role_names[role]) == 0)
+				break;
+		if (role == RT_NB_ROLES)
+			return 0;
+		if (sscanf(value, "%d@%d", &priority, &cpu) < 1)
+			return 0;
+		if (priority < sched_get_priority_min(SCHED_FIFO)
+				|| priority > sched_get_priority_max(SCHED_FIFO))
+			return 0;
+		rt_threads[role].priority = priority;
+		rt_threads[role].cpu = cpu;
+	}
+	return 1;
+}
+
+int rt_profile_enabled() {
+	return rt_enabled;
+}
+
+unsigned long minor_faults() {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_minflt;
+}
+
+//write one byte per page so that no fault happens when the memory is first used
+void rt_prefault(void * ptr, size_t size) {
+	volatile unsigned char * p = (volatile unsigned char *) ptr;
+	size_t i;
+	unsigned long faults = minor_faults();
+	for (i = 0; i < size; i += RT_PAGE_SIZE)
+		p[i] = p[i];
+	if (size > 0)
+		p[size - 1] = p[size - 1];
+	__atomic_add_fetch(&rt_minor_faults, minor_faults() - faults,
+			__ATOMIC_RELAXED);
+}
+
+void rt_prefault_stack() {
+	volatile unsigned char stack[RT_STACK_PREFAULT];
+	memset((void *) stack, 0, RT_STACK_PREFAULT);
+}
+
+//lock current and future pages, freed memory is kept by malloc instead of being
+//returned to the kernel and faulted again
+void rt_lock_memory() {
+	if (!rt_enabled)
+		return;
+	unsigned long faults = minor_faults();
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+	rt_lock_error = (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) ? 0 : errno;
+	rt_prefault_stack();
+	rt_minor_faults += minor_faults() - faults;
+}
+
+void apply_thread_settings(int priority, int cpu, int * sched_error,
+		int * cpu_error) {
+	struct sched_param param;
+	param.sched_priority = priority;
+	(*sched_error) = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	(*cpu_error) = 0;
+	if (cpu >= 0) {
+		cpu_set_t set;
+		if (cpu >= sysconf(_SC_NPROCESSORS_ONLN)) {
+			(*cpu_error) = EINVAL;
+			return;
+		}
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		(*cpu_error) = pthread_setaffinity_np(pthread_self(), sizeof(set),
+				&set);
+	}
+}
+
+//called at the start of each loop thread, stacks are touched before the first frame
+void rt_enter_thread(int role) {
+	if (!rt_enabled)
+		return;
+	rt_thread_status * t = &(rt_threads[role]);
+	unsigned long faults = minor_faults();
+	apply_thread_settings(t->priority, t->cpu, &(t->sched_error),
+			&(t->cpu_error));
+	rt_prefault_stack();
+	__atomic_add_fetch(&rt_minor_faults, minor_faults() - faults,
+			__ATOMIC_RELAXED);
+	__atomic_store_n(&(t->entered), 1, __ATOMIC_RELEASE);
+}
+
+void * jitter_probe_thread(void * arg) {
+	struct timespec next;
+	int sched_error, cpu_error, i;
+	rt_thread_status * t = &(rt_threads[RT_CONTROL]);
+	apply_thread_settings(t->priority, t->cpu, &sched_error, &cpu_error);
+	rt_prefault_stack();
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (i = 0; i < RT_JITTER_SAMPLES; i++) {
+		next.tv_nsec += RT_JITTER_PERIOD_US * 1000;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		double late = monotonic_time()
+				- (next.tv_sec + next.tv_nsec / 1000000000.);
+		record_latency(&rt_jitter, late > 0. ? late : 0.);
+	}
+	return NULL;
+}
+
+//periodic wakeups with the control thread settings, measures how late the
+//scheduler runs it, before the loop threads compete for the cores
+void rt_jitter_probe() {
+	pthread_t tid;
+	init_latency_histogram(&rt_jitter, RT_JITTER_PERIOD_US / 1000000.);
+	pthread_create(&tid, NULL, jitter_probe_thread, NULL);
+	pthread_join(tid, NULL);
+	print_latency_histogram("Scheduling jitter", &rt_jitter);
+}
+
+void print_rt_report() {
+	int i;
+	if (!rt_enabled) {
+		printf("Real-time profile : off, threads run SCHED_OTHER on every core \n");
+		return;
+	}
+	printf("Real-time profile : \n");
+	if (rt_lock_error == 0)
+		printf("	memory : locked \n");
+	else if (rt_lock_error > 0)
+		printf("	memory : not locked (%s), pages were only pre-faulted \n",
+				strerror(rt_lock_error));
+	printf("	pre-faulting took %lu minor page faults \n", rt_minor_faults);
+	for (i = 0; i < RT_NB_ROLES; i++) {
+		rt_thread_status * t = &(rt_threads[i]);
+		if (!__atomic_load_n(&(t->entered), __ATOMIC_ACQUIRE))
+			continue;
+		if (t->sched_error == 0)
+			printf("	%s : SCHED_FIFO %d", rt_role_names[i], t->priority);
+		else
+			printf("	%s : SCHED_OTHER, SCHED_FIFO %d refused (%s)",
+					rt_role_names[i], t->priority, strerror(t->sched_error));
+		if (t->cpu < 0)
+			printf(", every core \n");
+		else if (t->cpu_error == 0)
+			printf(", pinned to cpu %d \n", t->cpu);
+		else
+			printf(", every core, cpu %d refused (%s) \n", t->cpu,
+					strerror(t->cpu_error));
+	}
+}
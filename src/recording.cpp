@@ -0,0 +1,487 @@
+#include "recording.hpp"
+
+//Frames are copied by the capture thread into a ring, control events are pushed in
+//a lock-free ring by the control thread, a writer thread drains both, so neither
+//capture nor control ever waits on the file. Frames and events that do not fit in
+//their ring are counted and dropped. Replay maps the whole recording and
+//serves frames and control events by frame sequence number, so that a replay run
+//sees the same inputs on the same frames whatever its speed.
+
+typedef struct record_event {
+	record_entry entry;
+	union {
+		record_compass compass;
+		record_command command;
+		int32_t pole;
+	} payload;
+} record_event;
+
+typedef struct record_frame_slot {
+	record_entry entry;
+	unsigned char * data;
+} record_frame_slot;
+
+//recording
+int record_fd = -1;
+int record_running = 0;
+pthread_t record_tid;
+pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER; //frame pushes against close
+record_header rec_header;
+uint64_t record_offset = 0;
+record_index * record_entries = NULL;
+unsigned long nb_record_entries = 0, record_entries_size = 0;
+unsigned long nb_recorded_frames = 0;
+unsigned long nb_record_errors = 0;
+int last_pole_level = -1;
+
+record_event record_events[RECORD_EVENT_RING];
+unsigned int record_event_head = 0; //only written by the control thread
+unsigned int record_event_tail = 0; //only written by the frame writer
+unsigned long nb_events_lost = 0;
+
+record_frame_slot record_frames[RECORD_FRAME_RING];
+unsigned int record_frame_head = 0; //only written by the capture thread
+unsigned int record_frame_tail = 0; //only written by the writer thread
+unsigned long nb_frames_lost = 0;
+
+//replay
+unsigned char * replay_data = NULL;
+size_t replay_size = 0;
+record_header * replay_header = NULL;
+record_index * replay_index = NULL;
+unsigned long replay_nb_entries = 0;
+int replay_index_scanned = 0;
+int replay_realtime = 0;
+int replay_started = 0;
+double replay_clock_start = 0., replay_first_timestamp = 0.;
+unsigned long frame_cursor = 0, compass_cursor = 0, pole_cursor = 0,
+		command_cursor = 0;
+int replay_has_pole = 0, replay_pole_level = -1;
+unsigned long nb_replayed_frames = 0;
+unsigned long nb_commands_compared = 0, nb_commands_mismatch = 0,
+		nb_commands_unrecorded = 0;
+double max_steering_error = 0., max_esc_error = 0.;
+
+int write_all(int fd, const void * data, size_t size) {
+	const unsigned char * p = (const unsigned char *) data;
+	while (size > 0) {
+		ssize_t n = write(fd, p, size);
+		if (n <= 0)
+			return 0;
+		p += n;
+		size -= n;
+	}
+	return 1;
+}
+
+//called from the writer thread, or once it stopped
+void append_entry(uint32_t type, uint32_t seq, double timestamp,
+		const void * payload, uint32_t size) {
+	static const unsigned char padding[8] = { 0 };
+	record_entry e;
+	unsigned int pad = (8 - (size & 7)) & 7;
+	if (nb_record_entries == record_entries_size) {
+		record_entries_size = (record_entries_size > 0) ?
+				2 * record_entries_size : 4096;
+		record_entries = (record_index *) realloc(record_entries,
+				record_entries_size * sizeof(record_index));
+	}
+	record_entries[nb_record_entries].offset = record_offset;
+	record_entries[nb_record_entries].type = type;
+	record_entries[nb_record_entries].seq = seq;
+	memset(&e, 0, sizeof(e));
+	e.type = type;
+	e.size = size;
+	e.seq = seq;
+	e.timestamp = timestamp;
+	if (!write_all(record_fd, &e, sizeof(e))
+			|| !write_all(record_fd, payload, size)
+			|| !write_all(record_fd, padding, pad)) {
+		//the file is left as is, the index only covers complete entries
+		nb_record_errors++;
+		record_offset = lseek(record_fd, 0, SEEK_END);
+		return;
+	}
+	nb_record_entries++;
+	record_offset += sizeof(e) + size + pad;
+}
+
+//called from the writer thread, or once it stopped
+void flush_record_events() {
+	unsigned int tail = record_event_tail;
+	unsigned int head = __atomic_load_n(&record_event_head, __ATOMIC_ACQUIRE);
+	while (tail != head) {
+		record_event * ev = &(record_events[tail & (RECORD_EVENT_RING - 1)]);
+		append_entry(ev->entry.type, ev->entry.seq, ev->entry.timestamp,
+				&(ev->payload), ev->entry.size);
+		tail++;
+		__atomic_store_n(&record_event_tail, tail, __ATOMIC_RELEASE);
+	}
+}
+
+//called from the writer thread, or once it stopped
+void flush_record_frames() {
+	unsigned int tail = record_frame_tail;
+	unsigned int head = __atomic_load_n(&record_frame_head, __ATOMIC_ACQUIRE);
+	while (tail != head) {
+		record_frame_slot * f = &(record_frames[tail & (RECORD_FRAME_RING - 1)]);
+		append_entry(RECORD_FRAME, f->entry.seq, f->entry.timestamp, f->data,
+				f->entry.size);
+		nb_recorded_frames++;
+		tail++;
+		__atomic_store_n(&record_frame_tail, tail, __ATOMIC_RELEASE);
+	}
+}
+
+void * record_thread(void * arg) {
+	while (__atomic_load_n(&record_running, __ATOMIC_ACQUIRE)) {
+		flush_record_events();
+		flush_record_frames();
+		usleep(RECORD_FLUSH_PERIOD_US);
+	}
+	return NULL;
+}
+
+//called from the control thread only, never blocks
+void push_record_event(uint32_t type, uint32_t seq, const void * payload,
+		uint32_t size) {
+	unsigned int head = record_event_head;
+	unsigned int tail = __atomic_load_n(&record_event_tail, __ATOMIC_ACQUIRE);
+	if ((head - tail) >= RECORD_EVENT_RING) {
+		nb_events_lost++;
+		return;
+	}
+	record_event * ev = &(record_events[head & (RECORD_EVENT_RING - 1)]);
+	ev->entry.type = type;
+	ev->entry.size = size;
+	ev->entry.seq = seq;
+	ev->entry.timestamp = monotonic_time();
+	memcpy(&(ev->payload), payload, size);
+	__atomic_store_n(&record_event_head, head + 1, __ATOMIC_RELEASE);
+}
+
+int init_recording(const char * path, unsigned int w, unsigned int h) {
+	record_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (record_fd < 0) {
+		perror(path);
+		return 0;
+	}
+	memset(&rec_header, 0, sizeof(rec_header));
+	strncpy(rec_header.magic, RECORD_MAGIC, sizeof(rec_header.magic));
+	rec_header.version = RECORD_VERSION;
+	rec_header.width = w;
+	rec_header.height = h;
+	rec_header.fps = FPS;
+	if (!write_all(record_fd, &rec_header, sizeof(rec_header))) {
+		perror(path);
+		close(record_fd);
+		record_fd = -1;
+		return 0;
+	}
+	record_offset = sizeof(rec_header);
+	//touched here so that the capture thread does not take page faults
+	unsigned int i;
+	for (i = 0; i < RECORD_FRAME_RING; i++) {
+		record_frames[i].data = (unsigned char *) malloc(w * h);
+		if (record_frames[i].data == NULL) {
+			printf("Cannot allocate recording buffers \n");
+			close(record_fd);
+			record_fd = -1;
+			return 0;
+		}
+		memset(record_frames[i].data, 0, w * h);
+	}
+	record_running = 1;
+	if (pthread_create(&record_tid, NULL, record_thread, NULL) != 0) {
+		record_running = 0;
+		printf("Cannot start the recording thread \n");
+		close(record_fd);
+		record_fd = -1;
+		return 0;
+	}
+	return 1;
+}
+
+int is_recording() {
+	return record_fd >= 0;
+}
+
+//called from the capture thread, copies the frame for the writer thread, never
+//waits on the file
+void record_frame(frame_slot * slot) {
+	pthread_mutex_lock(&record_lock);
+	if (record_running) {
+		unsigned int head = record_frame_head;
+		unsigned int tail = __atomic_load_n(&record_frame_tail, __ATOMIC_ACQUIRE);
+		if ((head - tail) >= RECORD_FRAME_RING
+				|| slot->img.total() != rec_header.width * rec_header.height) {
+			nb_frames_lost++;
+		} else {
+			record_frame_slot * f = &(record_frames[head & (RECORD_FRAME_RING - 1)]);
+			f->entry.seq = slot->seq;
+			f->entry.timestamp = slot->timestamp;
+			f->entry.size = slot->img.total();
+			memcpy(f->data, slot->img.data, f->entry.size);
+			__atomic_store_n(&record_frame_head, head + 1, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&record_lock);
+}
+
+void record_compass_sample(unsigned int seq, short * mag, int ready,
+		double heading) {
+	record_compass c;
+	if (record_fd < 0)
+		return;
+	c.mag[0] = mag[0];
+	c.mag[1] = mag[1];
+	c.mag[2] = mag[2];
+	c.ready = ready;
+	c.heading = heading;
+	push_record_event(RECORD_COMPASS, seq, &c, sizeof(c));
+}
+
+//only changes of level are recorded
+void record_pole(unsigned int seq, int level) {
+	int32_t l = level;
+	if (record_fd < 0 || level == last_pole_level)
+		return;
+	last_pole_level = level;
+	push_record_event(RECORD_POLE, seq, &l, sizeof(l));
+}
+
+void record_actuation(unsigned int seq, float steering, float esc_speed) {
+	record_command c;
+	if (record_fd < 0)
+		return;
+	c.steering = steering;
+	c.esc_speed = esc_speed;
+	push_record_event(RECORD_COMMAND, seq, &c, sizeof(c));
+}
+
+//stop the writer thread, write the pending frames, events and the index, the
+//header is rewritten to point to it
+void close_recording() {
+	pthread_mutex_lock(&record_lock);
+	if (record_fd < 0 || !record_running) {
+		pthread_mutex_unlock(&record_lock);
+		return;
+	}
+	__atomic_store_n(&record_running, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&record_lock);
+	pthread_join(record_tid, NULL);
+	flush_record_events();
+	flush_record_frames();
+	rec_header.index_offset = record_offset;
+	rec_header.nb_entries = nb_record_entries;
+	if (!write_all(record_fd, record_entries,
+			nb_record_entries * sizeof(record_index))
+			|| pwrite(record_fd, &rec_header, sizeof(rec_header), 0)
+					!= sizeof(rec_header)) {
+		nb_record_errors++;
+	}
+	close(record_fd);
+	record_fd = -1;
+	printf("Recorded %lu frames, %lu entries, %lu frames and %lu events lost, %lu write errors \n",
+			nb_recorded_frames, nb_record_entries, nb_frames_lost,
+			nb_events_lost, nb_record_errors);
+	free(record_entries);
+	record_entries = NULL;
+	unsigned int i;
+	for (i = 0; i < RECORD_FRAME_RING; i++) {
+		free(record_frames[i].data);
+		record_frames[i].data = NULL;
+	}
+}
+
+//rebuild the index of a recording that was not closed, a truncated last entry is ignored
+unsigned long scan_recording() {
+	uint64_t offset = sizeof(record_header);
+	unsigned long n = 0, size = 0;
+	replay_index = NULL;
+	while (offset + sizeof(record_entry) <= replay_size) {
+		record_entry * e = (record_entry *) (replay_data + offset);
+		uint64_t next = offset + sizeof(record_entry) + e->size
+				+ ((8 - (e->size & 7)) & 7);
+		if (e->type < RECORD_FRAME || e->type > RECORD_COMMAND
+				|| next > replay_size)
+			break;
+		if (n == size) {
+			size = (size > 0) ? 2 * size : 4096;
+			replay_index = (record_index *) realloc(replay_index,
+					size * sizeof(record_index));
+		}
+		replay_index[n].offset = offset;
+		replay_index[n].type = e->type;
+		replay_index[n].seq = e->seq;
+		n++;
+		offset = next;
+	}
+	replay_index_scanned = 1;
+	return n;
+}
+
+int init_replay(const char * path, int realtime) {
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return 0;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(record_header)) {
+		printf("%s is not a recording \n", path);
+		close(fd);
+		return 0;
+	}
+	replay_size = st.st_size;
+	replay_data = (unsigned char *) mmap(NULL, replay_size, PROT_READ,
+			MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (replay_data == MAP_FAILED) {
+		perror(path);
+		replay_data = NULL;
+		return 0;
+	}
+	madvise(replay_data, replay_size, MADV_SEQUENTIAL);
+	replay_header = (record_header *) replay_data;
+	if (strncmp(replay_header->magic, RECORD_MAGIC, sizeof(replay_header->magic))
+			!= 0 || replay_header->version != RECORD_VERSION) {
+		printf("%s is not a version %d recording \n", path, RECORD_VERSION);
+		munmap(replay_data, replay_size);
+		replay_data = NULL;
+		return 0;
+	}
+	if (replay_header->index_offset > 0
+			&& replay_header->index_offset
+					+ replay_header->nb_entries * sizeof(record_index)
+					<= replay_size) {
+		replay_index = (record_index *) (replay_data
+				+ replay_header->index_offset);
+		replay_nb_entries = replay_header->nb_entries;
+	} else {
+		printf("%s has no index, scanning \n", path);
+		replay_nb_entries = scan_recording();
+	}
+	replay_realtime = realtime;
+	unsigned long i;
+	for (i = 0; i < replay_nb_entries; i++) {
+		if (replay_index[i].type == RECORD_POLE)
+			replay_has_pole = 1;
+	}
+	printf("Replaying %s : %lu entries, %ux%u frames, %s \n", path,
+			replay_nb_entries, replay_header->width, replay_header->height,
+			realtime ? "real time" : "as fast as possible");
+	return 1;
+}
+
+int is_replaying() {
+	return replay_data != NULL;
+}
+
+//move the cursor to the next entry of a type, without consuming it
+record_entry * peek_entry(unsigned long * cursor, uint32_t type) {
+	while ((*cursor) < replay_nb_entries && replay_index[(*cursor)].type != type)
+		(*cursor)++;
+	if ((*cursor) >= replay_nb_entries)
+		return NULL;
+	return (record_entry *) (replay_data + replay_index[(*cursor)].offset);
+}
+
+//return 0 at the end of the recording
+int replay_frame(frame_slot * slot) {
+	record_entry * e = peek_entry(&frame_cursor, RECORD_FRAME);
+	if (e == NULL)
+		return 0;
+	frame_cursor++;
+	if (e->size != slot->img.total()) {
+		printf("Recorded frame size %u does not match %lu \n", e->size,
+				(unsigned long) slot->img.total());
+		return 0;
+	}
+	if (!replay_started) {
+		replay_started = 1;
+		replay_clock_start = monotonic_time();
+		replay_first_timestamp = e->timestamp;
+	} else if (replay_realtime) {
+		struct timespec due;
+		double t = replay_clock_start + (e->timestamp - replay_first_timestamp);
+		due.tv_sec = (time_t) t;
+		due.tv_nsec = (long) ((t - due.tv_sec) * 1000000000.0);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+	}
+	memcpy(slot->img.data, ((unsigned char *) e) + sizeof(record_entry),
+			e->size);
+	slot->timestamp = e->timestamp;
+	slot->seq = e->seq;
+	nb_replayed_frames++;
+	return 1;
+}
+
+//samples read while processing a frame are returned in the same order,
+//return the recorded ready status, 0 once they are exhausted
+int replay_compass_sample(unsigned int seq, short * mag, double * heading) {
+	record_entry * e;
+	while ((e = peek_entry(&compass_cursor, RECORD_COMPASS)) != NULL
+			&& e->seq < seq)
+		compass_cursor++;
+	if (e == NULL || e->seq != seq)
+		return 0;
+	compass_cursor++;
+	record_compass * c = (record_compass *) (((unsigned char *) e)
+			+ sizeof(record_entry));
+	mag[0] = c->mag[0];
+	mag[1] = c->mag[1];
+	mag[2] = c->mag[2];
+	(*heading) = c->heading;
+	return c->ready;
+}
+
+//level of the pole switch at a frame, return 0 if the recording has no pole input
+int replay_pole(unsigned int seq, int * level) {
+	record_entry * e;
+	if (!replay_has_pole)
+		return 0;
+	while ((e = peek_entry(&pole_cursor, RECORD_POLE)) != NULL
+			&& (e->seq <= seq || replay_pole_level < 0)) {
+		replay_pole_level =
+				*((int32_t *) (((unsigned char *) e) + sizeof(record_entry)));
+		pole_cursor++;
+	}
+	(*level) = replay_pole_level;
+	return 1;
+}
+
+//compare a command with the one recorded for the same frame
+void replay_actuation(unsigned int seq, float steering, float esc_speed) {
+	record_entry * e;
+	while ((e = peek_entry(&command_cursor, RECORD_COMMAND)) != NULL
+			&& e->seq < seq)
+		command_cursor++;
+	if (e == NULL || e->seq != seq) {
+		nb_commands_unrecorded++;
+		return;
+	}
+	command_cursor++;
+	record_command * c = (record_command *) (((unsigned char *) e)
+			+ sizeof(record_entry));
+	double steering_error = fabs(c->steering - steering);
+	double esc_error = fabs(c->esc_speed - esc_speed);
+	nb_commands_compared++;
+	if (steering_error > 0. || esc_error > 0.)
+		nb_commands_mismatch++;
+	if (steering_error > max_steering_error)
+		max_steering_error = steering_error;
+	if (esc_error > max_esc_error)
+		max_esc_error = esc_error;
+}
+
+void print_replay_stats() {
+	if (!is_replaying())
+		return;
+	printf("Replayed %lu frames, %lu commands compared to the recording, %lu differ, %lu not recorded \n",
+			nb_replayed_frames, nb_commands_compared, nb_commands_mismatch,
+			nb_commands_unrecorded);
+	if (nb_commands_mismatch > 0)
+		printf("Max command difference : steering %f, esc %f \n",
+				max_steering_error, max_esc_error);
+}
@@ -0,0 +1,451 @@
+#include "simulator.hpp"
+
+//The robot is a kinematic bicycle driven by the servo and esc commands, the camera
+//view is rendered from a ground map of the track through the camera calibration :
+//each pixel is undistorted and projected on the ground once, frames only transform
+//those ground points by the robot pose and look them up in the map.
+//World frame follows the bot frame, heading is positive when turning right.
+
+typedef struct sim_point {
+	float x;
+	float y;
+} sim_point;
+
+typedef struct sim_command {
+	double time; //time at which the wheels respond
+	float steering;
+	float esc_speed;
+} sim_command;
+
+int simulating = 0;
+double sim_delay = SIM_DEFAULT_DELAY;
+double sim_ct[12];
+
+//track
+sim_point * track = NULL;
+double * track_s = NULL; //arc length at each point
+unsigned int track_size = 0;
+double track_length = 0.;
+
+//ground map
+unsigned char * ground = NULL;
+unsigned int ground_w = 0, ground_h = 0;
+double ground_x0 = 0., ground_y0 = 0.;
+
+//ground position of each pixel in the bot frame, x < 0 above the horizon
+float * pixel_ground_x = NULL;
+float * pixel_ground_y = NULL;
+
+//robot state
+double sim_x = 0., sim_y = 0., sim_yaw = 0., sim_speed = 0.;
+double sim_steer = 0., sim_target_speed = 0.;
+double sim_esc_gain = 1.; //fraction of SIM_MAX_SPEED a full esc command reaches
+double sim_time = 0.;
+unsigned int sim_seq = 0;
+sim_command commands[SIM_COMMAND_QUEUE];
+unsigned int command_head = 0, command_tail = 0;
+void (*sim_tick)(double t) = NULL; //called at the control rate in simulated time
+double sim_tick_period = 0., sim_next_tick = 0.;
+
+//metrics
+double sim_wall_start = 0.;
+double last_progress = 0., total_progress = 0.;
+int has_progress = 0;
+unsigned int nb_laps = 0;
+double lap_start = -1.;
+double lap_times[SIM_LAPS];
+double cte_sum = 0., cte_square_sum = 0., cte_max = 0.;
+unsigned long nb_cte = 0;
+double distance_travelled = 0., max_speed_reached = 0.;
+double lateral_square_sum = 0., lateral_max = 0.; //acceleration, grip used in turns
+unsigned long nb_lateral = 0;
+int line_in_view = 1, off_track = 0;
+unsigned long nb_out_of_view = 0, nb_off_track = 0, nb_frames_out_of_view = 0;
+//state estimate against the simulated pose
+double score_x0 = 0., score_y0 = 0., score_ex0 = 0., score_ey0 = 0.;
+double score_position = 0., score_position_max = 0., score_heading = 0.,
+		score_speed = 0.;
+unsigned long nb_scores = 0;
+
+void add_track_point(float x, float y) {
+	if ((track_size & 255) == 0)
+		track = (sim_point *) realloc(track,
+				(track_size + 256) * sizeof(sim_point));
+	track[track_size].x = x;
+	track[track_size].y = y;
+	track_size++;
+}
+
+void oval_track() {
+	double a, s;
+	for (s = 0.; s < SIM_OVAL_STRAIGHT; s += 50.)
+		add_track_point(s, 0.);
+	for (a = 0.; a < M_PI; a += 50. / SIM_OVAL_RADIUS)
+		add_track_point(SIM_OVAL_STRAIGHT + SIM_OVAL_RADIUS * sin(a),
+				SIM_OVAL_RADIUS - SIM_OVAL_RADIUS * cos(a));
+	for (s = SIM_OVAL_STRAIGHT; s > 0.; s -= 50.)
+		add_track_point(s, 2. * SIM_OVAL_RADIUS);
+	for (a = 0.; a < M_PI; a += 50. / SIM_OVAL_RADIUS)
+		add_track_point(-SIM_OVAL_RADIUS * sin(a),
+				SIM_OVAL_RADIUS + SIM_OVAL_RADIUS * cos(a));
+}
+
+//one "x y" point in mm per line, the track is closed from the last point to the first
+int load_track(const char * path) {
+	char line[256];
+	float x, y;
+	FILE * f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		return 0;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%f %f", &x, &y) == 2)
+			add_track_point(x, y);
+	}
+	fclose(f);
+	return track_size >= 3;
+}
+
+double distance_to_segment(double px, double py, sim_point * a, sim_point * b,
+		double * t) {
+	double dx = b->x - a->x, dy = b->y - a->y;
+	double l2 = dx * dx + dy * dy;
+	(*t) = (l2 > 0.) ? ((px - a->x) * dx + (py - a->y) * dy) / l2 : 0.;
+	if ((*t) < 0.)
+		(*t) = 0.;
+	if ((*t) > 1.)
+		(*t) = 1.;
+	double ex = px - (a->x + (*t) * dx), ey = py - (a->y + (*t) * dy);
+	return sqrt(ex * ex + ey * ey);
+}
+
+//distance to the track and arc length of the closest point
+double track_distance(double px, double py, double * progress) {
+	unsigned int i;
+	double best = 1e12;
+	for (i = 0; i < track_size; i++) {
+		double t;
+		sim_point * b = &(track[(i + 1) % track_size]);
+		double d = distance_to_segment(px, py, &(track[i]), b, &t);
+		if (d < best) {
+			double next_s = (i + 1 < track_size) ? track_s[i + 1] : track_length;
+			best = d;
+			(*progress) = track_s[i] + t * (next_s - track_s[i]);
+		}
+	}
+	return best;
+}
+
+//speckles are placed from a hash of the cell so that the ground is the same on every run
+unsigned char ground_texture(unsigned int i, unsigned int j) {
+#ifdef VO
+	unsigned int h = (i * 73856093u) ^ (j * 19349663u);
+	h ^= h >> 13;
+	h *= 0x5bd1e995u;
+	h ^= h >> 15;
+	if ((h & 63) == 0)
+		return SIM_TEXTURE_LEVEL;
+#endif
+	return SIM_GROUND_LEVEL;
+}
+
+void build_ground() {
+	unsigned int i, j, k;
+	double min_x = 1e12, min_y = 1e12, max_x = -1e12, max_y = -1e12;
+	for (k = 0; k < track_size; k++) {
+		min_x = fmin(min_x, track[k].x);
+		min_y = fmin(min_y, track[k].y);
+		max_x = fmax(max_x, track[k].x);
+		max_y = fmax(max_y, track[k].y);
+	}
+	ground_x0 = min_x - SIM_MARGIN_MM;
+	ground_y0 = min_y - SIM_MARGIN_MM;
+	ground_w = (max_x - min_x + 2 * SIM_MARGIN_MM) / SIM_GRID_MM;
+	ground_h = (max_y - min_y + 2 * SIM_MARGIN_MM) / SIM_GRID_MM;
+	ground = (unsigned char *) malloc(ground_w * ground_h);
+	for (j = 0; j < ground_h; j++)
+		for (i = 0; i < ground_w; i++)
+			ground[j * ground_w + i] = ground_texture(i, j);
+	//paint cells close to each segment
+	for (k = 0; k < track_size; k++) {
+		sim_point * a = &(track[k]), * b = &(track[(k + 1) % track_size]);
+		int i0 = (fmin(a->x, b->x) - SIM_LINE_WIDTH - ground_x0) / SIM_GRID_MM;
+		int i1 = (fmax(a->x, b->x) + SIM_LINE_WIDTH - ground_x0) / SIM_GRID_MM;
+		int j0 = (fmin(a->y, b->y) - SIM_LINE_WIDTH - ground_y0) / SIM_GRID_MM;
+		int j1 = (fmax(a->y, b->y) + SIM_LINE_WIDTH - ground_y0) / SIM_GRID_MM;
+		int ii, jj;
+		for (jj = j0; jj <= j1; jj++) {
+			for (ii = i0; ii <= i1; ii++) {
+				double t;
+				double d = distance_to_segment(
+						ground_x0 + (ii + 0.5) * SIM_GRID_MM,
+						ground_y0 + (jj + 0.5) * SIM_GRID_MM, a, b, &t);
+				if (d <= SIM_LINE_WIDTH / 2.)
+					ground[jj * ground_w + ii] = SIM_LINE_LEVEL;
+			}
+		}
+	}
+}
+
+void build_pixel_ground() {
+	unsigned int u, v;
+	pixel_ground_x = (float *) malloc(IMAGE_WIDTH * IMAGE_HEIGHT * sizeof(float));
+	pixel_ground_y = (float *) malloc(IMAGE_WIDTH * IMAGE_HEIGHT * sizeof(float));
+	for (v = 0; v < IMAGE_HEIGHT; v++) {
+		for (u = 0; u < IMAGE_WIDTH; u++) {
+			float iu, iv, gx, gy;
+			undistort_radial(K, u, v, &iu, &iv, radial_undistort,
+					POLY_UNDISTORT_SIZE);
+			pixel_to_ground_plane(sim_ct, iu, iv, &gx, &gy);
+			if (!(gx > 0. && gx < SIM_MAX_VIEW_MM))
+				gx = -1.;
+			pixel_ground_x[v * IMAGE_WIDTH + u] = gx;
+			pixel_ground_y[v * IMAGE_WIDTH + u] = gy;
+		}
+	}
+}
+
+//track_path is a track file or "oval" for the default track
+int init_simulator(const char * track_path, double actuation_delay) {
+	unsigned int i;
+	if (strcmp(track_path, "oval") == 0) {
+		oval_track();
+	} else if (!load_track(track_path)) {
+		printf("Cannot load a track from %s \n", track_path);
+		return 0;
+	}
+	track_s = (double *) malloc(track_size * sizeof(double));
+	track_length = 0.;
+	for (i = 0; i < track_size; i++) {
+		sim_point * a = &(track[i]), * b = &(track[(i + 1) % track_size]);
+		track_s[i] = track_length;
+		track_length += sqrt(pow(b->x - a->x, 2) + pow(b->y - a->y, 2));
+	}
+	calc_ct(camera_pose, K, cam_to_bot_in_world, sim_ct);
+	build_ground();
+	build_pixel_ground();
+	//start on the first point, along the first segment
+	sim_x = track[0].x;
+	sim_y = track[0].y;
+	sim_yaw = atan2(track[1].y - track[0].y, track[1].x - track[0].x);
+	sim_delay = actuation_delay;
+	simulating = 1;
+	sim_wall_start = monotonic_time();
+	printf("Simulating a %.1f m track, %.0f ms from capture to actuation \n",
+			track_length / 1000., sim_delay * 1000.);
+	return 1;
+}
+
+//run a control loop faster than the frames, on the physics steps
+//a sagging battery or a slipping drive, the same esc command gives less speed
+void sim_set_esc_gain(double gain) {
+	sim_esc_gain = gain;
+}
+
+void sim_set_tick(void (*tick)(double t), double rate) {
+	sim_tick = tick;
+	sim_tick_period = 1. / rate;
+	sim_next_tick = sim_time;
+}
+
+int is_simulating() {
+	return simulating;
+}
+
+//commands are applied once the actuation delay has elapsed
+void sim_actuate(float steering, float esc_speed) {
+	if ((command_head - command_tail) >= SIM_COMMAND_QUEUE)
+		command_tail++; //oldest command is lost
+	sim_command * c = &(commands[command_head & (SIM_COMMAND_QUEUE - 1)]);
+	c->time = sim_time + sim_delay;
+	c->steering = steering;
+	c->esc_speed = esc_speed;
+	command_head++;
+}
+
+double sim_heading() {
+	double h = fmod(SIM_NORTH_DEG + sim_yaw * 180. / M_PI, 360.);
+	return (h < 0.) ? h + 360. : h;
+}
+
+//estimates are in the compass frame from where the estimator started, errors are
+//taken on displacements since the first estimate scored
+void sim_score_estimate(double x, double y, double heading, double speed) {
+	double north = SIM_NORTH_DEG * M_PI / 180.;
+	if (nb_scores == 0) {
+		score_x0 = sim_x;
+		score_y0 = sim_y;
+		score_ex0 = x;
+		score_ey0 = y;
+	}
+	double dx = sim_x - score_x0, dy = sim_y - score_y0;
+	double tx = cos(north) * dx - sin(north) * dy;
+	double ty = sin(north) * dx + cos(north) * dy;
+	double e = hypot((x - score_ex0) - tx, (y - score_ey0) - ty);
+	double h = fmod(heading - sim_heading(), 360.);
+	if (h >= 180.)
+		h -= 360.;
+	if (h < -180.)
+		h += 360.;
+	score_position += e * e;
+	if (e > score_position_max)
+		score_position_max = e;
+	score_heading += h * h;
+	score_speed += (speed - sim_speed) * (speed - sim_speed);
+	nb_scores++;
+}
+
+void apply_commands() {
+	while (command_tail != command_head) {
+		sim_command * c = &(commands[command_tail & (SIM_COMMAND_QUEUE - 1)]);
+		if (c->time > sim_time)
+			break;
+		//same saturation as the servo and esc drivers
+		float steering = fmax(-1., fmin(1., c->steering));
+		float esc = fmax(0., fmin(1., c->esc_speed));
+		//a negative servo command turns toward the right, positive yaw
+		sim_steer = -steering * SIM_MAX_STEER_ANGLE * M_PI / 180.;
+		sim_target_speed = esc * SIM_MAX_SPEED * sim_esc_gain;
+		command_tail++;
+	}
+}
+
+void update_metrics() {
+	double progress;
+	double cte = track_distance(sim_x, sim_y, &progress);
+	nb_cte++;
+	cte_sum += cte;
+	cte_square_sum += cte * cte;
+	if (cte > cte_max)
+		cte_max = cte;
+	if (cte > SIM_OFF_TRACK_MM && !off_track)
+		nb_off_track++;
+	off_track = cte > SIM_OFF_TRACK_MM;
+	if (sim_speed > max_speed_reached)
+		max_speed_reached = sim_speed;
+	if (!has_progress) {
+		last_progress = progress;
+		has_progress = 1;
+		return;
+	}
+	double ds = progress - last_progress;
+	if (ds < -track_length / 2.)
+		ds += track_length;
+	if (ds > track_length / 2.)
+		ds -= track_length;
+	last_progress = progress;
+	total_progress += ds;
+	if (lap_start < 0. && sim_speed > 0.)
+		lap_start = sim_time;
+	if (total_progress >= (nb_laps + 1) * track_length && nb_laps < SIM_LAPS) {
+		lap_times[nb_laps] = sim_time - lap_start;
+		lap_start = sim_time;
+		nb_laps++;
+		printf("Lap %u : %.2f s \n", nb_laps, lap_times[nb_laps - 1]);
+	}
+}
+
+void sim_step(double dt) {
+	apply_commands();
+	sim_speed += (sim_target_speed - sim_speed) * (dt / SIM_SPEED_TAU);
+	sim_x += sim_speed * cos(sim_yaw) * dt;
+	sim_y += sim_speed * sin(sim_yaw) * dt;
+	sim_yaw += (sim_speed / SIM_WHEELBASE) * tan(sim_steer) * dt;
+	double lateral = sim_speed * sim_speed * fabs(tan(sim_steer)) / SIM_WHEELBASE;
+	lateral_square_sum += lateral * lateral;
+	if (lateral > lateral_max)
+		lateral_max = lateral;
+	nb_lateral++;
+	distance_travelled += sim_speed * dt;
+	sim_time += dt;
+	update_metrics();
+}
+
+//render the rows of the mask, or the whole frame, return the number of line pixels
+unsigned long sim_render(Mat & img, unsigned char * row_mask) {
+	unsigned int u, v;
+	unsigned long nb_line = 0;
+	double c = cos(sim_yaw), s = sin(sim_yaw);
+	for (v = 0; v < (unsigned int) img.rows; v++) {
+		if (row_mask != NULL && !row_mask[v])
+			continue;
+		unsigned char * row = img.ptr<unsigned char>(v);
+		float * gx = &(pixel_ground_x[v * IMAGE_WIDTH]);
+		float * gy = &(pixel_ground_y[v * IMAGE_WIDTH]);
+		for (u = 0; u < (unsigned int) img.cols; u++) {
+			if (gx[u] < 0.) {
+				row[u] = SIM_GROUND_LEVEL;
+				continue;
+			}
+			double wx = sim_x + c * gx[u] - s * gy[u];
+			double wy = sim_y + s * gx[u] + c * gy[u];
+			int i = (wx - ground_x0) / SIM_GRID_MM;
+			int j = (wy - ground_y0) / SIM_GRID_MM;
+			if (i < 0 || j < 0 || i >= (int) ground_w || j >= (int) ground_h) {
+				row[u] = SIM_GROUND_LEVEL;
+				continue;
+			}
+			row[u] = ground[j * ground_w + i];
+			if (row[u] == SIM_LINE_LEVEL)
+				nb_line++;
+		}
+	}
+	return nb_line;
+}
+
+//advance the robot by a frame period and render the camera view,
+//return 0 once the laps are done or the time is over
+int sim_read_frame(frame_slot * slot, unsigned char * row_mask) {
+	int i;
+	if (nb_laps >= SIM_LAPS || sim_time >= SIM_MAX_TIME)
+		return 0;
+	slot->img.create(IMAGE_HEIGHT, IMAGE_WIDTH, CV_8UC1);
+	if (sim_seq > 0) {
+		for (i = 0; i < SIM_SUBSTEPS; i++) {
+			sim_step(1. / (FPS * SIM_SUBSTEPS));
+			if (sim_tick != NULL && sim_time >= sim_next_tick) {
+				sim_tick(sim_time);
+				sim_next_tick += sim_tick_period;
+			}
+		}
+	}
+	unsigned long nb_line = sim_render(slot->img, row_mask);
+	if (nb_line == 0) {
+		nb_frames_out_of_view++;
+		if (line_in_view)
+			nb_out_of_view++;
+	}
+	line_in_view = nb_line > 0;
+	slot->timestamp = sim_time;
+	slot->seq = sim_seq++;
+	return 1;
+}
+
+void print_simulator_report() {
+	unsigned int i;
+	if (!simulating)
+		return;
+	double wall = monotonic_time() - sim_wall_start;
+	printf("Simulated %.2f s in %.2f s (%.1fx real time), %.1f m travelled, max speed %.2f m/s \n",
+			sim_time, wall, (wall > 0.) ? sim_time / wall : 0.,
+			distance_travelled / 1000., max_speed_reached / 1000.);
+	if (nb_lateral > 0)
+		printf("Mean speed %.2f m/s, lateral acceleration rms %.2f m/s^2, max %.2f m/s^2 \n",
+				(sim_time > 0.) ? distance_travelled / sim_time / 1000. : 0.,
+				sqrt(lateral_square_sum / nb_lateral) / 1000., lateral_max / 1000.);
+	printf("Laps completed : %u/%d \n", nb_laps, SIM_LAPS);
+	for (i = 0; i < nb_laps; i++)
+		printf("	lap %u : %.2f s \n", i + 1, lap_times[i]);
+	if (nb_cte > 0)
+		printf("Cross track error : mean %.1f mm, rms %.1f mm, max %.1f mm \n",
+				cte_sum / nb_cte, sqrt(cte_square_sum / nb_cte), cte_max);
+	printf("Line out of view %lu times (%lu frames), off track %lu times \n",
+			nb_out_of_view, nb_frames_out_of_view, nb_off_track);
+	if (nb_scores > 0)
+		printf("Estimate : position rms %.0f mm, max %.0f mm, heading rms %.2f deg, speed rms %.0f mm/s \n",
+				sqrt(score_position / nb_scores), score_position_max,
+				sqrt(score_heading / nb_scores), sqrt(score_speed / nb_scores));
+}
@@ -0,0 +1,74 @@
+#include "speed_control.hpp"
+
+//Closed-loop esc speed : the target jumps from frame to frame as the planner sees
+//new turns, the esc tracks a reference following it within the planner acceleration
+//limits. The command is the nominal one for the reference, led by the esc response
+//time and kept within the esc range, plus a PI correction on the measured ground
+//speed. The integral only grows while the command is not saturated against the way
+//it would push (anti-windup). Without a recent measurement the correction keeps the
+//integral, fading slowly, and drops the proportional term, so that a visual
+//odometry dropout neither freezes a wrong command nor lets the integral run away.
+
+void init_speed_controller(speed_controller * s) {
+	memset(s, 0, sizeof(speed_controller));
+}
+
+//target and measured in mm/s, valid is 0 when no recent measurement exists,
+//return the esc command
+float update_speed_controller(speed_controller * s, double t, float target,
+		float measured, int valid) {
+	double dt = (s->nb_updates > 0) ? t - s->timestamp : 0.;
+	if (dt < 0. || dt > SPEED_MAX_DT)
+		dt = 0.;
+	//the lead is bounded by the acceleration limits, a step of the target is
+	//followed over several updates instead of a command spike
+	double reference = target, rate = 0.;
+	if (dt > 0.) {
+		reference = fmax(s->reference - SPEED_MAX_DEC * dt,
+				fmin(s->reference + SPEED_MAX_ACC * dt, target));
+		rate = (reference - s->reference) / dt;
+	}
+	double feed_forward = (reference + SPEED_ESC_TAU * rate) / SPEED_FF_SPEED;
+	feed_forward = fmax(0., fmin(1., feed_forward));
+	s->timestamp = t;
+	s->target = target;
+	s->reference = reference;
+	s->measured = valid ? measured : 0.;
+	s->dropout = !valid;
+	s->nb_updates++;
+	double command;
+	if (valid && s->open_loop) {
+		double error = reference - measured;
+		s->error_square_sum += error * error;
+		command = feed_forward;
+	} else if (valid) {
+		double error = reference - measured;
+		double integral = s->integral + SPEED_KI * error * dt;
+		command = feed_forward + SPEED_KP * error + integral;
+		//anti-windup, integrate only when it does not push further into saturation
+		if (!((command > 1. && error > 0.) || (command < 0. && error < 0.)))
+			s->integral = integral;
+		command = feed_forward + SPEED_KP * error + s->integral;
+		s->error_square_sum += error * error;
+	} else {
+		s->nb_dropouts++;
+		s->integral *= exp(-dt / SPEED_DROPOUT_DECAY);
+		command = feed_forward + s->integral;
+	}
+	if (command > 1. || command < 0.)
+		s->nb_saturated++;
+	s->command = fmax(0., fmin(1., command));
+	return s->command;
+}
+
+void print_speed_controller_stats(speed_controller * s) {
+	unsigned long nb_measured = s->nb_updates - s->nb_dropouts;
+	if (s->nb_updates == 0)
+		return;
+	printf("Speed control : %s, %lu updates, %lu without measurement, %lu saturated, integral %.3f \n",
+			s->open_loop ? "open loop" : "closed loop", s->nb_updates,
+			s->nb_dropouts, s->nb_saturated, s->integral);
+	if (nb_measured > 0)
+		printf("Speed control : tracking error rms %.0f mm/s \n",
+				sqrt(s->error_square_sum / nb_measured));
+}
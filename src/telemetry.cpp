@@ -0,0 +1,234 @@
+#include "telemetry.hpp"
+#include "pipeline.hpp"
+
+//The control loop copies records into a lock-free ring and never blocks, a background
+//thread moves them into an aligned chunk that is written with O_DIRECT once full.
+//Records that do not fit in the ring are counted and dropped.
+
+telemetry_record telemetry_ring[TELEMETRY_RING_SIZE];
+unsigned int telemetry_head = 0; //only written by the control loop
+unsigned int telemetry_tail = 0; //only written by the flush thread
+int telemetry_running = 0;
+int telemetry_fd = -1;
+pthread_t telemetry_tid;
+
+unsigned char * telemetry_chunk = NULL;
+unsigned int chunk_fill = 0;
+unsigned long telemetry_file_size = 0;
+
+//control loop counters
+unsigned long nb_logged = 0;
+unsigned long nb_overflow = 0;
+double log_time_sum = 0., log_time_max = 0.;
+//flush thread counters
+unsigned long nb_chunks = 0;
+unsigned long nb_write_errors = 0;
+
+void write_chunk(unsigned int size) {
+	if (write(telemetry_fd, telemetry_chunk, size) != (ssize_t) size) {
+		nb_write_errors++;
+		return;
+	}
+	nb_chunks++;
+}
+
+//append bytes to the chunk, records may straddle two chunks
+void append_to_chunk(unsigned char * data, unsigned int size) {
+	while (size > 0) {
+		unsigned int n = TELEMETRY_CHUNK_SIZE - chunk_fill;
+		if (n > size)
+			n = size;
+		memcpy(telemetry_chunk + chunk_fill, data, n);
+		chunk_fill += n;
+		telemetry_file_size += n;
+		data += n;
+		size -= n;
+		if (chunk_fill == TELEMETRY_CHUNK_SIZE) {
+			write_chunk(TELEMETRY_CHUNK_SIZE);
+			chunk_fill = 0;
+		}
+	}
+}
+
+void drain_telemetry() {
+	unsigned int tail = telemetry_tail;
+	unsigned int head = __atomic_load_n(&telemetry_head, __ATOMIC_ACQUIRE);
+	while (tail != head) {
+		append_to_chunk(
+				(unsigned char *) &(telemetry_ring[tail
+						& (TELEMETRY_RING_SIZE - 1)]),
+				sizeof(telemetry_record));
+		tail++;
+		__atomic_store_n(&telemetry_tail, tail, __ATOMIC_RELEASE);
+	}
+}
+
+void * telemetry_thread(void * arg) {
+	while (__atomic_load_n(&telemetry_running, __ATOMIC_ACQUIRE)) {
+		drain_telemetry();
+		usleep(TELEMETRY_FLUSH_PERIOD_US);
+	}
+	drain_telemetry();
+	return NULL;
+}
+
+//return 0 if the log cannot be opened, records are then ignored
+int init_telemetry(const char * path) {
+	telemetry_header header;
+	telemetry_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	if (telemetry_fd < 0 && errno == EINVAL) {
+		//some file systems (tmpfs) do not support direct I/O
+		printf("No direct I/O for %s, using buffered writes \n", path);
+		telemetry_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if (telemetry_fd < 0) {
+		perror("telemetry");
+		return 0;
+	}
+	if (posix_memalign((void **) &telemetry_chunk, TELEMETRY_ALIGN,
+			TELEMETRY_CHUNK_SIZE) != 0) {
+		printf("Cannot allocate telemetry buffer \n");
+		close(telemetry_fd);
+		telemetry_fd = -1;
+		return 0;
+	}
+	//touch the ring so that the control loop does not take page faults
+	memset(telemetry_ring, 0, sizeof(telemetry_ring));
+	memset(&header, 0, sizeof(header));
+	strncpy(header.magic, TELEMETRY_MAGIC, sizeof(header.magic));
+	header.version = TELEMETRY_VERSION;
+	header.record_size = sizeof(telemetry_record);
+	header.start_time = monotonic_time();
+	chunk_fill = 0;
+	telemetry_file_size = 0;
+	append_to_chunk((unsigned char *) &header, sizeof(header));
+	telemetry_running = 1;
+	pthread_create(&telemetry_tid, NULL, telemetry_thread, NULL);
+	return 1;
+}
+
+//called from the control loop only, never blocks
+void telemetry_log(telemetry_record * record) {
+	if (telemetry_fd < 0)
+		return;
+	double tic_t = monotonic_time();
+	unsigned int head = telemetry_head;
+	unsigned int tail = __atomic_load_n(&telemetry_tail, __ATOMIC_ACQUIRE);
+	if ((head - tail) >= TELEMETRY_RING_SIZE) {
+		nb_overflow++;
+	} else {
+		telemetry_ring[head & (TELEMETRY_RING_SIZE - 1)] = (*record);
+		__atomic_store_n(&telemetry_head, head + 1, __ATOMIC_RELEASE);
+		nb_logged++;
+	}
+	double t = monotonic_time() - tic_t;
+	log_time_sum += t;
+	if (t > log_time_max)
+		log_time_max = t;
+}
+
+//stop the flush thread and write the last chunk, padded for direct I/O then
+//truncated to the logged size
+void close_telemetry() {
+	if (telemetry_fd < 0)
+		return;
+	__atomic_store_n(&telemetry_running, 0, __ATOMIC_RELEASE);
+	pthread_join(telemetry_tid, NULL);
+	if (chunk_fill > 0) {
+		unsigned int padded = ((chunk_fill + TELEMETRY_ALIGN - 1)
+				/ TELEMETRY_ALIGN) * TELEMETRY_ALIGN;
+		memset(telemetry_chunk + chunk_fill, 0, padded - chunk_fill);
+		write_chunk(padded);
+		if (ftruncate(telemetry_fd, telemetry_file_size) != 0)
+			perror("telemetry");
+	}
+	close(telemetry_fd);
+	telemetry_fd = -1;
+	free(telemetry_chunk);
+	telemetry_chunk = NULL;
+}
+
+void print_telemetry_stats() {
+	printf("Telemetry : %lu records, %lu dropped on overflow, %lu chunks written, %lu write errors \n",
+			nb_logged, nb_overflow, nb_chunks, nb_write_errors);
+	printf("Telemetry log time : mean %.3f us, max %.3f us \n",
+			(nb_logged + nb_overflow) > 0 ?
+					(1000000. * log_time_sum / (nb_logged + nb_overflow)) : 0.,
+			1000000. * log_time_max);
+}
+
+//every version appended fields before the flags, the fields of an older record are
+//a prefix of the current ones, return their size or 0 for an unknown version
+size_t telemetry_fields_size(unsigned int version) {
+	switch (version) {
+	case 1:
+		return offsetof(telemetry_record, latency);
+	case 2:
+		return offsetof(telemetry_record, frames_dropped);
+	case 3:
+		return offsetof(telemetry_record, est_x);
+	case 4:
+		return offsetof(telemetry_record, target_speed);
+	case TELEMETRY_VERSION:
+		return offsetof(telemetry_record, flags);
+	}
+	return 0;
+}
+
+//decode a log to CSV, one line per record, return the number of records or -1.
+//Logs of older versions are decoded too, the fields they did not have are 0.
+//Times are from the first record, records carry capture times, which come from
+//the recording or the simulation clock when the run was not live.
+int telemetry_to_csv(const char * path, FILE * out) {
+	telemetry_header header;
+	telemetry_record r;
+	unsigned char buffer[sizeof(telemetry_record)];
+	double origin = 0.;
+	int n = 0;
+	FILE * in = fopen(path, "rb");
+	if (in == NULL) {
+		perror(path);
+		return -1;
+	}
+	if (fread(&header, sizeof(header), 1, in) != 1
+			|| strncmp(header.magic, TELEMETRY_MAGIC, sizeof(header.magic)) != 0) {
+		printf("%s is not a telemetry log \n", path);
+		fclose(in);
+		return -1;
+	}
+	size_t fields = telemetry_fields_size(header.version);
+	if (fields == 0 || header.record_size < fields + sizeof(r.flags)
+			|| header.record_size > sizeof(telemetry_record)) {
+		printf("%s : unsupported version %u with records of %u bytes, version %d to %d expected \n",
+				path, header.version, header.record_size, 1, TELEMETRY_VERSION);
+		fclose(in);
+		return -1;
+	}
+	//on stderr, the CSV may go to stdout
+	if (header.version != TELEMETRY_VERSION)
+		fprintf(stderr, "%s : version %u decoded, fields added since are 0 \n",
+				path, header.version);
+	fprintf(out,
+			"time;seq;p0;p1;p2;min_x;max_x;confidence;speed_x;speed_y;speed_pop;heading;steering;esc_speed;updated;latency;deadline_miss;latency_p99;deadline_misses;degraded;frames_dropped;frames_degraded;heading_stale;est_x;est_y;est_heading;est_speed;est_position_std;target_speed;measured_speed;speed_dropout\n");
+	while (fread(buffer, header.record_size, 1, in) == 1) {
+		memset(&r, 0, sizeof(r));
+		memcpy(&r, buffer, fields);
+		memcpy(&(r.flags), buffer + fields, sizeof(r.flags));
+		if (n == 0)
+			origin = r.timestamp;
+		fprintf(out, "%.6f;%u;%g;%g;%g;%g;%g;%g;%g;%g;%d;%g;%g;%g;%u;%g;%u;%g;%u;%u;%u;%u;%u;%g;%g;%g;%g;%g;%g;%g;%u\n",
+				r.timestamp - origin, r.seq, r.curve[0], r.curve[1],
+				r.curve[2], r.min_x, r.max_x, r.confidence, r.speed_x,
+				r.speed_y, r.speed_pop, r.heading, r.steering, r.esc_speed,
+				r.flags & TELEMETRY_COMMAND_UPDATED, r.latency,
+				(r.flags & TELEMETRY_DEADLINE_MISS) ? 1 : 0, r.latency_p99,
+				r.deadline_misses, (r.flags & TELEMETRY_DEGRADED) ? 1 : 0,
+				r.frames_dropped, r.frames_degraded,
+				(r.flags & TELEMETRY_HEADING_STALE) ? 1 : 0, r.est_x, r.est_y,
+				r.est_heading, r.est_speed, r.est_position_std, r.target_speed,
+				r.measured_speed, (r.flags & TELEMETRY_SPEED_DROPOUT) ? 1 : 0);
+		n++;
+	}
+	fclose(in);
+	return n;
+}
@@ -1,8 +1,5 @@
 #include <visual_odometry.hpp>
-
-#define tic      double tic_t = clock();
-#define toc      std::cout << (clock() - tic_t)/CLOCKS_PER_SEC \
-                           << " seconds" << std::endl;
+#include "profiler.hpp"
 
 typedef char binary_descriptor[DESCRIPTOR_LENGTH / 8];
 
@@ -11,6 +8,7 @@ typedef unsigned char comp_vect[4];
 typedef struct feature {
 	xy pos;
 	binary_descriptor * desc;
+	fxy ground; //ground position, only computed for keyframe features
 } feature;
 
 typedef struct descriptor_stack {
@@ -20,13 +18,21 @@ typedef struct descriptor_stack {
 } descriptor_stack;
 
 descriptor_stack * current_stack = NULL;
-descriptor_stack * last_stack = NULL;
+descriptor_stack * keyframe_stack = NULL;
 
 unsigned int nb_descriptors_in_stack = 0;
 comp_vect * briefPattern;
 
 unsigned int first_line_to_sample, last_line_to_sample;
 
+int vo_engine = VO_ENGINE_BRIEF;
+fxy last_speed = { 0., 0. };
+
+int use_keyframes = 1;
+int has_keyframe = 0;
+fxy keyframe_displacement = { 0., 0. }; //motion from keyframe to last frame
+float keyframe_yaw = 0.;
+
 void init_stack(descriptor_stack * stack, unsigned int stack_size) {
 	stack->stack = (feature **) malloc(stack_size * sizeof(feature*));
 	stack->nb = 0;
@@ -64,6 +70,21 @@ int set_stack_at(descriptor_stack * stack, unsigned int index, feature * desc) {
 	return 1;
 }
 
+void free_stack(descriptor_stack * stack) {
+	while (stack->nb > 0) {
+		feature * f;
+		pop_stack(stack, &f);
+		if (f != NULL) {
+			free(f->desc);
+			free(f);
+		}
+	}
+	free(stack->stack);
+	free(stack);
+}
+
+#define BRIEF_PATTERN_SEED 1
+
 int rand_a_b_brief(int a, int b) {
 	//return ((rand() % (b - a) + a;
 	float rand_0_1 = (((float) rand()) / ((float) RAND_MAX));
@@ -75,7 +96,7 @@ comp_vect * initBriefPattern(comp_vect * pattern, int size) {
 	if (!pattern) {
 		pattern = (comp_vect *) malloc(size * sizeof(comp_vect));
 	}
-	srand(time(NULL));
+	srand(BRIEF_PATTERN_SEED); //same pattern on every run, recordings replay identically
 	int dist_max = sqrt(pow(DESCRIPTOR_WINDOW, 2) + pow(DESCRIPTOR_WINDOW, 2));
 	int dist_min = dist_max / 2; // could be altered to have increasing resolution in the descriptor
 	for (i = 0; i < size; i++) {
@@ -142,11 +163,12 @@ binary_descriptor * compute_descriptor(Mat &img, xy pos) {
 
 unsigned int get_match_score(binary_descriptor * d0, binary_descriptor * d1) {
 	unsigned long int i, dist = 0; // j,
-	unsigned long int * bits1_32 = (unsigned long int *) (*d0);
-	unsigned long int * bits2_32 = (unsigned long int *) (*d1);
+	//32 bits words whatever the size of long, so that desktop replays match the robot
+	uint32_t * bits1_32 = (uint32_t *) (*d0);
+	uint32_t * bits2_32 = (uint32_t *) (*d1);
 
 	for (i = 0; i < (DESCRIPTOR_LENGTH / 32); i++) {
-		unsigned long int xored = bits1_32[i] ^ bits2_32[i];
+		uint32_t xored = bits1_32[i] ^ bits2_32[i];
 		dist += __builtin_popcount(xored);
 		if (dist > DESCRIPTOR_MATCH_THRESHOLD)
 			return dist; //don't try harder if this not a match
@@ -198,7 +220,8 @@ int hough_votes(fxy * flow, unsigned int nb_flows, float * speed_x,
 		int indx = (flow[i].x - SPEED_X_MIN) / SPEED_X_STEP;
 		int indy = (flow[i].y - SPEED_Y_MIN) / SPEED_Y_STEP;
 //		cout << "vote index : "<<indx << ", " << indy << endl ;
-		if (indx > HOUGH_X || indy > HOUGH_Y || indx < 0 || indy < 0)
+		vote_space_pop[i] = -1;
+		if (indx >= HOUGH_X || indy >= HOUGH_Y || indx < 0 || indy < 0)
 			continue; //does not fit the model
 		vote_space[(indy * HOUGH_X) + indx]++;
 		vote_space_pop[i] = (indy * HOUGH_X) + indx;
@@ -226,50 +249,88 @@ int hough_votes(fxy * flow, unsigned int nb_flows, float * speed_x,
 	return nb_pop_max;
 }
 
+//flow of a ground point seen at (u_last, v_last) in last frame and (u, v) in current frame
+void ground_flow(float u_last, float v_last, float u, float v, fxy * flow) {
+	float gp0x, gp0y, gp1x, gp1y;
+	float ip0x, ip0y, ip1x, ip1y;
+	//should distort point before projection
+	undistort_radial(K, u, v, &(ip0x), &(ip0y), radial_undistort,
+			POLY_UNDISTORT_SIZE);
+	undistort_radial(K, u_last, v_last, &(ip1x), &(ip1y), radial_undistort,
+			POLY_UNDISTORT_SIZE);
+	pixel_to_ground_plane(cam_ct, ip0x, ip0y, &gp0x, &gp0y);
+	pixel_to_ground_plane(cam_ct, ip1x, ip1y, &gp1x, &gp1y);
+	flow->x = gp1x - gp0x;
+	flow->y = gp1y - gp0y;
+}
+
 #define FAST_THRESHOLD 90
-int estimate_ground_speeds(Mat & img, fxy * speed) {
+//keyframe features are matched against current frame features lying close to
+//where the predicted motion brings them
+int brief_ground_flows(Mat & img, fxy * flow_vectors, fxy * predicted) {
 	unsigned int i, j;
 	int nb_corners;
 	xy* corners;
-	fxy * flow_vectors = (fxy*) malloc(STACK_SIZE * sizeof(fxy));
 	int flow_vector_size = 0;
 
+	if (current_stack != NULL) //last frame did not become a keyframe
+		free_stack(current_stack);
 	current_stack = (descriptor_stack *) malloc(sizeof(descriptor_stack));
-	corners = fast9_detect_nonmax(
-			(img.data + (first_line_to_sample * img.step)), img.cols,
-			(last_line_to_sample - first_line_to_sample), img.step,
-			FAST_THRESHOLD, &nb_corners);
+	{
+		PROFILE_SCOPE(PROFILE_FAST);
+		corners = fast9_detect_nonmax(
+				(img.data + (first_line_to_sample * img.step)), img.cols,
+				(last_line_to_sample - first_line_to_sample), img.step,
+				FAST_THRESHOLD, &nb_corners);
+	}
 	init_stack(current_stack, STACK_SIZE);
 #ifdef DEBUG
 	cout << "found " << nb_corners << " corners" << endl;
 #endif
-	for (i = 0; i < nb_corners; i++) {
-		corners[i].y += first_line_to_sample;
-		feature * current = (feature *) malloc(sizeof(feature));
-		current->pos.x = corners[i].x;
-		current->pos.y = corners[i].y;
-		/*	showPatch(img.data, "patch", img.cols, img.rows,
-		 corners[i].x, corners[i].y);*/
-		current->desc = compute_descriptor(img, corners[i]);
+	{
+		PROFILE_SCOPE(PROFILE_BRIEF);
+		for (i = 0; i < nb_corners; i++) {
+			corners[i].y += first_line_to_sample;
+			feature * current = (feature *) malloc(sizeof(feature));
+			current->pos.x = corners[i].x;
+			current->pos.y = corners[i].y;
+			/*	showPatch(img.data, "patch", img.cols, img.rows,
+			 corners[i].x, corners[i].y);*/
+			current->desc = compute_descriptor(img, corners[i]);
 #ifdef DEBUG
-		circle(img, Point(current->pos.x, current->pos.y), 2,
-				Scalar(0, 0, 0, 0), 2, 8, 0);
+			circle(img, Point(current->pos.x, current->pos.y), 2,
+					Scalar(0, 0, 0, 0), 2, 8, 0);
 #endif
-		if (push_stack(current_stack, current) == 0)
-			break;
+			if (push_stack(current_stack, current) == 0)
+				break;
+		}
 	}
 	free(corners); //corners where copied in feature, it can be freed
-	if (last_stack != NULL) {
+	if (keyframe_stack != NULL) {
+		PROFILE_SCOPE(PROFILE_MATCH);
+		float pu[STACK_SIZE], pv[STACK_SIZE];
+		unsigned char matched[STACK_SIZE];
+		for (j = 0; j < keyframe_stack->nb; j++) {
+			feature * f1;
+			get_stack_at(keyframe_stack, j, &f1);
+			ground_plane_to_pixel(cam_ct, f1->ground.x - predicted->x,
+					f1->ground.y - predicted->y, &(pu[j]), &(pv[j]));
+			distort_radial(K, pu[j], pv[j], &(pu[j]), &(pv[j]), radial_distort,
+					POLY_DISTORT_SIZE);
+			matched[j] = 0;
+		}
 		for (i = 0; i < current_stack->nb; i++) {
 			feature * f0 = NULL;
 			unsigned int best_score = DESCRIPTOR_MATCH_THRESHOLD;
 			unsigned int best_score_index = 0;
 			get_stack_at(current_stack, i, &f0);
-			for (j = 0; j < last_stack->nb; j++) {
+			for (j = 0; j < keyframe_stack->nb; j++) {
 				feature * f1;
-				get_stack_at(last_stack, j, &f1);
-				if (f1 == NULL)
+				if (matched[j]
+						|| fabs(pu[j] - f0->pos.x) > VO_MATCH_RADIUS
+						|| fabs(pv[j] - f0->pos.y) > VO_MATCH_RADIUS)
 					continue;
+				get_stack_at(keyframe_stack, j, &f1);
 				unsigned int score = get_match_score(f1->desc, f0->desc);
 				if (score < best_score) {
 					best_score = score;
@@ -278,55 +339,208 @@ int estimate_ground_speeds(Mat & img, fxy * speed) {
 			}
 			if (best_score < DESCRIPTOR_MATCH_THRESHOLD) {
 				feature * f1;
-				get_stack_at(last_stack, best_score_index, &f1);
-				//project in robot frame
-				float gp0x, gp0y, gp1x, gp1y;
-				float ip0x, ip0y, ip1x, ip1y;
+				get_stack_at(keyframe_stack, best_score_index, &f1);
 #ifdef DEBUG
 				line(img, Point(f0->pos.x, f0->pos.y),
 						Point(f1->pos.x, f1->pos.y), Scalar(255, 0, 0, 0), 2, 8,
 						0);
 #endif
-				//should distort point before projection
-				undistort_radial(K, (float) f0->pos.x, (float) f0->pos.y,
-						&(ip0x), &(ip0y), radial_undistort,
-						POLY_UNDISTORT_SIZE);
-				undistort_radial(K, (float) f1->pos.x, (float) f1->pos.y,
-						&(ip1x), &(ip1y), radial_undistort,
-						POLY_UNDISTORT_SIZE);
-				pixel_to_ground_plane(cam_ct, ip0x, ip0y, &gp0x, &gp0y);
-				pixel_to_ground_plane(cam_ct, ip1x, ip1y, &gp1x, &gp1y);
-				flow_vectors[flow_vector_size].x = gp1x - gp0x;
-				flow_vectors[flow_vector_size].y = gp1y - gp0y;
+				//project in robot frame
+				ground_flow((float) f1->pos.x, (float) f1->pos.y,
+						(float) f0->pos.x, (float) f0->pos.y,
+						&(flow_vectors[flow_vector_size]));
 				flow_vector_size++;
-				free(f1->desc);
-				free(f1);
-				set_stack_at(last_stack, best_score_index, NULL);
+				matched[best_score_index] = 1;
 			}
 		}
-		while (last_stack->nb > 0) {
-			feature * f1;
-			pop_stack(last_stack, &f1);
-			if (f1 != NULL) {
-				free(f1->desc);
-				free(f1);
-			}
-		}
-		free(last_stack);
-		last_stack = current_stack;
-		if (flow_vector_size > 4) {
-			int nb_pop = hough_votes(flow_vectors, flow_vector_size,
-					&(speed->x), &(speed->y));
-			free(flow_vectors);
-			return nb_pop;
-		} else {
-			free(flow_vectors);
-			return 0;
-		}
-	} else {
-		free(flow_vectors);
-		last_stack = current_stack;
-		return 0; //exchange for the next frame
+	}
+	return flow_vector_size;
+}
+
+//features of the current frame become the keyframe ones
+void brief_set_keyframe() {
+	unsigned int i;
+	if (current_stack == NULL)
+		return;
+	for (i = 0; i < current_stack->nb; i++) {
+		float iu, iv;
+		feature * f;
+		get_stack_at(current_stack, i, &f);
+		undistort_radial(K, f->pos.x, f->pos.y, &iu, &iv, radial_undistort,
+				POLY_UNDISTORT_SIZE);
+		pixel_to_ground_plane(cam_ct, iu, iv, &(f->ground.x), &(f->ground.y));
+	}
+	if (keyframe_stack != NULL)
+		free_stack(keyframe_stack);
+	keyframe_stack = current_stack;
+	current_stack = NULL;
+}
+
+//ground points move by the last estimated speed, reproject them to predict
+//where roi features of the last frame will be found in the current frame
+void klt_ground_prediction(float x, float y, float * px, float * py) {
+	float iu, iv, gx, gy;
+	undistort_radial(K, x, y + first_line_to_sample, &iu, &iv,
+			radial_undistort, POLY_UNDISTORT_SIZE);
+	pixel_to_ground_plane(cam_ct, iu, iv, &gx, &gy);
+	ground_plane_to_pixel(cam_ct, gx - last_speed.x, gy - last_speed.y, px,
+			py);
+	distort_radial(K, (*px), (*py), px, py, radial_distort,
+			POLY_DISTORT_SIZE);
+	(*py) -= first_line_to_sample;
+}
+
+int klt_ground_flows(Mat & img, fxy * flow_vectors) {
+	PROFILE_SCOPE(PROFILE_KLT);
+	int i, nb_tracks;
+	klt_track tracks[KLT_MAX_FEATURES];
+	nb_tracks = klt_track_features(img.data + (first_line_to_sample * img.step),
+			img.step, tracks, KLT_MAX_FEATURES, klt_ground_prediction);
+#ifdef DEBUG
+	cout << "tracked " << nb_tracks << " features" << endl;
+#endif
+	for (i = 0; i < nb_tracks; i++) {
+		ground_flow(tracks[i].x0, tracks[i].y0 + first_line_to_sample,
+				tracks[i].x1, tracks[i].y1 + first_line_to_sample,
+				&(flow_vectors[i]));
+	}
+	return nb_tracks;
+}
+
+//phase correlation gives motion directly, its confidence is returned in percent
+int phase_ground_motion(Mat & img, fxy * displacement, float * yaw) {
+	PROFILE_SCOPE(PROFILE_PHASE);
+	float tx, ty, rotation;
+	float confidence = phase_correlation_motion(img, &tx, &ty, &rotation);
+#ifdef DEBUG
+	cout << "phase correlation confidence " << confidence << endl;
+#endif
+	if (confidence < PHASE_MIN_CONFIDENCE)
+		return 0;
+	displacement->x = tx;
+	displacement->y = ty;
+	(*yaw) = rotation;
+	return (int) (confidence * 100.) + 1;
+}
+
+int estimate_ground_speeds(Mat & img, fxy * speed) {
+	return estimate_ground_motion(img, speed, NULL);
+}
+
+void set_keyframe() {
+	switch (vo_engine) {
+	case VO_ENGINE_PHASE:
+		phase_set_keyframe();
+		break;
+	case VO_ENGINE_KLT:
+		klt_set_keyframe();
+		break;
+	case VO_ENGINE_BRIEF:
+	default:
+		brief_set_keyframe();
+		break;
+	}
+	has_keyframe = 1;
+	keyframe_displacement.x = 0.;
+	keyframe_displacement.y = 0.;
+	keyframe_yaw = 0.;
+}
+
+//Motion is measured from the keyframe to the current frame, the speed of a frame
+//is the difference between two successive measures so that estimation errors
+//do not add up while the keyframe is kept.
+//yaw is only estimated by the phase correlation engine, other engines leave it untouched
+int estimate_ground_motion(Mat & img, fxy * speed, float * yaw) {
+	PROFILE_SCOPE(PROFILE_ODOMETRY);
+	fxy flow_vectors[VO_MAX_FLOWS];
+	fxy displacement, predicted;
+	float rotation = 0.;
+	int flow_vector_size = 0;
+	int support = 0;
+	predicted.x = keyframe_displacement.x + last_speed.x;
+	predicted.y = keyframe_displacement.y + last_speed.y;
+	switch (vo_engine) {
+	case VO_ENGINE_PHASE:
+		support = phase_ground_motion(img, &displacement, &rotation);
+		break;
+	case VO_ENGINE_KLT:
+		flow_vector_size = klt_ground_flows(img, flow_vectors);
+		break;
+	case VO_ENGINE_BRIEF:
+	default:
+		flow_vector_size = brief_ground_flows(img, flow_vectors, &predicted);
+		break;
+	}
+	if (flow_vector_size > 4) {
+		PROFILE_SCOPE(PROFILE_VOTE);
+		support = hough_votes(flow_vectors, flow_vector_size, &(displacement.x),
+				&(displacement.y));
+	}
+	if (!has_keyframe) {
+		set_keyframe();
+		return 0;
+	}
+	if (support <= 4) {
+		//lost the keyframe, current frame is the new reference
+		set_keyframe();
+		return 0;
+	}
+	speed->x = displacement.x - keyframe_displacement.x;
+	speed->y = displacement.y - keyframe_displacement.y;
+	if (yaw != NULL && vo_engine == VO_ENGINE_PHASE)
+		(*yaw) = rotation - keyframe_yaw;
+	last_speed = (*speed);
+	keyframe_displacement = displacement;
+	keyframe_yaw = rotation;
+	//promote before overlap with the keyframe gets too small for the next frame
+	predicted.x = displacement.x + last_speed.x;
+	predicted.y = displacement.y + last_speed.y;
+	float max_distance = (vo_engine == VO_ENGINE_PHASE) ?
+	PHASE_KEYFRAME_MAX_MM : VO_KEYFRAME_MAX_DISTANCE;
+	if (!use_keyframes || support < VO_KEYFRAME_MIN_SUPPORT
+			|| sqrt(predicted.x * predicted.x + predicted.y * predicted.y)
+					> max_distance)
+		set_keyframe();
+	return support;
+}
+
+void set_visual_odometry_engine(int engine) {
+	vo_engine = engine;
+	//engines do not share state, restart from a fresh frame
+	if (keyframe_stack != NULL) {
+		free_stack(keyframe_stack);
+		keyframe_stack = NULL;
+	}
+	reset_klt_tracker();
+	reset_phase_correlation();
+	has_keyframe = 0;
+	last_speed.x = 0.;
+	last_speed.y = 0.;
+}
+
+//without keyframes every frame is matched against the previous one
+void set_visual_odometry_keyframes(int enable) {
+	use_keyframes = enable;
+}
+
+//mark the image rows read by the current engine
+void visual_odometry_rows(unsigned char * row_mask, unsigned int h) {
+	int v, first = first_line_to_sample, last = last_line_to_sample;
+	switch (vo_engine) {
+	case VO_ENGINE_PHASE:
+		phase_correlation_rows(row_mask, h);
+		return;
+	case VO_ENGINE_BRIEF:
+		//descriptors are computed around corners found on the band
+		first -= DESCRIPTOR_WINDOW / 2;
+		last += DESCRIPTOR_WINDOW / 2;
+		break;
+	default:
+		break;
+	}
+	for (v = first; v < last; v++) {
+		if (v >= 0 && v < (int) h)
+			row_mask[v] = 1;
 	}
 }
 
@@ -338,31 +552,50 @@ void init_visual_odometry() {
 	first_line_to_sample = (unsigned int) v;
 	ground_plane_to_pixel(cam_ct, 20., 0., &u, &v);
 	last_line_to_sample = (unsigned int) v;
+	init_klt_tracker(IMAGE_WIDTH, (last_line_to_sample - first_line_to_sample));
+	init_phase_correlation();
 }
 
+//run every engine over an image sequence to compare their timing and estimates
 int test_estimate_ground_speeds(int argc, char ** argv) {
 	if (argc < 3) {
-		printf("Requires image path \n");
+		printf("Requires at least two image paths \n");
 		exit(-1);
 	}
-	int success;
-	fxy speed;
+	int i, engine;
+	const char * engine_names[] = { "brief", "klt", "phase" };
 	init_visual_odometry();
-	Mat first_image, second_image;
-	first_image = imread(argv[1], IMREAD_GRAYSCALE);
-	second_image = imread(argv[2], IMREAD_GRAYSCALE);
-	estimate_ground_speeds(first_image, &speed);
-	tic
-	success = estimate_ground_speeds(second_image, &speed);
-	toc
-	if (success > 0) {
-		cout << success << ", " << speed.x << ", " << speed.y << endl;
-	} else {
-		cout << "Cannot estimate speed" << endl;
+	for (engine = 0; engine < 6; engine++) {
+		double total_time = 0., travelled_distance = 0.;
+		int nb_estimates = 0;
+		//each engine is run with keyframes, then frame to frame
+		set_visual_odometry_keyframes(engine < 3);
+		set_visual_odometry_engine(engine % 3);
+		for (i = 1; i < argc; i++) {
+			fxy speed;
+			float yaw = 0.;
+			Mat image = imread(argv[i], IMREAD_GRAYSCALE);
+			double tic_t = monotonic_time();
+			int success = estimate_ground_motion(image, &speed, &yaw);
+			if (i > 1)
+				total_time += monotonic_time() - tic_t;
+			if (success > 0) {
+				nb_estimates++;
+				travelled_distance += sqrt(pow(speed.x, 2) + pow(speed.y, 2));
+				cout << engine_names[engine % 3] << ", " << i << ", " << success
+						<< ", " << speed.x << ", " << speed.y << ", " << yaw
+						<< endl;
+			} else if (i > 1) {
+				cout << engine_names[engine % 3] << ", " << i
+						<< ", Cannot estimate speed" << endl;
+			}
+		}
+		cout << engine_names[engine % 3]
+				<< ((engine < 3) ? " keyframes" : " frame to frame") << " : "
+				<< (total_time / (argc - 2))
+				<< " seconds per frame, " << nb_estimates << "/" << (argc - 2)
+				<< " estimates, " << travelled_distance << " mm travelled"
+				<< endl;
 	}
-
-	imshow("first", first_image);
-	imshow("second", second_image);
-	waitKey(0);
 	return 0;
 }
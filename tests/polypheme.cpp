@@ -2,15 +2,24 @@
 #include <iostream>
 #include <fstream>
 #include <unistd.h>
+#include <string.h>
 #include <math.h>
-#include "opencv2/videoio/videoio.hpp"
 #include "opencv2/core/core.hpp"
 
 #include "detect_line.hpp"
 #include "visual_odometry.hpp"
 #include "navigation.hpp"
 #include "resampling.hpp"
-#include "HMC5883L.hpp"
+#include "compass.hpp"
+#include "pipeline.hpp"
+#include "frame_source.hpp"
+#include "telemetry.hpp"
+#include "profiler.hpp"
+#include "latency_histogram.hpp"
+#include "realtime.hpp"
+#include "estimator.hpp"
+#include "mpc.hpp"
+#include "speed_control.hpp"
 
 extern "C" {
 #include "servo_control.h"
@@ -19,311 +28,1219 @@ extern "C" {
 using namespace std;
 using namespace cv;
 
-#define tic      double tic_t = clock()
-#define toc      ((clock() - tic_t)/CLOCKS_PER_SEC)
+#define POLE_INPUT 17
+#define DISTANCE_TO_TRAVEL 130000.0
+unsigned char gray_rows[IMAGE_HEIGHT]; //rows read by the detectors
+int full_frame_conversion = 0;
 
+#define MIN_CONFIDENCE 0.30 //lines below are not steered on
+#define STEERING_MAX_CURVE_AGE 0.25 //s, the steering loop holds its command on older curves
+#define STEERING_COMMAND_RING 64 //loop commands waiting for the estimator, power of two
+#define ACTUATION_DELAY 0.030 //s, from the servo command to the wheels turning
+#define MODELED_PROCESSING_DELAY 0.010 //s, from capture to command in simulations and replays
 
+#define RESULT_SLOTS (2*RING_SIZE) //results are never overwritten while the consumer holds them
+#define NB_FRAME_CONSUMERS 2 //line detection and visual odometry
 
-#define POLE_INPUT 17
-#define DISTANCE_TO_TRAVEL 130000.0
-#ifdef PI_CAM
-#include "RaspiCamCV.h"
-
-RaspiCamCvCapture * capture;
-VideoCapture capture_from_file;
-int input_is_file = 0;
-
-int initCaptureFromCam() {
-	RASPIVID_CONFIG * config = (RASPIVID_CONFIG*)malloc(sizeof(RASPIVID_CONFIG));
-	RASPIVID_PROPERTIES * properties = (RASPIVID_PROPERTIES*)malloc(sizeof(RASPIVID_PROPERTIES));
-	config->width=IMAGE_WIDTH;
-	config->height=IMAGE_HEIGHT;
-	config->bitrate=0;      // zero: leave as default
-	config->framerate=FPS;
-	config->monochrome=0;
-	properties->hflip = HFLIP;
-	properties->vflip = VFLIP;
-	properties -> sharpness = 0;
-	properties -> contrast = 0;
-	properties -> brightness = 50;
-	properties -> saturation = 0;
-	properties -> exposure = AUTO;
-	properties -> shutter_speed = 0;// 0 is autoo
-	capture = (RaspiCamCvCapture *) raspiCamCvCreateCameraCapture3(0, config, properties, 1);
-	return 1;
+typedef struct line_result {
+	curve line;
+	float confidence;
+	point pts[NB_LINES_SAMPLED];
+	int nb_points;
+	unsigned int seq;
+	double timestamp; //capture time of the frame the line was detected on
+	int degraded; //tracked around the last line instead of searched in full
+} line_result;
+
+typedef struct vo_result {
+	fxy speed; //displacement since the last frame processed by visual odometry
+	float yaw; //rotation over the same frames in degrees, NAN when not estimated
+	int pop;
+	unsigned int seq;
+	double timestamp;
+} vo_result;
+
+//control state, only touched by the control stage
+double time_frame = 0;
+unsigned int fps = 0;
+int update = 0;
+int alive = 0;
+int frame_counter = -1;
+int old_state = 1;
+int rising_edge = 0, falling_edge = 0;
+int detect_line_timeout = 10;
+float current_speed = 0.;
+double travelled_distance = 0.;
+Mat map_image(320, 320, CV_8UC1, Scalar(255));
+short heading_buffer[3];
+unsigned int last_compass_count = 0;
+int heading_stale = 0; //the compass stopped answering, lap detection is paused
+double heading = 0., start_heading = 0.;
+int heading_timeout = 0, heading_state = 0;
+int arrival_detected = 0;
+fxy speed = { 0., 0. }; //ground speed in mm/s
+int speed_pop = 0;
+double last_vo_time = 0.;
+int has_vo_time = 0;
+double last_vo_speed_time = 0.; //last visual odometry result with a speed
+speed_controller speed_control;
+int speed_closed_loop = 1; //esc command from the measured speed, feed forward only otherwise
+float target_speed = 0.; //mm/s, planned
+float y_lookahead;
+nav_schedule steering_schedule; //lookahead and gain from the speed and confidence
+int mpc_enabled = 0; //model predictive steering instead of pure pursuit
+mpc_solver steering_mpc; //only touched by the thread running the steering law
+double control_now = 0.; //time the control step sends its command at, see control_time
+float last_steering = 0.; //only touched by the thread sending servo commands
+unsigned long nb_steering_laws = 0;
+double steering_law_busy = 0., steering_law_busy_max = 0.;
+speed_plan speed_planned; //last profile
+unsigned long nb_plans = 0;
+double plan_busy = 0., plan_busy_max = 0.;
+
+//benchmark counters
+double start_time = 0.;
+unsigned long nb_frames = 0;
+unsigned long nb_commands = 0;
+latency_histogram actuation_latency; //age of the frame when the servo is commanded
+float latency_p99 = 0.;
+
+//pipeline
+frame_pool frames;
+spsc_ring line_frames, vo_frames; //capture to workers
+spsc_ring line_out, vo_out; //workers to control
+line_result line_results[RESULT_SLOTS];
+vo_result vo_results[RESULT_SLOTS];
+stage_stats line_stage, vo_stage, control_stage;
+int pipelined = 1;
+
+//latency compensation, the curve is moved to the pose predicted when the command
+//reaches the wheels, from the capture time, the speed and the commands already sent
+int latency_compensation = 1;
+double actuation_delay = ACTUATION_DELAY;
+command_log steering_commands; //only touched by the thread sending servo commands
+unsigned long nb_compensated = 0;
+double compensated_horizon = 0., compensated_travel = 0., compensated_shift = 0.;
+
+//steering loop, published by the control step once per frame and read at each tick
+typedef struct steering_input {
+	curve line; //bot frame when the frame was captured
+	double timestamp; //capture time
+	float speed; //mm/s, for the latency compensation
+	float yaw_rate_bias; //degrees/s
+	float confidence;
+	float esc_speed;
+	int valid;
+} steering_input;
+
+double steering_rate = 0.; //Hz, 0 steers once per frame from the control step
+unsigned int steering_seq = 0;
+steering_input steering_shared, steering_published;
+float steering_sent = 0.; //last command of the loop
+int steering_running = 0;
+pthread_t steering_tid;
+unsigned long steering_ticks = 0, steering_held = 0;
+double steering_busy = 0., steering_busy_max = 0., steering_late_max = 0.;
+//age of the curve when the loop commands the servo, only touched by the steering
+//thread, merged into actuation_latency once it stopped
+latency_histogram steering_latency;
+float steering_latency_p99 = 0.; //published for the telemetry
+unsigned int steering_deadline_misses = 0;
+
+//every command of the loop goes to the estimator at the time it was sent, the
+//steering thread pushes, the control step drains
+typedef struct steering_command {
+	double t;
+	float angle;
+} steering_command;
+
+steering_command steering_command_ring[STEERING_COMMAND_RING];
+unsigned int steering_command_head = 0; //only written by the steering thread
+unsigned int steering_command_tail = 0; //only written by the control step
+unsigned long steering_commands_lost = 0;
+
+//frame policy, stale frames are dropped, the fast path tracks the last line
+frame_policy line_policy, vo_policy;
+curve tracked_line; //last line detected with enough confidence
+int has_tracked_line = 0;
+
+void print_benchmark() {
+	double elapsed = monotonic_time() - start_time;
+	cout << (pipelined ? "Pipelined" : "Sequential") << " loop : "
+			<< (nb_commands / elapsed) << " commands per second" << endl;
+	cout << "Acquisition moved "
+			<< (frame_source_bytes() / (nb_frames > 0 ? nb_frames : 1))
+			<< " bytes per frame, " << frame_source_dropped()
+			<< " frames dropped by the camera" << endl;
+	//the steering loop is stopped, its commands are counted with the others, it
+	//sends all of them when it runs
+	if (steering_latency.count > 0) {
+		if (actuation_latency.count == 0)
+			actuation_latency.deadline_us = steering_latency.deadline_us;
+		merge_latency_histogram(&actuation_latency, &steering_latency);
+	}
+	print_latency_histogram("Capture to servo latency", &actuation_latency);
+	print_frame_policy("line detection", &line_policy);
+	if (pipelined) {
+#ifdef VO
+		print_frame_policy("visual odometry", &vo_policy);
+#endif
+		print_stage_stats("line detection", &line_stage, elapsed);
+		print_stage_stats("visual odometry", &vo_stage, elapsed);
+		print_stage_stats("control", &control_stage, elapsed);
+		print_ring_stats("capture to line detection", &line_frames);
+		print_ring_stats("capture to visual odometry", &vo_frames);
+		print_ring_stats("line detection to control", &line_out);
+		print_ring_stats("visual odometry to control", &vo_out);
+	}
+	cout << "Capture waited " << frames.nb_stall
+			<< " times for a free frame buffer" << endl;
+	print_telemetry_stats();
+	print_compass_stats();
+	print_estimator_stats();
+	if (nb_steering_laws > 0)
+		printf("Steering law : %s, %lu commands, mean %.1f us, max %.1f us \n",
+				mpc_enabled ? "MPC" : "pure pursuit", nb_steering_laws,
+				1000000. * steering_law_busy / nb_steering_laws,
+				1000000. * steering_law_busy_max);
+	print_mpc_stats(&steering_mpc);
+	print_speed_controller_stats(&speed_control);
+	if (nb_plans > 0)
+		printf("Speed planner : %lu profiles of %d samples, mean %.1f us, max %.1f us \n",
+				nb_plans, PLAN_SAMPLES, 1000000. * plan_busy / nb_plans,
+				1000000. * plan_busy_max);
+	if (nb_compensated > 0)
+		printf("Latency compensation : %lu commands, %.1f ms ahead of capture and %.1f mm travelled on average, lookahead point moved by %.1f mm \n",
+				nb_compensated, 1000. * compensated_horizon / nb_compensated,
+				compensated_travel / nb_compensated,
+				compensated_shift / nb_compensated);
+	if (steering_ticks > 0)
+		printf("Steering loop : %lu ticks at %.0f Hz, %lu held on a stale curve, busy mean %.1f us, max %.1f us, late by %.1f us at most \n",
+				steering_ticks, steering_rate, steering_held,
+				1000000. * steering_busy / steering_ticks,
+				1000000. * steering_busy_max, 1000000. * steering_late_max);
+	if (steering_commands_lost > 0)
+		printf("Steering loop : %lu commands not handed to the estimator \n",
+				steering_commands_lost);
+	print_replay_stats();
+	print_simulator_report();
+	print_rt_report();
+	profile_report("polypheme_trace.json");
 }
-int initCaptureFromFile(char * path) {
-	if (!capture_from_file.open(path)) {
-		cout << "Capture from "<<path<<" didn't work" << endl;
-		return 0;
+
+void stop_steering_loop() {
+	if (!steering_running)
+		return;
+	__atomic_store_n(&steering_running, 0, __ATOMIC_RELEASE);
+	pthread_join(steering_tid, NULL);
+}
+
+void stop_robot() {
+	stop_steering_loop();
+	stop_compass_thread();
+	close_recording();
+	close_telemetry();
+	alive = 0;
+	set_esc_speed(0.);
+	set_servo_angle(0.);
+	close_servo();
+	print_benchmark();
+	sleep(2);
+	exit(0);
+}
+
+//displacements are integrated for every result, speed uses the time elapsed
+//between the two frames visual odometry processed
+void integrate_vo(vo_result * vo) {
+	double dt = 1. / FPS;
+	if (has_vo_time && vo->timestamp > last_vo_time)
+		dt = vo->timestamp - last_vo_time;
+	last_vo_time = vo->timestamp;
+	has_vo_time = 1;
+	speed_pop = vo->pop;
+	if (vo->pop > 0) {
+		last_vo_speed_time = vo->timestamp;
+		travelled_distance += sqrt(pow(vo->speed.x, 2) + pow(vo->speed.y, 2));
+		speed.x = vo->speed.x / dt;
+		speed.y = vo->speed.y / dt;
+		estimator_odometry(vo->timestamp, dt, vo->speed.x, vo->speed.y);
+		if (!isnan(vo->yaw))
+			estimator_yaw_rate(vo->timestamp - dt / 2., vo->yaw / dt,
+					EST_R_VO_YAW / dt);
+#ifdef DEBUG
+		cout << "speed " << speed.x << ", " << speed.y << endl;
+		cout << "Travelled distance : " << travelled_distance << " mm" << endl;
+#endif
 	}
-	input_is_file = 1;
-	return 1;
 }
 
-Mat getFrame() {
-	if(input_is_file) {
-		Mat img;
-		capture_from_file >> img;
-		return img;
-	} else {
-		int success = 0 ;
-		do {
-			success = raspiCamCvGrab(capture);
-			if(success == 0) usleep(500);
-		}while(success == 0);
-		IplImage* image = raspiCamCvRetrieve(capture);
-		Mat img = cvarrToMat(image);
-		/*Mat img(image->height, image->width, CV_8UC1, Scalar(0));
-		 for(i = 0 ; i < image->height ; i ++){
-		 memcpy(&(img.data[i*img.step]), &(image->imageData[i*image->widthStep]), image->width*image->nChannels);
-		 }*/
-		return img;
-	}}
+//return 1 when the compass thread published a new heading, readings are recorded
+//and replayed for the frame being processed, a stale heading is never returned.
+//New headings and the compass yaw rate go to the state estimator.
+int read_heading(unsigned int seq, double * h) {
+	PROFILE_SCOPE(PROFILE_COMPASS);
+	if (is_replaying() || is_simulating()) {
+		int ready = 1;
+		if (is_replaying()) {
+			ready = replay_compass_sample(seq, heading_buffer, h);
+		} else {
+			(*h) = sim_heading();
+			record_compass_sample(seq, heading_buffer, ready, *h);
+		}
+		if (ready)
+			estimator_heading(control_now, *h);
+		return ready;
+	}
+	compass_sample sample;
+	read_compass(&sample);
+	int stale = compass_stale(&sample);
+	if (stale != heading_stale) {
+		heading_stale = stale;
+		if (stale)
+			cout << "Compass heading stale, ignored until the compass answers" << endl;
+		else
+			cout << "Compass heading back" << endl;
+	}
+	int ready = !stale && sample.count != last_compass_count;
+	if (ready) {
+		last_compass_count = sample.count;
+		memcpy(heading_buffer, sample.mag, sizeof(heading_buffer));
+		(*h) = sample.heading;
+		estimator_heading(sample.timestamp, sample.heading);
+		estimator_yaw_rate(sample.timestamp, sample.yaw_rate, EST_R_YAW_RATE);
+	}
+	record_compass_sample(seq, heading_buffer, ready, *h);
+	return ready;
+}
+
+//pole switch edges, the level is recorded and replayed so that runs start and stop
+//on the same frames
+void read_pole_input(unsigned int seq) {
+	int level;
+	if (!is_replaying() || !replay_pole(seq, &level)) {
+#ifdef __arm__
+		if (is_simulating()) {
+			rising_edge = 1;
+			falling_edge = 0;
+			return;
+		}
+		level = gpioRead(POLE_INPUT);
+		record_pole(seq, level);
+#else
+		rising_edge = 1;
+		falling_edge = 0;
+		return;
+#endif
+	}
+	rising_edge = (old_state == 0) & (level == 1);
+	falling_edge = (old_state == 1) & (level == 0);
+	old_state = level;
+}
 
+int vo_running() {
+	return alive > 0 && frame_counter <= 0;
+}
+
+//esc command actually applied, the esc only runs with RUN or in the simulator
+float esc_sent() {
+#ifdef RUN
+	return current_speed;
 #else
+	return is_simulating() ? current_speed : 0.;
+#endif
+}
 
-VideoCapture capture;
+//ground speed for the latency compensation, measured by visual odometry until the
+//estimator runs
+void speed_for_compensation(float * v, float * yaw_rate_bias) {
+	estimate e;
+	if (get_estimate(&e)) {
+		(*v) = e.speed;
+		(*yaw_rate_bias) = e.yaw_rate_bias;
+	} else {
+		(*v) = speed.x;
+		(*yaw_rate_bias) = 0.;
+	}
+}
 
-int initCaptureFromCam() {
-	if (!capture.open(0)) {
-		cout << "Capture from camera #0 didn't work" << endl;
-		return 0;
+//curve seen from the pose the bot will have when a command sent at t turns the
+//wheels, the lookahead point is then taken in that frame
+void compensate_latency(curve * c, double capture, double t, float v,
+		float yaw_rate_bias, float lookahead, curve * moved) {
+	float dx, dy, dyaw, y, y_moved, speed_factor;
+	if (!latency_compensation) {
+		(*moved) = (*c);
+		return;
 	}
-	return 1;
+	predict_motion(&steering_commands, actuation_delay, capture,
+			t + actuation_delay, v, yaw_rate_bias, &dx, &dy, &dyaw);
+	propagate_curve(c, dx, dy, dyaw, moved);
+	steering_speed_from_curve(c, lookahead, &y, &speed_factor);
+	steering_speed_from_curve(moved, lookahead, &y_moved, &speed_factor);
+	nb_compensated++;
+	compensated_horizon += t + actuation_delay - capture;
+	compensated_travel += sqrt(dx * dx + dy * dy);
+	compensated_shift += fabs(y_moved - y);
 }
-int initCaptureFromFile(char * path) {
-	if (!capture.open(path)) {
-		cout << "Capture from " << path << " didn't work" << endl;
-		return 0;
+
+//servo command, logged for the latency compensation of the next ones
+void send_steering(double t, float angle) {
+	{
+		PROFILE_SCOPE(PROFILE_ACTUATION);
+		set_servo_angle(angle);
 	}
+	log_command(&steering_commands, t, angle);
+	last_steering = angle;
+}
+
+//servo command on the curve moved to actuation time, pure pursuit to the
+//lookahead point or the MPC over the whole curve
+float steering_law(curve * c, float v, float lookahead, float gain, double t,
+		float * y) {
+	float speed_factor, angle;
+	double start = monotonic_time();
+	float curvature = steering_speed_from_curve(c, lookahead, y, &speed_factor);
+	if (mpc_enabled)
+		angle = mpc_steering(&steering_mpc, c, v, last_steering, t);
+	else
+		angle = curvature * gain;
+	double busy = monotonic_time() - start;
+	nb_steering_laws++;
+	steering_law_busy += busy;
+	if (busy > steering_law_busy_max)
+		steering_law_busy_max = busy;
+	return angle;
+}
+
+//ground speed for the esc speed control at the capture time t, fused by the
+//estimator from visual odometry, return 0 when visual odometry gave no speed for
+//SPEED_MAX_AGE
+int measured_speed(double t, float * v) {
+	estimate e;
+	if (last_vo_speed_time <= 0. || t - last_vo_speed_time > SPEED_MAX_AGE)
+		return 0;
+	(*v) = get_estimate(&e) ? e.speed : speed.x;
 	return 1;
 }
 
-Mat getFrame() {
-	Mat img;
-	capture >> img;
-	return img;
+//hand the last confident curve and the latest speed estimate to the steering loop
+void publish_steering(line_result * l, int new_line) {
+	steering_input * in = &steering_published;
+	if (new_line) {
+		in->line = l->line;
+		in->timestamp = l->timestamp;
+		in->confidence = l->confidence;
+		in->valid = 1;
+	}
+	if (!in->valid)
+		return;
+	speed_for_compensation(&(in->speed), &(in->yaw_rate_bias));
+	in->esc_speed = current_speed;
+	seqlock_write(&steering_seq, &steering_shared, in, sizeof(steering_input));
 }
 
-#endif
+//called from the steering thread only, never blocks
+void push_steering_command(double t, float angle) {
+	unsigned int head = steering_command_head;
+	unsigned int tail = __atomic_load_n(&steering_command_tail, __ATOMIC_ACQUIRE);
+	if ((head - tail) >= STEERING_COMMAND_RING) {
+		steering_commands_lost++;
+		return;
+	}
+	steering_command * c = &(steering_command_ring[head & (STEERING_COMMAND_RING - 1)]);
+	c->t = t;
+	c->angle = angle;
+	__atomic_store_n(&steering_command_head, head + 1, __ATOMIC_RELEASE);
+}
 
-#define STEER_P -0.20
-#define SPEED_DEC 0.10
-#define ACC_FACTOR 0.1
-int main(int argc, char ** argv) {
-	double time_frame  = 0 ;
-	unsigned int fps = 0 ;
-	int update = 0;
-	int alive = 0;
-	int frame_counter = -1;
-	int old_state = 1;
-	int i;
-	int rising_edge = 0, falling_edge = 0;
-	int detect_line_timeout = 10;
-	int nb_points;
-	float current_speed = 0. ;
-	double travelled_distance = 0.;
-	Mat map_image(320, 320,
-	CV_8UC1, Scalar(255));
-	short heading_buffer[3];
-	double heading = 0., start_heading = 0.;
-	int heading_timeout = 0, heading_state = 0 ;
-	int arrival_detected = 0 ;
-	point pts[16];
-	curve line;
-	fxy speed;
-	speed.x = 0. ;
-	speed.y = 0. ;
-	float y_lookahead;
-	ofstream log_file;
-	log_file.open ("polypheme.log");
-	init_line_detector();
-#ifdef VO
-	init_visual_odometry();
-#endif
-	init_compass();
-/*#ifdef DEBUG
-	if(argc > 1) {
-		cout << "Need a path to video in testing" << endl;
-		exit(-1);
+//hand the commands sent by the loop since the last frame to the estimator, in
+//the order and at the time they were sent
+void drain_steering_commands() {
+	unsigned int tail = steering_command_tail;
+	unsigned int head = __atomic_load_n(&steering_command_head, __ATOMIC_ACQUIRE);
+	while (tail != head) {
+		steering_command * c = &(steering_command_ring[tail
+				& (STEERING_COMMAND_RING - 1)]);
+		estimator_command(c->t, c->angle, esc_sent());
+		tail++;
+		__atomic_store_n(&steering_command_tail, tail, __ATOMIC_RELEASE);
 	}
-	initCaptureFromFile(argv[1]);
-#else*/
-	initCaptureFromCam();
-//#endif
+}
 
-	init_servo();
-#ifdef __arm__
-	gpioSetMode(POLE_INPUT, PI_INPUT);
-	gpioSetPullUpDown(POLE_INPUT, PI_PUD_UP);
+//one steering tick at time t : the curve is moved to the pose predicted when the
+//command turns the wheels, then steered on as the control step does
+void steering_tick(double t) {
+	steering_input in;
+	curve moved;
+	float y, lookahead, gain;
+	double tic_t = monotonic_time();
+	seqlock_read(&steering_seq, &steering_shared, &in, sizeof(steering_input));
+	if (!in.valid)
+		return;
+	steering_ticks++;
+	if (t - in.timestamp > STEERING_MAX_CURVE_AGE) {
+		steering_held++;
+		return;
+	}
+	schedule_steering(&steering_schedule, in.speed, in.confidence, &lookahead,
+			&gain);
+	compensate_latency(&(in.line), in.timestamp, t, in.speed, in.yaw_rate_bias,
+			lookahead, &moved);
+	float angle = steering_law(&moved, in.speed, lookahead, gain, t, &y);
+	send_steering(t, angle);
+	if (is_simulating())
+		sim_actuate(angle, in.esc_speed);
+	__atomic_store(&steering_sent, &angle, __ATOMIC_RELEASE);
+	push_steering_command(t, angle);
+	record_latency(&steering_latency, t - in.timestamp);
+	//refreshed about once a second
+	if ((steering_latency.count % (unsigned long) fmax(1., steering_rate)) == 0) {
+		float p99 = latency_percentile(&steering_latency, 99.);
+		__atomic_store(&steering_latency_p99, &p99, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&steering_deadline_misses,
+			(unsigned int) steering_latency.nb_deadline_miss, __ATOMIC_RELEASE);
+	double busy = monotonic_time() - tic_t;
+	steering_busy += busy;
+	if (busy > steering_busy_max)
+		steering_busy_max = busy;
+}
+
+void * steering_thread(void * arg) {
+	struct timespec next;
+	long period = (long) (1000000000. / steering_rate);
+	PROFILE_THREAD("steering");
+	rt_enter_thread(RT_STEERING);
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (__atomic_load_n(&steering_running, __ATOMIC_ACQUIRE)) {
+		next.tv_nsec += period;
+		while (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		double late = monotonic_time() - (next.tv_sec + next.tv_nsec / 1000000000.);
+		if (late > steering_late_max)
+			steering_late_max = late;
+		steering_tick(frame_source_time());
+	}
+	return NULL;
+}
+
+//the simulator runs the ticks on its own clock, replays keep the commands of the
+//recording, one per frame
+void start_steering_loop() {
+	if (steering_rate <= 0.)
+		return;
+	if (is_replaying()) {
+		cout << "Replay steers once per frame, steering loop off" << endl;
+		steering_rate = 0.;
+		return;
+	}
+	if (is_simulating()) {
+		sim_set_tick(steering_tick, steering_rate);
+		return;
+	}
+	steering_running = 1;
+	if (pthread_create(&steering_tid, NULL, steering_thread, NULL) != 0) {
+		steering_running = 0;
+		steering_rate = 0.;
+		cout << "Cannot start the steering loop, steering once per frame" << endl;
+	}
+}
+
+//time the command computed from a frame is sent, the clock for the live camera,
+//the capture time plus a modeled processing delay in simulations and replays so
+//that how long the host takes does not change the commands
+double control_time(line_result * l) {
+	if (is_simulating() || is_replaying())
+		return l->timestamp + MODELED_PROCESSING_DELAY;
+	return frame_source_time();
+}
+
+//one iteration of the control loop, driven by line detection results
+void control_step(line_result * l) {
+	PROFILE_SCOPE(PROFILE_CONTROL);
+	control_now = control_time(l);
+	if (alive > 0) {
+		double tic_t = monotonic_time();
+		if (steering_rate > 0.)
+			drain_steering_commands();
+		estimator_predict(control_now);
+		if (frame_counter > 0) {
+			frame_counter--;
+			if (read_heading(l->seq, &start_heading)) {
+				heading_state = 0;
+//				cout << "Start heading "<< start_heading << endl ;
+			}
+			return;
+		} else {
+			float confidence = l->confidence;
+#ifdef DEBUG
+			cout << "Confidence " << confidence << endl;
 #endif
-	arm_esc();
-	set_servo_angle(0.0);
-	//alive = 1; //to be removed when not debugging
-	while (1) {
-		Mat img = getFrame();
-
-		if (alive > 0) {
-/*#ifdef DEBUG
-	imshow("view", img);
-	waitKey(1);
-#endif*/
-			tic ;
-			if (frame_counter > 0) {
-				frame_counter--;
-				if( HMC5883L_GetReadyStatus()){
-                                        start_heading = HMC5883L_GetHeading(heading_buffer);
-					heading_state = 0 ;
-//					cout << "Start heading "<< start_heading << endl ; 
-				}
-				continue;
+			if (confidence < MIN_CONFIDENCE) {
+				//should we consider updating the command when we have a low confidence in the curve estimate
+				if (detect_line_timeout > 0)
+					detect_line_timeout--;
+				update = 0;
 			} else {
-				float confidence = detect_line(gray_img, &line, pts, &nb_points);
+				detect_line_timeout = (FPS / 2);
+				update = 1;
 #ifdef DEBUG
-				cout << "Confidence " << confidence << endl;
+				int i;
+				memset(map_image.data, 255, map_image.step * map_image.rows);
+				for (i = 0; i < l->nb_points; i++) {
+					circle(map_image,
+							Point(l->pts[i].x,
+									(l->pts[i].y + map_image.cols / 2)), 1,
+							Scalar(0, 0, 0, 0), 4, 8, 0);
+				}
+				imshow("map", map_image);
+				waitKey(1);
 #endif
-				if (confidence < 0.30) {
-					//should we consider updating the command when we have a low confidence in the curve estimate
-					if(detect_line_timeout > 0) detect_line_timeout--;
-					update = 0;
-				} else {
-					detect_line_timeout = (FPS/2);
-					update = 1;					int i ;
-					float u, v ;
+			}
+			if (read_heading(l->seq, &heading)) {
+				double heading_distance = fabs(
+						wrap_heading(heading - start_heading));
 #ifdef DEBUG
-					memset(map_image.data, 255, map_image.step*map_image.rows);
-					for (i = 0; i < nb_points; i++) {
-					ground_plane_to_pixel(cam_ct, (double) pts[i].x, (double) pts[i].y, &u,&v);
-					circle(map_image, Point(pts[i].x, (pts[i].y + map_image.cols / 2)), 1,Scalar(0, 0, 0, 0), 4, 8, 0);
-					}
-					imshow("map", map_image);
-					waitKey(1);
+				/*cout << "Start heading " << start_heading << endl ;
+				 cout << "Current heading" << heading << endl ;*/
+				cout << "Heading distance " << heading_distance << endl;
 #endif
+				if (heading_state == 0 && heading_distance > 45.) {
+					heading_state = 1;
+					cout << "Away from start" << endl;
+				} else if (heading_distance < 10. && heading_state == 1) {
+					cout << "Back to start" << endl;
+					heading_timeout = FPS * 2;
+					heading_state = 2;
+				} else if (heading_distance < 15. && heading_state == 2
+						&& heading_timeout > 0) {
+					heading_timeout--;
 				}
-				//cout << "line detector used " << nb_points << endl;
-#ifdef VO
-				int speed_pop = estimate_ground_speeds(gray_img, &speed) ;
-				if (speed_pop > 0) {
+
+			}
+
+			telemetry_record record;
+			record.timestamp = l->timestamp;
+			record.seq = l->seq;
+			record.curve[0] = l->line.p[0];
+			record.curve[1] = l->line.p[1];
+			record.curve[2] = l->line.p[2];
+			record.min_x = l->line.min_x;
+			record.max_x = l->line.max_x;
+			record.confidence = confidence;
+			record.speed_x = speed.x;
+			record.speed_y = speed.y;
+			record.speed_pop = speed_pop;
+			record.heading = heading;
+			record.steering = 0.;
+			record.esc_speed = current_speed;
+			record.latency = 0.;
+			record.flags = l->degraded ? TELEMETRY_DEGRADED : 0;
+			record.target_speed = record.measured_speed = 0.;
+			estimate e;
+			if (get_estimate(&e)) {
+				record.est_x = e.x;
+				record.est_y = e.y;
+				record.est_heading = e.heading;
+				record.est_speed = e.speed;
+				record.est_position_std = sqrt(
+						e.covariance[EST_X][EST_X] + e.covariance[EST_Y][EST_Y]);
+				if (is_simulating())
+					sim_score_estimate(e.x, e.y, e.heading, e.speed);
+			} else {
+				record.est_x = record.est_y = record.est_heading = 0.;
+				record.est_speed = record.est_position_std = 0.;
+			}
+			if (heading_stale)
+				record.flags |= TELEMETRY_HEADING_STALE;
+			if (update == 1) {
+				float angle_from_steering;
+				curve moved;
+				if (steering_rate > 0.) {
+					//the steering loop owns the compensation, the steering law and
+					//the command log, the speed is planned on the curve it is handed
+					moved = l->line;
+					__atomic_load(&steering_sent, &angle_from_steering,
+							__ATOMIC_ACQUIRE);
+				} else {
+					float v, yaw_rate_bias, lookahead, gain;
+					speed_for_compensation(&v, &yaw_rate_bias);
+					//longer lookahead and softer gain as the speed grows
+					schedule_steering(&steering_schedule, v, confidence, &lookahead,
+							&gain);
+					compensate_latency(&(l->line), l->timestamp, control_now, v,
+							yaw_rate_bias, lookahead, &moved);
+					angle_from_steering = steering_law(&moved, v, lookahead, gain,
+							control_now, &y_lookahead);
+				}
+				//brake before the turns seen on the whole curve, the target ramps
+				//up from the last one
+				double plan_start = monotonic_time();
+				target_speed = plan_speed(&moved, target_speed, 1. / FPS,
+						&speed_planned);
+				double plan_time = monotonic_time() - plan_start;
+				plan_busy += plan_time;
+				if (plan_time > plan_busy_max)
+					plan_busy_max = plan_time;
+				nb_plans++;
+				//the esc tracks the target on the measured speed, whatever the
+				//battery charge, the nominal command alone in open loop
+				float v_measured = 0.;
+				int measured = measured_speed(l->timestamp, &v_measured);
+				current_speed = update_speed_controller(&speed_control,
+						l->timestamp, target_speed, v_measured, measured);
+				record.target_speed = target_speed;
+				record.measured_speed = measured ? v_measured : 0.;
+				if (!measured)
+					record.flags |= TELEMETRY_SPEED_DROPOUT;
 #ifdef DEBUG
-					cout << "speed " << speed.x << ", " << speed.y << endl;
+				cout << "speed :" << target_speed << endl;
+				cout << "steering :" << angle_from_steering << endl;
 #endif
-					travelled_distance += sqrt(
-							pow(speed.x, 2) + pow(speed.y, 2));
-					//TODO: use a kind of PID for the ESC control or map the robot position using integral of speed over time
-#ifdef DEBUG
-	cout << "Travelled distance : " << travelled_distance << " mm" << endl ;
+				{
+					PROFILE_SCOPE(PROFILE_ACTUATION);
+#ifdef	RUN
+					set_esc_speed(current_speed);
 #endif
 				}
+				//the steering loop sends the servo commands
+				if (steering_rate <= 0.)
+					send_steering(control_now, angle_from_steering);
+				if (is_simulating() && steering_rate <= 0.)
+					sim_actuate(angle_from_steering, current_speed);
+				record_actuation(l->seq, angle_from_steering, current_speed);
+				if (steering_rate <= 0.)
+					estimator_command(control_now, angle_from_steering,
+							esc_sent());
+				if (is_replaying())
+					replay_actuation(l->seq, angle_from_steering, current_speed);
+				record.esc_speed = current_speed;
+				nb_commands++;
+				//the steering loop records the age of the curves it steers on
+				if (steering_rate <= 0.) {
+					double latency = frame_source_time() - l->timestamp;
+					record.steering = angle_from_steering;
+					record.flags |= TELEMETRY_COMMAND_UPDATED;
+					record.latency = latency;
+					if (record_latency(&actuation_latency, latency))
+						record.flags |= TELEMETRY_DEADLINE_MISS;
+					if ((nb_commands % FPS) == 0)
+						latency_p99 = latency_percentile(&actuation_latency, 99.);
+				}
+			}
+			if (steering_rate > 0.) {
+				publish_steering(l, update);
+				__atomic_load(&steering_latency_p99, &latency_p99, __ATOMIC_ACQUIRE);
+				record.latency_p99 = latency_p99;
+				record.deadline_misses = __atomic_load_n(&steering_deadline_misses,
+						__ATOMIC_ACQUIRE);
+			} else {
+				record.latency_p99 = latency_p99;
+				record.deadline_misses = actuation_latency.nb_deadline_miss;
+			}
+			record.frames_dropped = line_policy.nb_dropped + vo_policy.nb_dropped;
+			record.frames_degraded = line_policy.nb_degraded;
+			telemetry_log(&record);
+
+#ifdef VO
+			arrival_detected = (travelled_distance >= DISTANCE_TO_TRAVEL) ? 1 : 0;
 #else
-				int speed_pop = 0 ;
-				speed.x = 0 ;
-				speed.y = 0 ;
-#endif
-	 			if( HMC5883L_GetReadyStatus()){
-                			heading = HMC5883L_GetHeading(heading_buffer);
-					double heading_distance = abs(heading - start_heading);
-#ifdef DEBUG
-					/*cout << "Start heading " << start_heading << endl ;
-					cout << "Current heading" << heading << endl ;*/
-					cout << "Heading distance " << heading_distance << endl ;
+			arrival_detected =
+					(heading_state == 2 && heading_timeout == 0) ? 1 : 0;
 #endif
-					if(heading_state == 0 && heading_distance > 45.){
-						 heading_state = 1;
-						cout << "Away from start" << endl ;
-					}else if(heading_distance < 10. && heading_state == 1){
-						cout << "Back to start" << endl;
-						heading_timeout = FPS * 2 ;
-						heading_state = 2 ;
-					} else if(heading_distance < 15. && heading_state == 2 && heading_timeout > 0){
-						heading_timeout -- ;
-					}
-
+			if (falling_edge == 1 || detect_line_timeout <= 0
+					|| arrival_detected > 0) {
+				if (detect_line_timeout <= 0) {
+					cout << "Line lost " << endl;
+				} else {
+					cout << "Arrival detected " << endl;
 				}
+				stop_robot();
+			}
+		}
+		time_frame = time_frame + (monotonic_time() - tic_t);
+		fps++;
+		if (time_frame > 1.0) {
+			time_frame = 0;
+			cout << fps << endl;
+			fps = 0;
+		}
+	} else {
+		if (rising_edge) {
+			alive = 1;
+			cout << "countdown to start " << endl;
+			frame_counter = 2 * FPS; //initialize a 2sec timeout before robot starts
+			travelled_distance = 0.;
+			init_estimator(); //the estimate starts here, from the next heading
+			init_speed_controller(&speed_control);
+			speed_control.open_loop = !speed_closed_loop;
+			target_speed = 0.;
+		}
+	}
+	read_pole_input(l->seq);
+}
 
+//full search, or tracking around the last good line on the fast path
+void run_line_detection(frame_slot * f, line_result * r, int decision) {
+	r->degraded = (decision == FRAME_DEGRADED) && has_tracked_line;
+	if (r->degraded)
+		r->line = tracked_line;
+	r->confidence = detect_line(f->img, &(r->line), r->pts, &(r->nb_points),
+			r->degraded);
+	if (r->confidence >= MIN_CONFIDENCE) {
+		tracked_line = r->line;
+		has_tracked_line = 1;
+	}
+}
 
-				log_file << line.p[0] << "; " << line.p[1] << "; " << line.p[2] << "; ";
-				log_file << line.min_x << "; " << line.max_x << "; " << confidence << "; ";
-				log_file << speed.x << "; " << speed.y << "; " << speed_pop <<"; "<< heading <<endl;
-				//imshow("img", img);
-				//waitKey(0);
-				if (update == 1) {
-					float speed_factor;
-					float steering = steering_speed_from_curve(&line, 150.0,
-							&y_lookahead, &speed_factor); //lookahead point should evolve with speed
-					float angle_from_steering = steering * STEER_P;
-					float speed_from_steering = 1.0
-							- (abs(angle_from_steering) * SPEED_DEC);
-					speed_from_steering *= speed_factor;
-					if(speed_from_steering > current_speed){
-						current_speed += (ACC_FACTOR * (speed_from_steering - current_speed));//limiting acceleration
-					}else{
-						current_speed = speed_from_steering ;
-					}
-
-					//TODO: apply command to servo and esc
-#ifdef DEBUG
-					cout << "speed factor:" << speed_factor << endl ;
-					cout << "speed :" << speed_from_steering << endl ;
-					cout << "steering :" << angle_from_steering << endl ;
+//capture, line detection, visual odometry and control run one after the other
+void run_sequential() {
+	line_result l;
+#ifdef VO
+	vo_result vo;
 #endif
-#ifdef	RUN
-					set_esc_speed(current_speed);
+	rt_enter_thread(RT_CONTROL);
+	while (1) {
+		frame_slot * f = acquire_frame(&frames, 1);
+		if (!frame_source_read(f)) {
+			cout << "End of input" << endl;
+			stop_robot();
+		}
+		nb_frames++;
+		int decision = frame_policy_decide(&line_policy,
+				frame_source_time() - f->timestamp);
+		if (decision == FRAME_DROP) {
+			release_frame(f);
+			continue;
+		}
+		l.timestamp = f->timestamp;
+		l.seq = f->seq;
+		l.degraded = 0;
+		if (vo_running()) {
+			run_line_detection(f, &l, decision);
+#ifdef VO
+			//the fast path skips odometry, the next displacement spans both frames
+			if (decision == FRAME_PROCESS) {
+				vo.yaw = NAN;
+				vo.pop = estimate_ground_motion(f->img, &(vo.speed), &(vo.yaw));
+				vo.seq = f->seq;
+				vo.timestamp = f->timestamp;
+				integrate_vo(&vo);
+			}
 #endif
-					set_servo_angle(angle_from_steering);
-				}
+		}
+		release_frame(f);
+		control_step(&l);
+		frame_policy_done(&line_policy, frame_source_time() - l.timestamp);
+	}
+}
 
-				/*
-				//foireux ...
-				Mat roi_rgb(img, Rect(Point(((IMAGE_WIDTH/2)-40) , (IMAGE_HEIGHT - 81)), Point(((IMAGE_WIDTH/2)+40), (IMAGE_HEIGHT - 1))));
-				cvtColor(roi_rgb, roi_hsv, COLOR_BGR2HSV);
-				//try to detect arrival line color ...
-				if()*/
+//touch every buffer the loop uses, in case memory could not be locked
+void prefault_pools() {
+	unsigned int i;
+	for (i = 0; i < PIPELINE_FRAMES; i++)
+		rt_prefault(frames.slots[i].img.data, frames.slots[i].img.total());
+	rt_prefault(line_results, sizeof(line_results));
+	rt_prefault(vo_results, sizeof(vo_results));
+	rt_prefault(&actuation_latency, sizeof(actuation_latency));
+	rt_prefault(&steering_latency, sizeof(steering_latency));
+}
+
+//push an end of input marker, waiting for room in the ring
+void push_end_of_input(spsc_ring * ring) {
+	while (!ring_push(ring, NULL))
+		usleep(1000);
+}
 
+void * capture_thread(void * arg) {
+	PROFILE_THREAD("capture");
+	rt_enter_thread(RT_CAPTURE);
+	while (1) {
+		frame_slot * slot = acquire_frame(&frames, NB_FRAME_CONSUMERS);
+		if (!frame_source_read(slot)) {
+			slot->refs = 0;
+			push_end_of_input(&line_frames);
+#ifdef VO
+			push_end_of_input(&vo_frames);
+#endif
+			return NULL;
+		}
+		nb_frames++;
+		if (!ring_push(&line_frames, slot))
+			release_frame(slot);
 #ifdef VO
-				arrival_detected = (travelled_distance >= DISTANCE_TO_TRAVEL) ? 1 : 0;
+		if (!ring_push(&vo_frames, slot))
+			release_frame(slot);
 #else
-				arrival_detected = (heading_state == 2 && heading_timeout == 0) ? 1 : 0 ;
+		release_frame(slot);
 #endif
-				if (falling_edge == 1 || detect_line_timeout <= 0 || arrival_detected > 0){
-					if(detect_line_timeout <= 0){
-						cout << "Line lost " << endl;
-					}else{
-						cout << "Arrival detected " << endl;
-					}
-					log_file.close();
-					alive = 0;
-					set_esc_speed(0.);
-					set_servo_angle(0.);
-					close_servo();
-					sleep(2);
-					exit(0);
-				}
-			}
-			time_frame = time_frame + toc ;
-			fps ++ ;
-			if(time_frame > 1.0){
-				time_frame = 0 ;
-				cout << fps << endl ;
-				fps = 0 ;
+	}
+	return NULL;
+}
+
+//sleep until frames are available, drain the ring and keep the freshest frame,
+//older ones are released unprocessed, return NULL at end of input
+frame_slot * wait_freshest_frame(spsc_ring * ring, stage_stats * stats) {
+	frame_slot * slot = NULL;
+	void * item;
+	ring_wait(ring);
+	while (ring_pop(ring, &item)) {
+		if (slot != NULL) {
+			release_frame(slot);
+			stats->nb_skipped++;
+		}
+		slot = (frame_slot *) item;
+		if (slot == NULL)
+			break;
+	}
+	return slot;
+}
+
+void * line_thread(void * arg) {
+	unsigned int n = 0;
+	PROFILE_THREAD("line detection");
+	rt_enter_thread(RT_LINE);
+	while (1) {
+		frame_slot * f = wait_freshest_frame(&line_frames, &line_stage);
+		if (f == NULL) {
+			push_end_of_input(&line_out);
+			return NULL;
+		}
+		int decision = frame_policy_decide(&line_policy,
+				frame_source_time() - f->timestamp);
+		if (decision == FRAME_DROP) {
+			release_frame(f);
+			continue;
+		}
+		double tic_t = monotonic_time();
+		line_result * r = &(line_results[n % RESULT_SLOTS]);
+		run_line_detection(f, r, decision);
+		r->seq = f->seq;
+		r->timestamp = f->timestamp;
+		release_frame(f);
+		line_stage.busy_time += monotonic_time() - tic_t;
+		line_stage.nb_processed++;
+		if (ring_push(&line_out, r))
+			n++;
+		frame_policy_done(&line_policy, frame_source_time() - r->timestamp);
+	}
+	return NULL;
+}
+
+#ifdef VO
+void * vo_thread(void * arg) {
+	unsigned int n = 0;
+	PROFILE_THREAD("odometry");
+	rt_enter_thread(RT_ODOMETRY);
+	while (1) {
+		frame_slot * f = wait_freshest_frame(&vo_frames, &vo_stage);
+		if (f == NULL)
+			return NULL;
+		//odometry has no cheaper path, late frames are skipped
+		if (frame_policy_decide(&vo_policy, frame_source_time() - f->timestamp)
+				!= FRAME_PROCESS) {
+			release_frame(f);
+			continue;
+		}
+		double tic_t = monotonic_time();
+		vo_result * r = &(vo_results[n % RESULT_SLOTS]);
+		r->yaw = NAN;
+		r->pop = estimate_ground_motion(f->img, &(r->speed), &(r->yaw));
+		r->seq = f->seq;
+		r->timestamp = f->timestamp;
+		release_frame(f);
+		vo_stage.busy_time += monotonic_time() - tic_t;
+		vo_stage.nb_processed++;
+		if (ring_push(&vo_out, r))
+			n++;
+		frame_policy_done(&vo_policy, frame_source_time() - r->timestamp);
+	}
+	return NULL;
+}
+#endif
+
+//control consumes the freshest line result, every odometry result is integrated
+void run_pipelined() {
+	pthread_t capture_tid, line_tid;
+	init_ring(&line_frames);
+	init_ring(&vo_frames);
+	init_ring(&line_out);
+	init_ring(&vo_out);
+	rt_enter_thread(RT_CONTROL);
+	pthread_create(&capture_tid, NULL, capture_thread, NULL);
+	pthread_create(&line_tid, NULL, line_thread, NULL);
+#ifdef VO
+	pthread_t vo_tid;
+	pthread_create(&vo_tid, NULL, vo_thread, NULL);
+#endif
+	while (1) {
+		line_result * l = NULL;
+		int end_of_input = 0;
+		void * item;
+		ring_wait(&line_out);
+		while (ring_pop(&line_out, &item)) {
+			if (item == NULL) {
+				end_of_input = 1;
+				break;
 			}
-		} else {
-			if (rising_edge) {
-				alive = 1;
-				cout << "countdown to start " << endl;
-				frame_counter = 2*FPS; //initialize a 2sec timeout before robot starts
-				travelled_distance = 0.;
+			if (l != NULL)
+				control_stage.nb_skipped++;
+			l = (line_result *) item;
+		}
+#ifdef VO
+		while (ring_pop(&vo_out, &item)) {
+			if (item == NULL)
+				continue;
+			if (vo_running()) {
+				integrate_vo((vo_result *) item);
+			} else {
+				last_vo_time = ((vo_result *) item)->timestamp;
+				has_vo_time = 1;
 			}
 		}
-#ifdef __arm__
-		//cout << gpioRead(POLE_INPUT) << endl ;
-		rising_edge = (old_state == 0) & (gpioRead(POLE_INPUT) == 1);
-		falling_edge = (old_state == 1) & (gpioRead(POLE_INPUT) == 0);
-		old_state = gpioRead(POLE_INPUT);
+#endif
+		if (l != NULL) {
+			double tic_t = monotonic_time();
+			control_step(l);
+			control_stage.busy_time += monotonic_time() - tic_t;
+			control_stage.nb_processed++;
+		}
+		if (end_of_input) {
+			cout << "End of input" << endl;
+			stop_robot();
+		}
+	}
+}
+
+int main(int argc, char ** argv) {
+	int opt;
+#ifdef VO
+	int vo_engine = VO_ENGINE_BRIEF;
+#endif
+	char * input_path = NULL, * record_path = NULL, * replay_path = NULL;
+	char * track_path = NULL;
+	int replay_realtime = 1;
+	double sim_delay = SIM_DEFAULT_DELAY;
+	int degraded_path = 0;
+	int drdy_gpio = -1;
+	const char * calibration_path = MAG_CALIBRATION_FILE;
+	double compensation_delay = -1.;
+	const char * schedule_path = NAV_SCHEDULE_FILE;
+	double esc_gain = 1.;
+	while ((opt = getopt(argc, argv, "v:sfi:R:p:xS:D:r:dg:m:c:a:nL:MOB:")) != -1) {
+		switch (opt) {
+		case 'v':
+#ifndef VO
+			cout << "Visual odometry not compiled in, build with -DVO" << endl;
+			exit(-1);
 #else
-		rising_edge = 1;
-		falling_edge = 0;
+			if (strcmp(optarg, "klt") == 0) {
+				vo_engine = VO_ENGINE_KLT;
+			} else if (strcmp(optarg, "brief") == 0) {
+				vo_engine = VO_ENGINE_BRIEF;
+			} else if (strcmp(optarg, "phase") == 0) {
+				vo_engine = VO_ENGINE_PHASE;
+			} else {
+				cout << "Unknown visual odometry engine " << optarg << endl;
+				exit(-1);
+			}
+			break;
+#endif
+		case 's':
+			pipelined = 0;
+			break;
+		case 'f':
+			full_frame_conversion = 1;
+			break;
+		case 'i':
+			input_path = optarg;
+			break;
+		case 'R':
+			record_path = optarg;
+			break;
+		case 'p':
+			replay_path = optarg;
+			break;
+		case 'x':
+			replay_realtime = 0;
+			break;
+		case 'S':
+			track_path = optarg;
+			break;
+		case 'D':
+			sim_delay = atof(optarg) / 1000.;
+			break;
+		case 'd':
+			degraded_path = 1;
+			break;
+		case 'g':
+			drdy_gpio = atoi(optarg);
+			break;
+		case 'm':
+			calibration_path = optarg;
+			break;
+		case 'c':
+			steering_rate = atof(optarg);
+			break;
+		case 'a':
+			compensation_delay = atof(optarg) / 1000.;
+			break;
+		case 'n':
+			latency_compensation = 0;
+			break;
+		case 'L':
+			schedule_path = optarg;
+			break;
+		case 'M':
+			mpc_enabled = 1;
+			break;
+		case 'O':
+			speed_closed_loop = 0;
+			break;
+		case 'B':
+			esc_gain = atof(optarg);
+			break;
+		case 'r':
+			if (!set_rt_profile(optarg)) {
+				cout << "Bad real-time profile " << optarg << endl;
+				exit(-1);
+			}
+			break;
+		default:
+			cout << "Usage : " << argv[0]
+					<< " [-v brief|klt|phase] [-s] [-f] [-i video] [-R recording] [-p recording [-x]] [-S track|oval [-D delay_ms] [-B esc_gain]] [-r default|role=prio[@cpu],...] [-d] [-g gpio] [-m calibration] [-c rate] [-a delay_ms] [-n] [-L schedule] [-M] [-O]"
+					<< endl;
+			cout << "	-s : run all stages sequentially in a single thread"
+					<< endl;
+			cout << "	-f : convert whole color frames to gray" << endl;
+			cout << "	-i : read frames from a video file" << endl;
+			cout << "	-R : record frames, compass, pole switch and commands"
+					<< endl;
+			cout << "	-p : replay a recording sequentially, in real time or"
+					<< " as fast as possible with -x" << endl;
+			cout << "	-S : drive a simulated robot on a track file or the default"
+					<< " oval, -D sets the capture to actuation delay, -B the"
+					<< " fraction of the nominal speed the esc reaches" << endl;
+			cout << "	-r : run capture, control, line and odometry threads"
+					<< " SCHED_FIFO pinned to cores, memory locked" << endl;
+			cout << "	-d : after a frame overran its deadline, track the last"
+					<< " line and skip odometry on the next one" << endl;
+			cout << "	-g : read the compass on edges of the GPIO wired to DRDY"
+					<< endl;
+			cout << "	-m : compass calibration written by test_compass calibrate,"
+					<< " " << MAG_CALIBRATION_FILE << " by default" << endl;
+			cout << "	-c : steer at this rate in Hz (200) on the last curve moved"
+					<< " by the estimated motion, instead of once per frame" << endl;
+			cout << "	-a : servo command to wheels delay compensated, "
+					<< (1000. * ACTUATION_DELAY)
+					<< " ms by default, with -S the simulated one less the "
+					<< (1000. * MODELED_PROCESSING_DELAY)
+					<< " ms modeled from capture to command" << endl;
+			cout << "	-n : steer on the curve as captured, no latency compensation"
+					<< endl;
+			cout << "	-L : lookahead and steering gain schedule written by"
+					<< " tune_navigation.sh, " << NAV_SCHEDULE_FILE << " by default"
+					<< endl;
+			cout << "	-M : steer with the model predictive controller instead of"
+					<< " pure pursuit" << endl;
+			cout << "	-O : open loop esc, the nominal command for the planned speed"
+					<< " without the measured speed, always without -DVO" << endl;
+			exit(-1);
+		}
+	}
+#ifndef VO
+	//the ground speed is only measured by visual odometry
+	if (speed_closed_loop) {
+		cout << "Esc speed control needs visual odometry, build with -DVO,"
+				<< " feed forward only" << endl;
+		speed_closed_loop = 0;
+	}
 #endif
+	init_telemetry("polypheme.tlm");
+	init_line_detector();
+#ifdef VO
+	init_visual_odometry();
+	set_visual_odometry_engine(vo_engine);
+#endif
+	memset(gray_rows, 0, IMAGE_HEIGHT);
+	line_detector_rows(gray_rows, IMAGE_HEIGHT);
+#ifdef VO
+	visual_odometry_rows(gray_rows, IMAGE_HEIGHT);
+#endif
+	if (replay_path != NULL) {
+		//every frame goes through every stage in order, so that a recording
+		//always produces the same commands
+		if (!init_frame_source_replay(replay_path, replay_realtime))
+			exit(-1);
+		pipelined = 0;
+	} else if (track_path != NULL) {
+		//the simulation advances a frame period per frame read, stages run in order
+		if (!init_frame_source_simulator(track_path, sim_delay))
+			exit(-1);
+		pipelined = 0;
+		//the simulated delay runs from capture, the command is sent after the
+		//modeled processing
+		actuation_delay = fmax(0., sim_delay - MODELED_PROCESSING_DELAY);
+		sim_set_esc_gain(esc_gain);
+	} else {
+		if (!start_compass_thread(drdy_gpio, calibration_path))
+			exit(-1);
+		if (input_path != NULL) {
+			if (!init_frame_source_file(input_path))
+				exit(-1);
+		} else {
+			init_frame_source_camera();
+		}
 	}
+	//recorded frames are whole so that they can be replayed with other detectors
+	set_frame_source_rows(
+			(full_frame_conversion || record_path != NULL) ? NULL : gray_rows);
+	if (record_path != NULL
+			&& !init_recording(record_path, IMAGE_WIDTH, IMAGE_HEIGHT))
+		exit(-1);
+	if (record_path != NULL || replay_path != NULL || track_path != NULL)
+		set_line_detector_seed(0);
 
+	if (compensation_delay >= 0.)
+		actuation_delay = compensation_delay;
+	init_command_log(&steering_commands);
+	init_mpc(&steering_mpc);
+	if (!load_nav_schedule(schedule_path, &steering_schedule))
+		cout << "No steering schedule in " << schedule_path
+				<< ", default lookahead and gain" << endl;
+	init_frame_pool(&frames, IMAGE_WIDTH, IMAGE_HEIGHT);
+	init_latency_histogram(&actuation_latency, 1. / FPS);
+	//a tick steers on the last curve, a frame period old at most when none is late
+	init_latency_histogram(&steering_latency, 2. / FPS);
+	//recordings and simulations process every frame so that runs are repeatable
+	int live = (replay_path == NULL && track_path == NULL);
+	init_frame_policy(&line_policy, live, degraded_path, 1. / FPS,
+			FRAME_MAX_AGE_PERIODS / FPS);
+	init_frame_policy(&vo_policy, live, degraded_path, 1. / FPS,
+			FRAME_MAX_AGE_PERIODS / FPS);
+	if (rt_profile_enabled()) {
+		//no page fault once armed
+		rt_lock_memory();
+		prefault_pools();
+		rt_jitter_probe();
+	}
+	init_servo();
+#ifdef __arm__
+	gpioSetMode(POLE_INPUT, PI_INPUT);
+	gpioSetPullUpDown(POLE_INPUT, PI_PUD_UP);
+#endif
+	arm_esc();
+	set_servo_angle(0.0);
+	//alive = 1; //to be removed when not debugging
+	start_time = monotonic_time();
+	start_steering_loop();
+	PROFILE_THREAD(pipelined ? "control" : "main");
+	if (pipelined) {
+		run_pipelined();
+	} else {
+		run_sequential();
+	}
 }
@@ -0,0 +1,24 @@
+#include <stdio.h>
+#include "telemetry.hpp"
+
+int main(int argc, char ** argv) {
+	if (argc < 2) {
+		printf("Usage : %s polypheme.tlm [out.csv] \n", argv[0]);
+		return -1;
+	}
+	FILE * out = stdout;
+	if (argc > 2) {
+		out = fopen(argv[2], "w");
+		if (out == NULL) {
+			perror(argv[2]);
+			return -1;
+		}
+	}
+	int n = telemetry_to_csv(argv[1], out);
+	if (out != stdout)
+		fclose(out);
+	if (n < 0)
+		return -1;
+	fprintf(stderr, "%d records decoded \n", n);
+	return 0;
+}
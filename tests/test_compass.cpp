@@ -0,0 +1,8 @@
+#include "HMC5883L.hpp"
+#include "compass.hpp"
+
+int main(int argc, char ** argv){
+	if (argc > 1 && strcmp(argv[1], "calibrate") == 0)
+		return test_compass_calibration(argc - 1, argv + 1);
+	return test_hmc5883l(argc, argv);
+}
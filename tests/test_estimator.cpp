@@ -0,0 +1,5 @@
+#include "estimator.hpp"
+
+int main(int argc, char ** argv){
+	return test_estimator(argc, argv);
+}
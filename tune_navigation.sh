@@ -0,0 +1,73 @@
+#!/bin/bash
+# Sweep lookahead and steering gain schedules in the simulator, report lap time and
+# cross track error of each and write the best one.
+# usage : ./tune_navigation.sh [oval|track file|recording.tlm] [schedule file]
+# A telemetry log is turned into a track from its estimated positions, so that the
+# schedules are tried on the shape of a recorded run.
+# The lookahead grows linearly with the speed from LOOKAHEADS at rest by TIME_GAPS
+# seconds of travel, the gain goes from NAV_GAIN at rest to each of GAINS at full
+# speed. The best run minimizes lap time + CTE_WEIGHT * cross track rms.
+
+TRACK=${1:-oval}
+OUTPUT=${2:-navigation_schedule.txt}
+LOOKAHEADS=${LOOKAHEADS:-"100 150 200"}
+TIME_GAPS=${TIME_GAPS:-"0 0.05 0.1"}
+GAINS=${GAINS:-"-0.20 -0.15"}
+REST_GAIN=${REST_GAIN:--0.20}
+FULL_SPEED=${FULL_SPEED:-2500}
+DELAY_MS=${DELAY_MS:-40}
+CTE_WEIGHT=${CTE_WEIGHT:-0.05} # seconds of lap time worth a mm of rms error
+
+BIN=$(pwd)/polypheme
+WORK=$(mktemp -d)
+if [ ! -x ${BIN} ]; then
+	echo "Build polypheme first : make polypheme"
+	exit 1
+fi
+
+if [[ ${TRACK} == *.tlm ]]; then
+	./telemetry_to_csv ${TRACK} ${WORK}/run.csv > /dev/null || exit 1
+	# est_x and est_y, a point every 5 records, before the estimator starts they are 0
+	awk -F';' 'NR > 1 && ($24 != 0 || $25 != 0) && (n++ % 5) == 0 { print $24, $25 }' \
+		${WORK}/run.csv > ${WORK}/track.txt
+	TRACK=${WORK}/track.txt
+elif [ ${TRACK} != "oval" ]; then
+	TRACK=$(readlink -f ${TRACK})
+fi
+
+BEST_COST=""
+printf "%10s %8s %8s %10s %12s\n" "lookahead" "gap s" "gain" "lap s" "cte rms mm"
+for L in ${LOOKAHEADS}; do
+	for T in ${TIME_GAPS}; do
+		for G in ${GAINS}; do
+			SCHEDULE=${WORK}/schedule_${L}_${T}_${G}.txt
+			echo "speed 0 ${L} ${REST_GAIN}" > ${SCHEDULE}
+			echo "speed ${FULL_SPEED} $(awk "BEGIN { print ${L} + ${FULL_SPEED} * ${T} }") ${G}" >> ${SCHEDULE}
+			echo "confidence 0.30 1.000 1.000" >> ${SCHEDULE}
+			OUT=$(cd ${WORK} && ${BIN} -S ${TRACK} -D ${DELAY_MS} -L ${SCHEDULE} 2> /dev/null)
+			LAP=$(echo "${OUT}" | awk '/^\tlap 1 :/ { print $4 }')
+			CTE=$(echo "${OUT}" | awk '/^Cross track error/ { print $9 }')
+			if [ -z "${LAP}" ] || echo "${OUT}" | grep -q "Line lost"; then
+				printf "%10s %8s %8s %10s %12s\n" ${L} ${T} ${G} "-" "${CTE:--}"
+				continue
+			fi
+			printf "%10s %8s %8s %10s %12s\n" ${L} ${T} ${G} ${LAP} ${CTE}
+			COST=$(awk "BEGIN { print ${LAP} + ${CTE_WEIGHT} * ${CTE} }")
+			if [ -z "${BEST_COST}" ] || awk "BEGIN { exit !(${COST} < ${BEST_COST}) }"; then
+				BEST_COST=${COST}
+				BEST=${SCHEDULE}
+			fi
+		done
+	done
+done
+
+if [ -z "${BEST_COST}" ]; then
+	echo "No schedule completed a lap"
+	rm -rf ${WORK}
+	exit 1
+fi
+echo "# tuned by tune_navigation.sh on ${1:-oval}" > ${OUTPUT}
+cat ${BEST} >> ${OUTPUT}
+echo "Best schedule written to ${OUTPUT} :"
+cat ${BEST}
+rm -rf ${WORK}